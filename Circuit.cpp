@@ -15,37 +15,142 @@ void FastSim::add_valve(CircuitElementValve& valve, PressureAdjacent adj)
     valves.push_back(FastSimValve(valve, adj));
 }
 
-SaveObject* CircuitElement::save()
+void CircuitElement::save(SaveWriter& writer)
 {
-    SaveObjectMap* omap = new SaveObjectMap;
-    omap->add_num("type", get_type());
-    save(omap);
-    return omap;
+    writer.begin_map();
+    save_fields(writer);
+    writer.num(SAVE_KEY_TYPE, get_type());
+    writer.end_map();
 }
 
 CircuitElement* CircuitElement::load(SaveObject* obj, unsigned version, bool read_only)
 {
-    if (obj->is_num())
+    SaveTreeReader reader(obj);
+    return load(reader, version, read_only);
+}
+
+static void read_icon_rows(SaveReader& reader, std::vector<std::vector<int64_t>>& rows)
+{
+    reader.begin_list();
+    while (reader.next_item())
     {
+        rows.emplace_back();
+        reader.begin_list();
+        while (reader.next_item())
+            rows.back().push_back(reader.read_num());
+    }
+}
+
+// The type is the last key of an element, so everything an element might
+// need is collected first and the element is built once the map is done.
+
+CircuitElement* CircuitElement::load(SaveReader& reader, unsigned version, bool read_only)
+{
+    if (reader.peek() == SAVE_READER_NUM)
+    {
+        reader.read_num();
         return new CircuitElementEmpty();
     }
-    SaveObjectMap* omap = obj->get_map();
-    CircuitElementType type = CircuitElementType(omap->get_num("type"));
-    switch (type)
+    int64_t type = 0;
+    int64_t connections = 0;
+    int64_t direction = 0;
+    int64_t level_index = 0;
+    Circuit* circuit = NULL;
+    std::string name;
+    bool has_name = false;
+    std::vector<std::vector<int64_t>> icon_bg;
+    std::vector<std::vector<int64_t>> icon;
+
+    SaveKey key;
+    reader.begin_map();
+    while (reader.next_key(key))
+    {
+        switch (key)
+        {
+            case SAVE_KEY_TYPE:
+                type = reader.read_num();
+                break;
+            case SAVE_KEY_CONNECTIONS:
+                connections = reader.read_num();
+                break;
+            case SAVE_KEY_DIRECTION:
+                direction = reader.read_num();
+                break;
+            case SAVE_KEY_LEVEL_INDEX:
+                level_index = reader.read_num();
+                break;
+            case SAVE_KEY_READ_ONLY:
+                reader.skip();
+                read_only = true;
+                break;
+            case SAVE_KEY_CIRCUIT:
+                delete circuit;
+                circuit = new Circuit(reader, version);
+                break;
+            case SAVE_KEY_NAME:
+                name = reader.read_string();
+                has_name = true;
+                break;
+            case SAVE_KEY_ICON_BG:
+                read_icon_rows(reader, icon_bg);
+                break;
+            case SAVE_KEY_ICON:
+                read_icon_rows(reader, icon);
+                break;
+            default:
+                reader.skip();
+        }
+    }
+    if (type != CIRCUIT_ELEMENT_TYPE_SUBCIRCUIT)
+        delete circuit;
+
+    switch (CircuitElementType(type))
     {
         case CIRCUIT_ELEMENT_TYPE_PIPE:
-            if (omap->get_num("connections") == 0)
-                return new CircuitElementEmpty(omap);
+            if (connections == 0)
+                return new CircuitElementEmpty();
             else
-                return new CircuitElementPipe(omap);
+                return new CircuitElementPipe(Connections(connections));
         case CIRCUIT_ELEMENT_TYPE_VALVE:
-            return new CircuitElementValve(omap);
+            return new CircuitElementValve(DirFlip(direction));
         case CIRCUIT_ELEMENT_TYPE_SOURCE:
-            return new CircuitElementSource(omap);
+            return new CircuitElementSource(Direction(direction));
         case CIRCUIT_ELEMENT_TYPE_SUBCIRCUIT:
-            return new CircuitElementSubCircuit(omap, version, read_only);
+        {
+            CircuitElementSubCircuit* sub = new CircuitElementSubCircuit(Direction(direction), version_reindex_level(version, Direction(level_index)), circuit, read_only);
+            if (!circuit)
+                return sub;
+            if ((sub->level_index == -2) && has_name)
+                sub->name = name;
+
+            for (unsigned y = 0; y < 24; y++)
+                for (unsigned x = 0; x < 24*8; x++)
+                    sub->icon_pixels[y][x] = 8;
+
+            for (unsigned y = 0; y < icon_bg.size() && y < 24; y++)
+            {
+                for (unsigned x = 0; x < icon_bg[y].size() && x < 24; x++)
+                {
+                    for (int i = 0; i < 8; i++)
+                    {
+                        XYPos pos = DirFlip(i).trans(XYPos(x,y), 24);
+                        sub->icon_pixels[pos.y][pos.x + i * 24] = icon_bg[y][x];
+                    }
+                }
+            }
+            for (unsigned y = 0; y < icon.size() && y < 24; y++)
+            {
+                for (unsigned x = 0; x < icon[y].size() && x < 24*8; x++)
+                {
+                    uint8_t colour = icon[y][x];
+                    if (colour != 8)
+                        sub->icon_pixels[y][x] = colour;
+                }
+            }
+            return sub;
+        }
         case CIRCUIT_ELEMENT_TYPE_EMPTY:
-            return new CircuitElementEmpty(omap);
+            return new CircuitElementEmpty();
         default:
             assert(0);        
     }
@@ -93,14 +198,9 @@ static Connections bitmap_to_con(unsigned bit)
     }
 }
 
-CircuitElementPipe::CircuitElementPipe(SaveObjectMap* omap)
-{
-    connections = Connections(omap->get_num("connections"));
-}
-
-void CircuitElementPipe::save(SaveObjectMap* omap)
+void CircuitElementPipe::save_fields(SaveWriter& writer)
 {
-    omap->add_num("connections", connections);
+    writer.num(SAVE_KEY_CONNECTIONS, connections);
 }
 
 uint16_t CircuitElementPipe::get_desc()
@@ -412,14 +512,9 @@ unsigned CircuitElementPipe::get_cost()
 }
 
 
-CircuitElementValve::CircuitElementValve(SaveObjectMap* omap)
+void CircuitElementValve::save_fields(SaveWriter& writer)
 {
-    dir_flip = DirFlip(omap->get_num("direction"));
-}
-
-void CircuitElementValve::save(SaveObjectMap* omap)
-{
-    omap->add_num("direction", dir_flip.as_int());
+    writer.num(SAVE_KEY_DIRECTION, dir_flip.as_int());
 }
 
 uint16_t CircuitElementValve::get_desc()
@@ -517,14 +612,9 @@ void CircuitElementValve::sim(PressureAdjacent adj)
     adj.E.move(mov);
 }
 
-CircuitElementSource::CircuitElementSource(SaveObjectMap* omap)
-{
-    direction = Direction(omap->get_num("direction"));
-}
-
-void CircuitElementSource::save(SaveObjectMap* omap)
+void CircuitElementSource::save_fields(SaveWriter& writer)
 {
-    omap->add_num("direction", direction);
+    writer.num(SAVE_KEY_DIRECTION, direction);
 }
 
 uint16_t CircuitElementSource::get_desc()
@@ -548,16 +638,12 @@ void CircuitElementSource::sim_prep(PressureAdjacent adj_, FastSim& fast_sim)
     fast_sim.add_source(adj.N);
 }
 
-CircuitElementEmpty::CircuitElementEmpty(SaveObjectMap* omap)
-{
-}
-
 // SaveObject* CircuitElementEmpty::save()
 // {
 //     return new SaveObjectNumber(0);
 // }
 
-void CircuitElementEmpty::save(SaveObjectMap* omap)
+void CircuitElementEmpty::save_fields(SaveWriter& writer)
 {
 }
 
@@ -589,57 +675,13 @@ CircuitElementSubCircuit::CircuitElementSubCircuit(DirFlip dir_flip_, int level_
     elaborate(level_set);
 }
 
-CircuitElementSubCircuit::CircuitElementSubCircuit(SaveObjectMap* omap, unsigned version, bool read_only_):
+CircuitElementSubCircuit::CircuitElementSubCircuit(DirFlip dir_flip_, int level_index_, Circuit* circuit_, bool read_only_):
+    dir_flip(dir_flip_),
+    level_index(level_index_),
+    circuit(circuit_),
     read_only(read_only_)
 {
-    dir_flip = Direction(omap->get_num("direction"));
-    level_index = version_reindex_level(version, Direction(omap->get_num("level_index")));
-    level = NULL;
-    circuit = NULL;
-    if (omap->has_key("read_only"))
-        read_only = true;
-    if (omap->has_key("circuit"))
-    {
-        circuit = new Circuit(omap->get_item("circuit")->get_map(), version);
-        custom = true;
-        if ((level_index == -2) && omap->has_key("name"))
-            name = omap->get_string("name");
-
-        for (unsigned y = 0; y < 24; y++)
-            for (unsigned x = 0; x < 24*8; x++)
-                icon_pixels[y][x] = 8;
-
-        if (omap->has_key("icon_bg"))
-        {
-            SaveObjectList* icon_list_y = omap->get_item("icon_bg")->get_list();
-            for (unsigned y = 0; y < icon_list_y->get_count() && y < 24; y++)
-            {
-                SaveObjectList* icon_list_x = icon_list_y->get_item(y)->get_list();
-                for (unsigned x = 0; x < icon_list_x->get_count() && x < 24; x++)
-                {
-                    for (int i = 0; i < 8; i++)
-                    {
-                        XYPos pos = DirFlip(i).trans(XYPos(x,y), 24);
-                        icon_pixels[pos.y][pos.x + i * 24] = icon_list_x->get_num(x);
-                    }
-                }
-            }
-        }
-        if (omap->has_key("icon"))
-        {
-            SaveObjectList* icon_list_y = omap->get_item("icon")->get_list();
-            for (unsigned y = 0; y < icon_list_y->get_count() && y < 24; y++)
-            {
-                SaveObjectList* icon_list_x = icon_list_y->get_item(y)->get_list();
-                for (unsigned x = 0; x < icon_list_x->get_count() && x < 24*8; x++)
-                {
-                    uint8_t colour = icon_list_x->get_num(x);
-                    if (colour != 8)
-                        icon_pixels[y][x] = colour;
-                }
-            }
-        }
-    }
+    custom = circuit != NULL;
 }
 
 CircuitElementSubCircuit::CircuitElementSubCircuit(CircuitElementSubCircuit& other)
@@ -658,63 +700,79 @@ CircuitElementSubCircuit::CircuitElementSubCircuit(CircuitElementSubCircuit& oth
             icon_pixels[y][x] = other.icon_pixels[y][x];
 }
 
-void CircuitElementSubCircuit::save(SaveObjectMap* omap)
+void CircuitElementSubCircuit::save_fields(SaveWriter& writer)
 {
-    omap->add_num("direction", dir_flip.as_int());
-    omap->add_num("level_index", level_index);
     if (custom)
     {
-        omap->add_item("circuit", circuit->save());
-        if (level_index == -2)
-        {
-            omap->add_string("name", name);
+        writer.key(SAVE_KEY_CIRCUIT);
+        circuit->save(writer);
+    }
+    writer.num(SAVE_KEY_DIRECTION, dir_flip.as_int());
+    if (custom && level_index == -2)
+        save_icon_pixels(writer, icon_pixels);
+    writer.num(SAVE_KEY_LEVEL_INDEX, level_index);
+    if (custom && level_index == -2)
+        writer.string(SAVE_KEY_NAME, name);
+}
 
-            uint8_t base_pixels[24][24];
+// Icons are stored as the pixels shared by all eight orientations, then the
+// pixels of each orientation that differ from them.  Rows lose their
+// trailing 8s (transparent).
 
-            SaveObjectList* y_list = new SaveObjectList;
-            for (unsigned y = 0; y < 24; y++)
+void save_icon_pixels(SaveWriter& writer, PixelData& icon_pixels)
+{
+    uint8_t base_pixels[24][24];
+    for (unsigned y = 0; y < 24; y++)
+    {
+        for (unsigned x = 0; x < 24; x++)
+        {
+            int colour = icon_pixels[y][x];
+            for (int i = 0; i < 8; i++)
             {
-                SaveObjectList* x_list = new SaveObjectList;
-                for (unsigned x = 0; x < 24; x++)
+                XYPos npos = DirFlip(i).trans(XYPos(x,y), 24);
+                if (colour != icon_pixels[npos.y][npos.x + i * 24])
                 {
-                    int colour = icon_pixels[y][x];
-                    for (int i = 0; i < 8; i++)
-                    {
-                        XYPos npos = DirFlip(i).trans(XYPos(x,y), 24);
-                        if (colour != icon_pixels[npos.y][npos.x + i * 24])
-                        {
-                            colour = 8;
-                            break;
-                        }
-                    }
-                    base_pixels[y][x] = colour;
-                    x_list->add_num(colour);
+                    colour = 8;
+                    break;
                 }
-                while (x_list->get_count() && x_list->get_num(x_list->get_count() - 1) == 8)
-                    x_list->pop_back();
-                y_list->add_item(x_list);
             }
-            omap->add_item("icon_bg", y_list);
+            base_pixels[y][x] = colour;
+        }
+    }
 
-            y_list = new SaveObjectList;
-            for (unsigned y = 0; y < 24; y++)
-            {
-                SaveObjectList* x_list = new SaveObjectList;
-                for (unsigned x = 0; x < 24*8; x++)
-                {
-                    XYPos npos = DirFlip(x / 24).trans_inv(XYPos(x%24,y), 24);
-                    if (base_pixels[npos.y][npos.x] != icon_pixels[y][x])
-                        x_list->add_num(icon_pixels[y][x]);
-                    else
-                        x_list->add_num(8);
-                }
-                while (x_list->get_count() && x_list->get_num(x_list->get_count() - 1) == 8)
-                    x_list->pop_back();
-                y_list->add_item(x_list);
-            }
-            omap->add_item("icon", y_list);
+    writer.key(SAVE_KEY_ICON);
+    writer.begin_list();
+    for (unsigned y = 0; y < 24; y++)
+    {
+        uint8_t row[24*8];
+        unsigned length = 0;
+        for (unsigned x = 0; x < 24*8; x++)
+        {
+            XYPos npos = DirFlip(x / 24).trans_inv(XYPos(x%24,y), 24);
+            row[x] = (base_pixels[npos.y][npos.x] != icon_pixels[y][x]) ? icon_pixels[y][x] : 8;
+            if (row[x] != 8)
+                length = x + 1;
         }
+        writer.begin_ints();
+        for (unsigned x = 0; x < length; x++)
+            writer.num(row[x]);
+        writer.end_list();
+    }
+    writer.end_list();
+
+    writer.key(SAVE_KEY_ICON_BG);
+    writer.begin_list();
+    for (unsigned y = 0; y < 24; y++)
+    {
+        unsigned length = 24;
+        while (length && base_pixels[y][length - 1] == 8)
+            length--;
+        writer.begin_ints();
+        for (unsigned x = 0; x < length; x++)
+            writer.num(base_pixels[y][x]);
+        writer.end_list();
     }
+    writer.end_list();
 }
 
 uint16_t CircuitElementSubCircuit::get_desc()
@@ -922,22 +980,61 @@ Sign::Sign(XYPos pos_, Direction direction_, std::string text_):
 
 Sign::Sign(SaveObject* sobj)
 {
-    SaveObjectMap* omap = sobj->get_map();
-    omap->get_string("text", text);
-    omap->get_num("pos.x", pos.x);
-    omap->get_num("pos.y", pos.y);
-    direction = Direction(omap->get_num("direction"));
-    
+    SaveTreeReader reader(sobj);
+    load(reader);
 }
 
-SaveObject*  Sign::save()
+Sign::Sign(SaveReader& reader)
 {
-    SaveObjectMap* omap = new SaveObjectMap;
-    omap->add_string("text", text);
-    omap->add_num("pos.x", pos.x);
-    omap->add_num("pos.y", pos.y);
-    omap->add_num("direction", direction);
-    return omap;
+    load(reader);
+}
+
+void Sign::load(SaveReader& reader)
+{
+    bool has_text = false;
+    bool has_x = false;
+    bool has_y = false;
+    direction = DIRECTION_N;
+    std::string_view key;
+    reader.begin_map();
+    while (reader.next_key(key))
+    {
+        if (key == "text")
+        {
+            text = reader.read_string();
+            has_text = true;
+        }
+        else if (key == "pos.x")
+        {
+            pos.x = reader.read_num();
+            has_x = true;
+        }
+        else if (key == "pos.y")
+        {
+            pos.y = reader.read_num();
+            has_y = true;
+        }
+        else if (key == "direction")
+        {
+            direction = Direction(reader.read_num());
+        }
+        else
+        {
+            reader.skip();
+        }
+    }
+    if (!has_text || !has_x || !has_y)
+        throw(std::runtime_error("Bad map key"));
+}
+
+void Sign::save(SaveWriter& writer)
+{
+    writer.begin_map();
+    writer.num(SAVE_KEY_DIRECTION, direction);
+    writer.num("pos.x", pos.x);
+    writer.num("pos.y", pos.y);
+    writer.string(SAVE_KEY_TEXT, text);
+    writer.end_map();
 }
 
 XYPos Sign::get_size()
@@ -994,29 +1091,71 @@ void Sign::flip(bool vertically)
 
 Circuit::Circuit(SaveObjectMap* omap, unsigned version)
 {
-    SaveObjectList* slist_y = omap->get_item("elements")->get_list();
+    SaveTreeReader reader(omap);
+    load(reader, version);
+}
+
+Circuit::Circuit(SaveReader& reader, unsigned version)
+{
+    load(reader, version);
+}
+
+void Circuit::load(SaveReader& reader, unsigned version)
+{
     XYPos pos;
     for (pos.y = 0; pos.y < 9; pos.y++)
-    {
-        SaveObjectList* slist_x = slist_y->get_item(pos.y)->get_list();
         for (pos.x = 0; pos.x < 9; pos.x++)
+            elements[pos.y][pos.x] = NULL;
+
+    bool has_elements = false;
+    SaveKey key;
+    reader.begin_map();
+    while (reader.next_key(key))
+    {
+        if (key == SAVE_KEY_ELEMENTS)
         {
-            if (pos.x < slist_x->get_count())
-                elements[pos.y][pos.x] = CircuitElement::load(slist_x->get_item(pos.x), version);
-            else
-                elements[pos.y][pos.x] = new CircuitElementEmpty();
+            has_elements = true;
+            pos.y = 0;
+            reader.begin_list();
+            while (reader.next_item())
+            {
+                if (pos.y >= 9)
+                {
+                    reader.skip();
+                    continue;
+                }
+                pos.x = 0;
+                reader.begin_list();
+                while (reader.next_item())
+                {
+                    if (pos.x < 9)
+                        elements[pos.y][pos.x++] = CircuitElement::load(reader, version);
+                    else
+                        reader.skip();
+                }
+                pos.y++;
+            }
+            if (pos.y < 9)
+                throw(std::runtime_error("Bad list index"));
         }
-    }
-    if (omap->has_key("signs"))
-    {
-        SaveObjectList* slist = omap->get_item("signs")->get_list();
-        for (unsigned i = 0; i < slist->get_count(); i++)
+        else if (key == SAVE_KEY_SIGNS)
+        {
+            reader.begin_list();
+            while (reader.next_item())
+                signs.push_back(Sign(reader));
+        }
+        else
         {
-            signs.push_back(Sign(slist->get_item(i)));
+            reader.skip();
         }
     }
+    if (!has_elements)
+        throw(std::runtime_error("Bad map key"));
 
-    
+    for (pos.y = 0; pos.y < 9; pos.y++)
+        for (pos.x = 0; pos.x < 9; pos.x++)
+            if (!elements[pos.y][pos.x])
+                elements[pos.y][pos.x] = new CircuitElementEmpty();
 }
 
 Circuit::Circuit()
@@ -1057,14 +1196,21 @@ Circuit::~Circuit()
 
 SaveObject* Circuit::save()
 {
-    SaveObjectMap* omap = new SaveObjectMap;
-    
-    SaveObjectList* slist_y = new SaveObjectList;
+    SaveTreeWriter writer;
+    save(writer);
+    return writer.take();
+}
+
+void Circuit::save(SaveWriter& writer)
+{
+    writer.begin_map();
+    writer.key(SAVE_KEY_ELEMENTS);
+    writer.begin_list();
     XYPos pos;
     
     for (pos.y = 0; pos.y < 9; pos.y++)
     {
-        SaveObjectList* slist_x = new SaveObjectList;
+        writer.begin_list();
         for (pos.x = 0; pos.x < 9; pos.x++)
         {
             int x = pos.x;
@@ -1081,25 +1227,25 @@ SaveObject* Circuit::save()
             if (is_blocked(pos))
             {
                 CircuitElementEmpty tmp;
-                slist_x->add_item(((CircuitElement*)(&tmp))->save());
+                tmp.save(writer);
             }
             else
             {
-                slist_x->add_item(elements[pos.y][pos.x]->save());
+                elements[pos.y][pos.x]->save(writer);
             }
         }
-        slist_y->add_item(slist_x);
+        writer.end_list();
     }
-    omap->add_item("elements", slist_y);
+    writer.end_list();
     
-    SaveObjectList* slist = new SaveObjectList;
+    writer.key(SAVE_KEY_SIGNS);
+    writer.begin_list();
     for (Sign &sign : signs)
     {
-        slist->add_item(sign.save());
+        sign.save(writer);
     }
-    omap->add_item("signs", slist);
-
-    return omap;
+    writer.end_list();
+    writer.end_map();
 }
 
 void Circuit::copy_elements(Circuit& other)
@@ -1797,24 +1943,24 @@ unsigned Circuit::get_cost()
     return cost;
 }
 
-SaveObjectList* Circuit::save_forced()
+void Circuit::save_forced(SaveWriter& writer)
 {
-    SaveObjectList* slist = new SaveObjectList;
+    writer.begin_list();
     XYPos pos;
     for (pos.y = 0; pos.y < 9; pos.y++)
     for (pos.x = 0; pos.x < 9; pos.x++)
     {
         if (is_blocked(pos))
         {
-            SaveObjectMap* omap = new SaveObjectMap;
-            omap->add_num("x", pos.x);
-            omap->add_num("y", pos.y);
-            omap->add_item("element", elements[pos.y][pos.x]->save());
-            slist->add_item(omap);
-
+            writer.begin_map();
+            writer.key(SAVE_KEY_ELEMENT);
+            elements[pos.y][pos.x]->save(writer);
+            writer.num(SAVE_KEY_X, pos.x);
+            writer.num(SAVE_KEY_Y, pos.y);
+            writer.end_map();
         }
     }
-    return slist;
+    writer.end_list();
 }
 
 void Circuit::copy_in(Circuit* other)
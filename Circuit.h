@@ -350,9 +350,10 @@ typedef uint8_t PixelData[24][24*8];
 class CircuitElement
 {
 public:
-    SaveObject* save(void);
-    virtual void save(SaveObjectMap*) = 0;
+    void save(SaveWriter& writer);
+    virtual void save_fields(SaveWriter& writer) = 0;
     static CircuitElement* load(SaveObject*, unsigned version, bool read_only = false);
+    static CircuitElement* load(SaveReader& reader, unsigned version, bool read_only = false);
     virtual CircuitElement* copy() = 0;
     virtual ~CircuitElement(){}
 
@@ -399,9 +400,8 @@ public:
     CircuitElementPipe(Connections connections_):
         connections(connections_)
         {}
-    CircuitElementPipe(SaveObjectMap*);
 
-    void save(SaveObjectMap*);
+    void save_fields(SaveWriter& writer);
     virtual uint16_t get_desc();
     virtual CircuitElement* copy() { return new CircuitElementPipe(connections);}
     unsigned getconnections(void);
@@ -433,9 +433,8 @@ public:
     CircuitElementValve(DirFlip dir_flip_):
         dir_flip(dir_flip_)
         {}
-    CircuitElementValve(SaveObjectMap*);
 
-    void save(SaveObjectMap*);
+    void save_fields(SaveWriter& writer);
     virtual uint16_t get_desc();
     virtual CircuitElement* copy() { return new CircuitElementValve(dir_flip);}
     void reset();
@@ -463,9 +462,8 @@ public:
     CircuitElementSource(Direction direction_):
         direction(direction_)
         {}
-    CircuitElementSource(SaveObjectMap*);
 
-    void save(SaveObjectMap*);
+    void save_fields(SaveWriter& writer);
     virtual uint16_t get_desc();
     virtual CircuitElement* copy() { return new CircuitElementSource(direction);}
     unsigned getconnections(void);
@@ -482,10 +480,9 @@ class CircuitElementEmpty : public CircuitElement
 {
 public:
     CircuitElementEmpty(){}
-    CircuitElementEmpty(SaveObjectMap*);
 
 //    SaveObject* save();
-    void save(SaveObjectMap*);
+    void save_fields(SaveWriter& writer);
     virtual uint16_t get_desc();
     virtual CircuitElement* copy() { return new CircuitElementEmpty();}
     unsigned getconnections(void) {return 0;};
@@ -513,11 +510,11 @@ public:
     WrappedTexture* texture = NULL;
 
     CircuitElementSubCircuit(DirFlip dir_flip_, int level_index_, LevelSet* level_set, bool read_only_ = false);
-    CircuitElementSubCircuit(SaveObjectMap*, unsigned version, bool read_only_ = false);
+    CircuitElementSubCircuit(DirFlip dir_flip_, int level_index_, Circuit* circuit_, bool read_only_);
     CircuitElementSubCircuit(CircuitElementSubCircuit& other);
     ~CircuitElementSubCircuit();
 
-    void save(SaveObjectMap*);
+    void save_fields(SaveWriter& writer);
     virtual uint16_t get_desc();
     virtual CircuitElement* copy();
     void reset();
@@ -545,6 +542,8 @@ public:
     virtual void reindex_deleted_level(LevelSet* level_set, int level_index);
 };
 
+void save_icon_pixels(SaveWriter& writer, PixelData& icon_pixels);
+
 class Sign
 {
 public:
@@ -555,7 +554,9 @@ public:
     Sign(){};
     Sign(XYPos pos_, Direction direction_, std::string text);
     Sign(SaveObject* omap);
-    SaveObject*  save();
+    Sign(SaveReader& reader);
+    void load(SaveReader& reader);
+    void save(SaveWriter& writer);
     XYPos get_size();
     void set_size(XYPos size);
     XYPos get_pos();
@@ -601,11 +602,14 @@ public:
     Pressure last_moved = 0;
 
     Circuit(SaveObjectMap* omap, unsigned version);
+    Circuit(SaveReader& reader, unsigned version);
     Circuit(Circuit& other);
     Circuit();
     ~Circuit();
 
+    void load(SaveReader& reader, unsigned version);
     SaveObject* save(void);
+    void save(SaveWriter& writer);
     void copy_elements(Circuit& other);
 
 
@@ -647,7 +651,7 @@ public:
     unsigned get_cost();
     void reset_steam_used() {fast_sim.reset_steam_used();}
     int64_t get_steam_used() {return fast_sim.get_steam_used();}
-    SaveObjectList* save_forced();
+    void save_forced(SaveWriter& writer);
     void copy_in(Circuit* other);
     void reindex_deleted_level(LevelSet* level_set, int level_index);
     void set_custom(bool recurse = false);
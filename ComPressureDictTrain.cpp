@@ -0,0 +1,266 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <stdexcept>
+
+#include <zstd.h>
+#include <zdict.h>
+
+#include "Compress.h"
+#include "SaveState.h"
+#include "Level.h"
+
+// Trains a zstd dictionary for Compress.cpp.  The samples are the payloads
+// that actually get compressed: designs as the server stores them (text)
+// and as the game sends them (binary), taken from the built-in help designs
+// and from any game saves, server db.save files or paste dumps given on the
+// command line.  The result is written out as a C array ready to be added to
+// compress_dictionaries.
+
+class TrainConfig
+{
+public:
+    std::string out;
+    size_t size = 16384;
+    unsigned id = 0;
+    int level = 19;
+    std::vector<std::string> files;
+};
+
+static TrainConfig config;
+
+class SampleSet
+{
+public:
+    std::string data;
+    std::vector<size_t> sizes;
+
+    void add(const std::string& sample)
+    {
+        if (sample.empty())
+            return;
+        data += sample;
+        sizes.push_back(sample.size());
+    }
+    void add_design(SaveObject* design)
+    {
+        add(design->to_string());
+        add(design->to_binary());
+    }
+};
+
+// Designs show up in three shapes: compressed strings keyed "design" in
+// db.save and paste dumps, and best_design or saved_designs in game saves,
+// which are level lists, with a null for each empty saved design slot.
+
+static void collect(SaveObject* sobj, SampleSet& samples)
+{
+    if (sobj->is_list())
+    {
+        SaveObjectList* slist = sobj->get_list();
+        for (unsigned i = 0; i < slist->get_count(); i++)
+            collect(slist->get_item(i), samples);
+        return;
+    }
+    if (!sobj->is_map())
+        return;
+    SaveObjectMap* omap = sobj->get_map();
+    for (SaveObjectMap::Map::iterator it = omap->omap.begin(); it != omap->omap.end(); ++it)
+    {
+        std::string_view key = it->key;
+        SaveObject* value = it->value;
+        if (key == "design" && value->is_string())
+        {
+            try
+            {
+                samples.add(decompress_string(value->get_string()));
+            }
+            catch (const std::runtime_error& error)
+            {
+            }
+        }
+        else if (key == "best_design" && value->is_list())
+        {
+            samples.add_design(value);
+        }
+        else if (key == "saved_designs" && value->is_list())
+        {
+            SaveObjectList* slist = value->get_list();
+            for (unsigned i = 0; i < slist->get_count(); i++)
+                if (slist->get_item(i)->is_list())
+                    samples.add_design(slist->get_item(i));
+        }
+        else
+        {
+            collect(value, samples);
+        }
+    }
+}
+
+static void usage()
+{
+    printf("usage: ComPressureDictTrain [options] [FILE...]\n"
+           "  --out FILE         write the dictionary as a C array (dictionary_ID.inc)\n"
+           "  --size N           dictionary size in bytes (16384)\n"
+           "  --id N             dictionary ID (one after the current one)\n"
+           "  --level N          zstd level used to compare ratios (19)\n"
+           "  FILE               game save, db.save or paste dump to take samples from\n");
+}
+
+// IDs below 32768 and from 2^31 up are reserved by zstd.
+
+static unsigned next_dictionary_id()
+{
+    unsigned current = compress_dictionary_id();
+    if (current >= 32768 && current < 0x7FFFFFFF)
+        return current + 1;
+    return 32768;
+}
+
+static size_t compressed_size(SampleSet& samples, const void* dict, size_t dict_size)
+{
+    ZSTD_CCtx* cctx = ZSTD_createCCtx();
+    ZSTD_CDict* cdict = ZSTD_createCDict(dict, dict_size, config.level);
+    std::string out;
+    size_t total = 0;
+    size_t pos = 0;
+    for (size_t size : samples.sizes)
+    {
+        out.resize(ZSTD_compressBound(size));
+        size_t got = ZSTD_compress_usingCDict(cctx, &out[0], out.size(), samples.data.data() + pos, size, cdict);
+        if (ZSTD_isError(got))
+            throw(std::runtime_error("ZSTD failed"));
+        total += got;
+        pos += size;
+    }
+    ZSTD_freeCDict(cdict);
+    ZSTD_freeCCtx(cctx);
+    return total;
+}
+
+static void write_dictionary(const std::string& dict)
+{
+    std::ofstream outfile(config.out);
+    if (outfile.fail())
+        throw(std::runtime_error("could not write " + config.out));
+    outfile << "static unsigned char dictionary_" << config.id << "[] = {";
+    char hex[8];
+    for (size_t i = 0; i < dict.size(); i++)
+    {
+        snprintf(hex, sizeof(hex), "0x%02x", (unsigned char)dict[i]);
+        outfile << (i % 12 ? ", " : (i ? ",\n  " : "\n  ")) << hex;
+    }
+    outfile << "\n};\n";
+}
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            if (arg == "--help" || arg == "-h")
+            {
+                usage();
+                return 0;
+            }
+            if (arg.compare(0, 2, "--"))
+            {
+                config.files.push_back(arg);
+                continue;
+            }
+            if (i + 1 >= argc)
+                throw(std::runtime_error("missing value for " + arg));
+            std::string value = argv[++i];
+            if (arg == "--out")
+                config.out = value;
+            else if (arg == "--size")
+                config.size = std::max(1024, atoi(value.c_str()));
+            else if (arg == "--id")
+                config.id = strtoul(value.c_str(), NULL, 10);
+            else if (arg == "--level")
+                config.level = atoi(value.c_str());
+            else
+                throw(std::runtime_error("unknown option " + arg));
+        }
+        if (!config.id)
+            config.id = next_dictionary_id();
+        if (config.id < 32768 || config.id >= 0x80000000)
+            throw(std::runtime_error("dictionary IDs must be between 32768 and 2^31"));
+        if (config.out.empty())
+            config.out = "dictionary_" + std::to_string(config.id) + ".inc";
+    }
+    catch (const std::runtime_error& error)
+    {
+        std::cerr << error.what() << "\n";
+        usage();
+        return 1;
+    }
+
+    SampleSet samples;
+    for (int i = 0; i < LEVEL_COUNT; i++)
+    {
+        std::string_view help_design = level_descs[i].help_design;
+        if (help_design.empty())
+            continue;
+        SaveObject* sobj = SaveObject::load(help_design.data(), help_design.size());
+        samples.add_design(sobj);
+        delete sobj;
+    }
+
+    for (std::string& filename : config.files)
+    {
+        std::ifstream loadfile(filename.c_str(), std::ios::binary);
+        if (loadfile.fail())
+        {
+            printf("could not open %s\n", filename.c_str());
+            continue;
+        }
+        size_t before = samples.sizes.size();
+        try
+        {
+            DecompressInBuf decompress(loadfile);
+            std::istream in(&decompress);
+            SaveArena arena;
+            SaveArenaScope scope(&arena);
+            collect(SaveObject::load(in), samples);
+        }
+        catch (const std::runtime_error& error)
+        {
+            printf("%s: %s\n", filename.c_str(), error.what());
+        }
+        printf("%s: %d samples\n", filename.c_str(), int(samples.sizes.size() - before));
+    }
+    printf("%d samples, %d bytes\n", int(samples.sizes.size()), int(samples.data.size()));
+
+    std::string dict;
+    dict.resize(config.size);
+    size_t got = ZDICT_trainFromBuffer(&dict[0], dict.size(), samples.data.data(), samples.sizes.data(), samples.sizes.size());
+    if (ZDICT_isError(got))
+    {
+        printf("training failed: %s\n", ZDICT_getErrorName(got));
+        return 1;
+    }
+    dict.resize(got);
+
+    // The header is the magic number followed by the little endian ID; the
+    // trainer picks a random one.
+    for (int i = 0; i < 4; i++)
+        dict[4 + i] = char(config.id >> (i * 8));
+
+    std::string old_dict = compress_dictionary_data();
+    size_t old_size = compressed_size(samples, old_dict.data(), old_dict.size());
+    size_t new_size = compressed_size(samples, dict.data(), dict.size());
+    printf("dictionary %u: %d bytes\n", config.id, int(dict.size()));
+    printf("current dictionary %u: %d -> %d bytes (%.2f%%)\n", compress_dictionary_id(), int(samples.data.size()), int(old_size), 100.0 * old_size / samples.data.size());
+    printf("new dictionary %u: %d -> %d bytes (%.2f%%)\n", config.id, int(samples.data.size()), int(new_size), 100.0 * new_size / samples.data.size());
+
+    write_dictionary(dict);
+    printf("wrote %s\n", config.out.c_str());
+    return 0;
+}
@@ -0,0 +1,645 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <string>
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "Compress.h"
+#include "SaveState.h"
+#include "Level.h"
+#include "Stats.h"
+
+// Load generator for ComPressureServer.  Every worker thread plays a stream
+// of simulated users, each request on its own connection exactly like the
+// game does, and records the time from connect until the reply arrives (or,
+// for commands which never reply, until the server has consumed the request
+// and closed its side).
+
+enum LoadCommand
+{
+    LOAD_SCORE_SUBMIT,
+    LOAD_SCORE_FETCH,
+    LOAD_DESIGN_FETCH,
+    LOAD_PASTE_SUBMIT,
+    LOAD_PASTE_FETCH,
+    LOAD_SAVE,
+    LOAD_COMMAND_COUNT
+};
+
+static const char* load_command_names[LOAD_COMMAND_COUNT] = {"score_submit", "score_fetch", "design_fetch", "paste_submit", "paste_fetch", "save"};
+static const bool load_command_replies[LOAD_COMMAND_COUNT] = {false, true, true, false, true, false};
+
+class Design
+{
+public:
+    int level_index;
+    unsigned version;
+    SaveObject* levels;
+};
+
+class LoadConfig
+{
+public:
+    std::string host = "127.0.0.1";
+    int port = 42069;
+    unsigned threads = 16;
+    unsigned users = 1000;
+    unsigned duration = 10;
+    uint64_t requests = 0;
+    unsigned pool = 64;
+    unsigned seed = 1;
+    unsigned timeout = 30;
+    bool binary = false;
+    unsigned mix[LOAD_COMMAND_COUNT] = {5, 40, 20, 5, 20, 2};
+    std::vector<std::string> save_files;
+};
+
+class CommandResult
+{
+public:
+    uint64_t count = 0;
+    uint64_t errors = 0;
+    uint64_t bytes_out = 0;
+    uint64_t bytes_in = 0;
+    LatencyHistogram latency;
+};
+
+class WorkerResult
+{
+public:
+    CommandResult commands[LOAD_COMMAND_COUNT];
+    uint64_t substituted = 0;
+};
+
+class PooledRequest
+{
+public:
+    std::string payload;
+    uint64_t paste_id;
+};
+
+class KnownDesign
+{
+public:
+    int level_index;
+    unsigned type;
+    uint64_t steam_id;
+};
+
+static LoadConfig config;
+static std::vector<Design> designs;
+static std::vector<SaveObject*> save_contents;
+static std::vector<PooledRequest> pool[LOAD_COMMAND_COUNT];
+static std::mutex pool_mutex;
+
+static std::mutex known_mutex;
+static std::vector<KnownDesign> known_designs;
+static std::vector<uint64_t> known_pastes;
+
+static std::atomic<uint64_t> requests_issued = 0;
+
+static uint64_t user_steam_id(unsigned user)
+{
+    return 1000000 + user;
+}
+
+static std::string user_name(unsigned user)
+{
+    return "load_user_" + std::to_string(user);
+}
+
+static void load_designs()
+{
+    for (int i = 0; i < LEVEL_COUNT; i++)
+    {
+        std::string_view help_design = level_descs[i].help_design;
+        if (help_design.empty())
+            continue;
+        designs.push_back({i, COMPRESSURE_VERSION, SaveObject::load(help_design.data(), help_design.size())});
+    }
+    printf("help designs: %d\n", (int)designs.size());
+
+    for (std::string& filename : config.save_files)
+    {
+        std::ifstream loadfile(filename.c_str(), std::ios::binary);
+        if (loadfile.fail())
+        {
+            printf("could not open %s\n", filename.c_str());
+            continue;
+        }
+        DecompressInBuf decompress(loadfile);
+        std::istream in(&decompress);
+        SaveObjectMap* omap = SaveObject::load(in)->get_map();
+        unsigned version = 0;
+        if (omap->has_key("version"))
+            version = omap->get_num("version");
+        save_contents.push_back(omap);
+        unsigned count = 0;
+        const char* set_names[] = {"levels", "levels_price", "levels_steam"};
+        for (const char* set_name : set_names)
+        {
+            if (!omap->has_key(set_name))
+                continue;
+            SaveObjectList* slist = omap->get_item(set_name)->get_list();
+            for (unsigned spos = 0; spos < slist->get_count(); spos++)
+            {
+                SaveObject* sobj = slist->get_item(spos);
+                if (sobj->is_null() || !sobj->get_map()->has_key("best_design"))
+                    continue;
+                int level_index = version_reindex_level(version, spos);
+                if (level_index >= LEVEL_COUNT)
+                    continue;
+                designs.push_back({level_index, version, sobj->get_map()->get_item("best_design")});
+                count++;
+            }
+        }
+        printf("%s: %d saved designs\n", filename.c_str(), count);
+    }
+    if (designs.empty())
+        throw(std::runtime_error("No designs to submit"));
+}
+
+static SaveObjectMap* new_request(const char* command, unsigned user)
+{
+    SaveObjectMap* omap = new SaveObjectMap;
+    omap->add_string("command", command);
+    omap->add_num("steam_id", user_steam_id(user));
+    omap->add_string("steam_username", user_name(user));
+    return omap;
+}
+
+static std::string encode(SaveObject* omap)
+{
+    return config.binary ? omap->to_binary() : omap->to_string();
+}
+
+// Requests which carry a design are expensive to build and compress, so a
+// pool of them is prepared before the clock starts and replayed.
+
+static PooledRequest build_pooled(LoadCommand command, unsigned index, std::mt19937& rng)
+{
+    PooledRequest request;
+    request.paste_id = (uint64_t(config.seed) << 32) + index + 1;
+    unsigned user = rng() % config.users;
+    Design& design = designs[rng() % designs.size()];
+    SaveObjectMap* omap = new_request(load_command_names[command], user);
+    if (command == LOAD_SCORE_SUBMIT || command == LOAD_PASTE_SUBMIT)
+    {
+        omap->add_num("level_index", design.level_index);
+        omap->add_num("version", design.version);
+        omap->add_item("levels", design.levels->dup());
+        if (command == LOAD_PASTE_SUBMIT)
+            omap->add_num("paste_id", request.paste_id);
+    }
+    else
+    {
+        SaveObject* content;
+        if (!save_contents.empty())
+            content = save_contents[rng() % save_contents.size()]->dup();
+        else
+        {
+            SaveObjectMap* cmap = new SaveObjectMap;
+            cmap->add_num("version", design.version);
+            cmap->add_item("levels", design.levels->dup());
+            content = cmap;
+        }
+        omap->add_item("content", content);
+    }
+    request.payload = compress_string(encode(omap), COMPRESS_REALTIME);
+    delete omap;
+    return request;
+}
+
+static void build_pool(unsigned thread_index)
+{
+    std::mt19937 rng(config.seed * 7919 + thread_index);
+    const LoadCommand pooled[] = {LOAD_SCORE_SUBMIT, LOAD_PASTE_SUBMIT, LOAD_SAVE};
+    for (LoadCommand command : pooled)
+    {
+        if (!config.mix[command] && !(command == LOAD_PASTE_SUBMIT && config.mix[LOAD_PASTE_FETCH]))
+            continue;
+        for (unsigned i = thread_index; i < config.pool; i += config.threads)
+        {
+            PooledRequest request = build_pooled(command, i, rng);
+            std::lock_guard<std::mutex> lock(pool_mutex);
+            pool[command].push_back(request);
+        }
+    }
+}
+
+static bool send_all(int fd, const char* data, size_t length)
+{
+    while (length)
+    {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent <= 0)
+            return false;
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+static bool recv_all(int fd, char* data, size_t length)
+{
+    while (length)
+    {
+        ssize_t got = recv(fd, data, length, 0);
+        if (got <= 0)
+            return false;
+        data += got;
+        length -= got;
+    }
+    return true;
+}
+
+// Sends one request and returns the decompressed reply, or an empty string
+// for commands which do not reply.  Throws on any connection failure.
+
+static std::string transact(const std::string& payload, bool reply, CommandResult& result, uint64_t& duration)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config.port);
+    if (inet_pton(AF_INET, config.host.c_str(), &addr.sin_addr) != 1)
+        throw(std::runtime_error("bad host address"));
+
+    uint64_t start = stats_time_us();
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        throw(std::runtime_error("socket failed"));
+    struct timeval tv;
+    tv.tv_sec = config.timeout;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    std::string in_str;
+    try
+    {
+        if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+            throw(std::runtime_error("connect failed"));
+        uint32_t length = payload.length();
+        if (!send_all(fd, (char*)&length, 4) || !send_all(fd, payload.c_str(), length))
+            throw(std::runtime_error("send failed"));
+        result.bytes_out += 4 + length;
+        if (reply)
+        {
+            if (!recv_all(fd, (char*)&length, 4))
+                throw(std::runtime_error("Connection closed early"));
+            in_str.resize(length);
+            if (!recv_all(fd, &in_str[0], length))
+                throw(std::runtime_error("Connection closed early"));
+            result.bytes_in += 4 + length;
+        }
+        else
+        {
+            shutdown(fd, SHUT_WR);
+            char buf[64];
+            while (true)
+            {
+                ssize_t got = recv(fd, buf, sizeof(buf), 0);
+                if (got == 0)
+                    break;
+                if (got < 0)
+                    throw(std::runtime_error("no close from server"));
+            }
+        }
+    }
+    catch (const std::runtime_error& error)
+    {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    duration = stats_time_us() - start;
+    if (!reply)
+        return "";
+    return decompress_string(in_str);
+}
+
+static void note_scores(SaveObject* sobj, int level_index, unsigned type)
+{
+    SaveObjectMap* omap = sobj->get_map();
+    if (!omap->has_key("friend_scores"))
+        return;
+    SaveObjectList* slist = omap->get_item("friend_scores")->get_list();
+    std::lock_guard<std::mutex> lock(known_mutex);
+    for (unsigned i = 0; i < slist->get_count() && known_designs.size() < 100000; i++)
+        known_designs.push_back({level_index, type, (uint64_t)slist->get_item(i)->get_map()->get_num("steam_id")});
+}
+
+static LoadCommand pick_command(std::mt19937& rng)
+{
+    unsigned total = 0;
+    for (unsigned i = 0; i < LOAD_COMMAND_COUNT; i++)
+        total += config.mix[i];
+    unsigned r = rng() % total;
+    for (unsigned i = 0; i < LOAD_COMMAND_COUNT; i++)
+    {
+        if (r < config.mix[i])
+            return LoadCommand(i);
+        r -= config.mix[i];
+    }
+    return LOAD_SCORE_FETCH;
+}
+
+static void run_worker(unsigned thread_index, uint64_t end_time, WorkerResult* result)
+{
+    std::mt19937 rng(config.seed * 104729 + thread_index);
+    while (stats_time_us() < end_time)
+    {
+        if (config.requests && requests_issued.fetch_add(1) >= config.requests)
+            break;
+        LoadCommand picked = pick_command(rng);
+        LoadCommand command = picked;
+        unsigned user = rng() % config.users;
+
+        // Fetches need something to fetch; until the run has produced it,
+        // issue the request that would have.
+        KnownDesign known = {0, 0, 0};
+        uint64_t paste_id = 0;
+        if (command == LOAD_DESIGN_FETCH)
+        {
+            std::lock_guard<std::mutex> lock(known_mutex);
+            if (known_designs.empty())
+                command = LOAD_SCORE_FETCH;
+            else
+                known = known_designs[rng() % known_designs.size()];
+        }
+        else if (command == LOAD_PASTE_FETCH)
+        {
+            std::lock_guard<std::mutex> lock(known_mutex);
+            if (known_pastes.empty())
+                command = LOAD_PASTE_SUBMIT;
+            else
+                paste_id = known_pastes[rng() % known_pastes.size()];
+        }
+        if (command == LOAD_PASTE_SUBMIT && pool[command].empty())
+            command = LOAD_SCORE_FETCH;
+        if (command != picked)
+            result->substituted++;
+
+        int level_index = rng() % LEVEL_COUNT;
+        unsigned type = rng() % 3;
+        std::string comp;
+        if (command == LOAD_SCORE_SUBMIT || command == LOAD_PASTE_SUBMIT || command == LOAD_SAVE)
+        {
+            PooledRequest& request = pool[command][rng() % pool[command].size()];
+            comp = request.payload;
+            paste_id = request.paste_id;
+        }
+        else
+        {
+            SaveObjectMap* omap = new_request(load_command_names[command], user);
+            if (command == LOAD_SCORE_FETCH)
+            {
+                omap->add_num("type", type);
+                omap->add_num("level_index", level_index);
+                SaveObjectList* slist = new SaveObjectList;
+                for (unsigned i = 0; i < 8; i++)
+                    slist->add_num(user_steam_id(rng() % config.users));
+                omap->add_item("friends", slist);
+            }
+            else if (command == LOAD_DESIGN_FETCH)
+            {
+                omap->add_num("type", known.type);
+                omap->add_num("level_steam_id", known.steam_id);
+                omap->add_num("level_index", known.level_index);
+            }
+            else if (command == LOAD_PASTE_FETCH)
+            {
+                omap->add_num("paste_id", paste_id);
+            }
+            // Small requests go out zlib compressed, which the server
+            // accepts alongside zstd, so the generator does not become the
+            // bottleneck.
+            comp = compress_string_zlib(encode(omap), COMPRESS_REALTIME);
+            delete omap;
+        }
+
+        CommandResult& cmd = result->commands[command];
+        cmd.count++;
+        try
+        {
+            uint64_t duration = 0;
+            std::string reply = transact(comp, load_command_replies[command], cmd, duration);
+            cmd.latency.add(duration);
+            if (command == LOAD_SCORE_FETCH)
+            {
+                SaveObject* sobj = SaveObject::load(reply);
+                note_scores(sobj, level_index, type);
+                delete sobj;
+            }
+            else if (command == LOAD_PASTE_SUBMIT)
+            {
+                std::lock_guard<std::mutex> lock(known_mutex);
+                known_pastes.push_back(paste_id);
+            }
+        }
+        catch (const std::runtime_error& error)
+        {
+            cmd.errors++;
+        }
+    }
+}
+
+static void print_server_stats()
+{
+    try
+    {
+        SaveObjectMap* omap = new_request("stats", 0);
+        std::string comp = compress_string_zlib(encode(omap), COMPRESS_REALTIME);
+        delete omap;
+        CommandResult result;
+        uint64_t duration;
+        std::string reply = transact(comp, true, result, duration);
+        SaveObjectMap* stats = SaveObject::load(reply)->get_map();
+        SaveObjectMap* submit = stats->get_item("submit_time")->get_map();
+        printf("server: busy %lld%%  workload depth max %lld  sim ticks/s %lld  submit p50 %.1f ms  p99 %.1f ms\n",
+               (long long)stats->get_num("busy_percent"), (long long)stats->get_num("workload_depth_max"), (long long)stats->get_num("sim_ticks_per_second"),
+               submit->get_num("p50_us") / 1000.0, submit->get_num("p99_us") / 1000.0);
+        delete stats;
+    }
+    catch (const std::runtime_error& error)
+    {
+        printf("server stats unavailable: %s\n", error.what());
+    }
+}
+
+static void usage()
+{
+    printf("usage: ComPressureLoad [options]\n"
+           "  --host ADDR        server address (127.0.0.1)\n"
+           "  --port N           server port (42069)\n"
+           "  --threads N        concurrent connections (16)\n"
+           "  --users N          simulated users (1000)\n"
+           "  --duration S       run time in seconds (10)\n"
+           "  --requests N       stop after N requests (unlimited)\n"
+           "  --pool N           prebuilt requests per submit command (64)\n"
+           "  --mix CMD=W,...    command weights, commands are:\n"
+           "                     score_submit score_fetch design_fetch paste_submit paste_fetch save\n"
+           "  --save FILE        add the designs and content of a game save file\n"
+           "  --seed N           random seed (1)\n"
+           "  --timeout S        per request timeout (30)\n"
+           "  --format F         request encoding, text or binary (text)\n");
+}
+
+static void parse_mix(std::string mix)
+{
+    for (unsigned i = 0; i < LOAD_COMMAND_COUNT; i++)
+        config.mix[i] = 0;
+    std::istringstream stream(mix);
+    std::string item;
+    while (std::getline(stream, item, ','))
+    {
+        size_t eq = item.find('=');
+        std::string name = item.substr(0, eq);
+        unsigned weight = eq == std::string::npos ? 1 : atoi(item.substr(eq + 1).c_str());
+        unsigned i = 0;
+        while (i < LOAD_COMMAND_COUNT && name != load_command_names[i])
+            i++;
+        if (i == LOAD_COMMAND_COUNT)
+            throw(std::runtime_error("unknown command in mix: " + name));
+        config.mix[i] = weight;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            if (arg == "--help" || arg == "-h")
+            {
+                usage();
+                return 0;
+            }
+            if (i + 1 >= argc)
+                throw(std::runtime_error("missing value for " + arg));
+            std::string value = argv[++i];
+            if (arg == "--host")
+                config.host = value;
+            else if (arg == "--port")
+                config.port = atoi(value.c_str());
+            else if (arg == "--threads")
+                config.threads = std::max(1, atoi(value.c_str()));
+            else if (arg == "--users")
+                config.users = std::max(1, atoi(value.c_str()));
+            else if (arg == "--duration")
+                config.duration = atoi(value.c_str());
+            else if (arg == "--requests")
+                config.requests = atoll(value.c_str());
+            else if (arg == "--pool")
+                config.pool = std::max(1, atoi(value.c_str()));
+            else if (arg == "--mix")
+                parse_mix(value);
+            else if (arg == "--save")
+                config.save_files.push_back(value);
+            else if (arg == "--seed")
+                config.seed = atoi(value.c_str());
+            else if (arg == "--timeout")
+                config.timeout = atoi(value.c_str());
+            else if (arg == "--format" && (value == "text" || value == "binary"))
+                config.binary = value == "binary";
+            else
+                throw(std::runtime_error("unknown option " + arg));
+        }
+        unsigned total = 0;
+        for (unsigned i = 0; i < LOAD_COMMAND_COUNT; i++)
+            total += config.mix[i];
+        if (!total)
+            throw(std::runtime_error("empty command mix"));
+
+        load_designs();
+    }
+    catch (const std::runtime_error& error)
+    {
+        std::cerr << error.what() << "\n";
+        usage();
+        return 1;
+    }
+
+    uint64_t build_start = stats_time_us();
+    {
+        std::vector<std::thread> builders;
+        for (unsigned i = 0; i < config.threads; i++)
+            builders.push_back(std::thread(build_pool, i));
+        for (std::thread& t : builders)
+            t.join();
+    }
+    printf("built request pool in %.1f s\n", (stats_time_us() - build_start) / 1e6);
+
+    std::vector<WorkerResult> results(config.threads);
+    uint64_t start = stats_time_us();
+    uint64_t end_time = config.duration ? start + uint64_t(config.duration) * 1000000 : UINT64_MAX;
+    {
+        std::vector<std::thread> workers;
+        for (unsigned i = 0; i < config.threads; i++)
+            workers.push_back(std::thread(run_worker, i, end_time, &results[i]));
+        for (std::thread& t : workers)
+            t.join();
+    }
+    double elapsed = (stats_time_us() - start) / 1e6;
+
+    CommandResult totals[LOAD_COMMAND_COUNT];
+    CommandResult all;
+    uint64_t substituted = 0;
+    for (WorkerResult& result : results)
+    {
+        substituted += result.substituted;
+        for (unsigned i = 0; i < LOAD_COMMAND_COUNT; i++)
+        {
+            CommandResult& from = result.commands[i];
+            for (CommandResult* to : {&totals[i], &all})
+            {
+                to->count += from.count;
+                to->errors += from.errors;
+                to->bytes_in += from.bytes_in;
+                to->bytes_out += from.bytes_out;
+                to->latency.merge(from.latency);
+            }
+        }
+    }
+
+    printf("\n%-14s %8s %7s %9s %9s %9s %9s %9s\n", "command", "count", "errors", "req/s", "p50 ms", "p99 ms", "max ms", "KB/req");
+    for (unsigned i = 0; i <= LOAD_COMMAND_COUNT; i++)
+    {
+        CommandResult& cmd = i < LOAD_COMMAND_COUNT ? totals[i] : all;
+        if (!cmd.count)
+            continue;
+        printf("%-14s %8llu %7llu %9.1f %9.2f %9.2f %9.2f %9.1f\n",
+               i < LOAD_COMMAND_COUNT ? load_command_names[i] : "total",
+               (unsigned long long)cmd.count, (unsigned long long)cmd.errors, cmd.count / elapsed,
+               cmd.latency.percentile(50) / 1000.0, cmd.latency.percentile(99) / 1000.0, cmd.latency.max / 1000.0,
+               (cmd.bytes_out + cmd.bytes_in) / 1024.0 / cmd.count);
+    }
+    printf("\n%.1f s, %u threads, %u users\n", elapsed, config.threads, config.users);
+    if (substituted)
+        printf("%llu fetches had nothing to fetch yet and were sent as the matching submit instead\n", (unsigned long long)substituted);
+    printf("score_submit, paste_submit and save are timed until the server closes the\n"
+           "connection; score simulation runs after that and shows as submit_time below.\n");
+    print_server_stats();
+
+    return 0;
+}
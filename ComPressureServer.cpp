@@ -6,6 +6,7 @@
 #include <sstream>
 #include <fstream>
 #include <list>
+#include <unordered_map>
 #include <stdexcept>
 #include <signal.h>
 #include <codecvt>
@@ -19,40 +20,211 @@
 #include "Compress.h"
 #include "SaveState.h"
 #include "Level.h"
+#include "Trace.h"
+#include "Stats.h"
 
 class Database;
 
+// Designs submitted while the server is busy are stored at the interactive
+// compression level and recompressed at the archival level once it goes
+// idle.  Setting COMPRESSURE_NO_RECOMPRESS stores them archived straight
+// away instead.
+
+static bool background_recompress = true;
+
+static CompressProfile design_profile()
+{
+    return background_recompress ? COMPRESS_INTERACTIVE : COMPRESS_ARCHIVAL;
+}
+
+// Every change to a stored design gets a new stamp, so anything built from
+// the design can tell whether it is still current.
+
+static uint64_t score_stamps = 0;
+
+// Designs are stored once however many score tables and players refer to
+// them, keyed by a hash of their text.  add() hands back a reference which
+// the caller releases once the scores it set up hold their own, and a blob
+// goes when its last reference does.
+
+class DesignBlob
+{
+public:
+    std::string c_save;
+    unsigned refs = 0;
+    bool archived = true;
+};
+
+class DesignStore
+{
+public:
+    std::unordered_map<uint64_t, DesignBlob> blobs;
+    std::vector<uint64_t> cold_ids;
+
+    // Walks from the text's hash to the blob holding the same text, or to
+    // the first free id if there is none.  Id 0 means no design.
+
+    uint64_t find(const std::string& text, bool& found)
+    {
+        uint64_t id = hash_bytes(text.data(), text.size());
+        while (true)
+        {
+            if (!id)
+                id++;
+            std::unordered_map<uint64_t, DesignBlob>::iterator it = blobs.find(id);
+            found = it != blobs.end();
+            if (!found || decompress_string(it->second.c_save) == text)
+                return id;
+            id++;
+        }
+    }
+
+    uint64_t add(const std::string& text)
+    {
+        bool found;
+        uint64_t id = find(text, found);
+        DesignBlob& blob = blobs[id];
+        if (!found)
+        {
+            blob.c_save = compress_string(text, design_profile());
+            blob.archived = !background_recompress;
+            if (!blob.archived)
+                cold_ids.push_back(id);
+        }
+        blob.refs++;
+        return id;
+    }
+
+    uint64_t add_compressed(const std::string& c_save)
+    {
+        if (c_save.empty())
+            return 0;
+        bool found;
+        uint64_t id = find(decompress_string(c_save), found);
+        DesignBlob& blob = blobs[id];
+        if (!found)
+            blob.c_save = c_save;
+        blob.refs++;
+        return id;
+    }
+
+    void acquire(uint64_t id)
+    {
+        if (id)
+            blobs[id].refs++;
+    }
+
+    void release(uint64_t id)
+    {
+        if (!id)
+            return;
+        std::unordered_map<uint64_t, DesignBlob>::iterator it = blobs.find(id);
+        if (!--it->second.refs)
+            blobs.erase(it);
+    }
+
+    const std::string& get(uint64_t id)
+    {
+        static const std::string none;
+        if (!id)
+            return none;
+        return blobs[id].c_save;
+    }
+
+    // Recompresses one design stored at the interactive level, returning
+    // false once there are none left.
+
+    bool recompress_cold()
+    {
+        while (!cold_ids.empty())
+        {
+            uint64_t id = cold_ids.back();
+            cold_ids.pop_back();
+            std::unordered_map<uint64_t, DesignBlob>::iterator it = blobs.find(id);
+            if (it == blobs.end() || it->second.archived)
+                continue;
+            it->second.c_save = compress_string(decompress_string(it->second.c_save), COMPRESS_ARCHIVAL);
+            it->second.archived = true;
+            return true;
+        }
+        return false;
+    }
+};
+
+static DesignStore design_store;
+
+// A design on its way into the score tables.  It is serialised and stored
+// the first time a table takes it, and shared by the rest.
+
+class DesignSubmission
+{
+public:
+    SaveObject* sobj;
+    uint64_t id = 0;
+
+    DesignSubmission(SaveObject* sobj_):
+        sobj(sobj_)
+    {}
+    ~DesignSubmission()
+    {
+        design_store.release(id);
+    }
+    uint64_t get()
+    {
+        if (!id)
+            id = design_store.add(sobj->to_string());
+        return id;
+    }
+};
+
 class Score
 {
 public:
     int64_t score = 0;
-    std::string c_save;
+    uint64_t design = 0;
     unsigned version = 0;
+    uint64_t stamp = 0;
     Score(){}
     Score(const Score& other)
     {
         score = other.score;
-        c_save = other.c_save;
+        design = other.design;
         version = other.version;
+        stamp = other.stamp;
+        design_store.acquire(design);
+    }
+    Score& operator=(const Score& other)
+    {
+        design_store.acquire(other.design);
+        design_store.release(design);
+        score = other.score;
+        design = other.design;
+        version = other.version;
+        stamp = other.stamp;
+        return *this;
     }
     ~Score()
     {
+        design_store.release(design);
     }
-    void update_design(SaveObject* sobj, unsigned version_)
+
+    void update_design(uint64_t design_, unsigned version_)
     {
-        c_save = compress_string(sobj->to_string());
+        design_store.acquire(design_);
+        design_store.release(design);
+        design = design_;
         version = version_;
+        stamp = ++score_stamps;
     }
 
-    void update_design(std::string st, unsigned version_)
+    const std::string& c_save()
     {
-        c_save = st;
-        version = version_;
+        return design_store.get(design);
     }
 
     SaveObject* get_design(unsigned& version_)
     {
-        std::string s = decompress_string(c_save);
+        std::string s = decompress_string(c_save());
         version_ = version;
         return SaveObject::load(s);
     }
@@ -80,7 +252,7 @@ public:
             score_map->add_num("id", id);
             score_map->add_num("score", user_score[id].score);
             if (!lite)
-                score_map->add_string("design", user_score[id].c_save);
+                score_map->add_string("design", user_score[id].c_save());
             score_map->add_num("version", user_score[id].version);
             score_list->add_item(score_map);
         }
@@ -93,11 +265,12 @@ public:
         for (unsigned i = 0; i < score_list->get_count(); i++)
         {
             SaveObjectMap* omap = score_list->get_item(i)->get_map();
-            std::string des = omap->get_string("design");
+            uint64_t design = design_store.add_compressed(omap->get_string("design"));
             unsigned load_game_version = 0;
             if (omap->has_key("version"))
                 load_game_version = omap->get_num("version");
-            add_score(omap->get_num("id"), omap->get_num("score"), des, load_game_version);
+            add_score(omap->get_num("id"), omap->get_num("score"), design, load_game_version);
+            design_store.release(design);
         }
     }
 
@@ -106,14 +279,14 @@ public:
         return user_score[steam_id].score;
     }
 
-    void add_score(uint64_t steam_id, int64_t score, SaveObject* sobj, unsigned version)
+    void add_score(uint64_t steam_id, int64_t score, DesignSubmission& design, unsigned version)
     {
         if ((user_score.find(steam_id) != user_score.end()) && (score < user_score[steam_id].score))
             return;
 
         if (score == user_score[steam_id].score)
         {
-            user_score[steam_id].update_design(sobj, version);
+            user_score[steam_id].update_design(design.get(), version);
             return;
         }
 
@@ -131,17 +304,17 @@ public:
         }
         sorted_scores.insert({score, steam_id});
         user_score[steam_id].score = score;
-        user_score[steam_id].update_design(sobj, version);
+        user_score[steam_id].update_design(design.get(), version);
     }
 
-    void add_score(uint64_t steam_id, int64_t score, std::string& sobj, unsigned version)
+    void add_score(uint64_t steam_id, int64_t score, uint64_t design, unsigned version)
     {
         if ((user_score.find(steam_id) != user_score.end()) && (score < user_score[steam_id].score))
             return;
 
         if (score == user_score[steam_id].score)
         {
-            user_score[steam_id].update_design(sobj, version);
+            user_score[steam_id].update_design(design, version);
             return;
         }
 
@@ -159,7 +332,7 @@ public:
         }
         sorted_scores.insert({score, steam_id});
         user_score[steam_id].score = score;
-        user_score[steam_id].update_design(sobj, version);
+        user_score[steam_id].update_design(design, version);
     }
 
    void fetch_scores(SaveObjectMap* omap, uint64_t user_id, std::set<uint64_t>& friends, Database& db, unsigned type, int visible);
@@ -170,6 +343,12 @@ public:
             throw(std::runtime_error("bad user id"));
         return user_score[steam_id].get_design(version_);
     }
+
+    Score* find_score(uint64_t steam_id)
+    {
+        std::map<uint64_t, Score>::iterator it = user_score.find(steam_id);
+        return it == user_score.end() ? NULL : &it->second;
+    }
     
     void clear()
     {
@@ -186,6 +365,29 @@ public:
     int top_level = 0;
 };
 
+// The last game state a player uploaded, kept so that the periodic save
+// only has to carry the levels that changed.  Each level comes with the hash
+// the game gave it, and base is a hash over all of them which the game
+// quotes back, so both sides know what the changes apply to.  These are not
+// saved; after a restart games are asked to send everything again.  At most
+// USER_SAVE_LIMIT players are kept.
+
+#define USER_SAVE_LIMIT 4096
+
+class UserSave
+{
+public:
+    SaveObjectMap* content = NULL;
+    std::vector<uint64_t> hashes[3];
+    uint64_t base = 0;
+    uint64_t last_used = 0;
+
+    ~UserSave()
+    {
+        delete content;
+    }
+};
+
 class CustomLevel
 {
 public:
@@ -263,6 +465,62 @@ public:
 };
 
 
+// Wire-ready replies to fetches of stored designs, which are popular and
+// would otherwise be decompressed, parsed, reserialised and compressed again
+// on every request.  An entry carries a tag naming what it was built from
+// and is only used while the caller's tag still matches; the least recently
+// used entries go once the cache grows past REPLY_CACHE_BYTES.
+
+#define REPLY_CACHE_BYTES (64 * 1024 * 1024)
+
+class ReplyCache
+{
+public:
+    class Entry
+    {
+    public:
+        std::string key;
+        std::string tag;
+        std::string reply;
+    };
+    std::list<Entry> entries;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    size_t bytes = 0;
+
+    const std::string* get(const std::string& key, const std::string& tag)
+    {
+        std::unordered_map<std::string, std::list<Entry>::iterator>::iterator it = index.find(key);
+        if (it == index.end() || it->second->tag != tag)
+            return NULL;
+        entries.splice(entries.begin(), entries, it->second);
+        return &it->second->reply;
+    }
+
+    void put(const std::string& key, const std::string& tag, const std::string& reply)
+    {
+        erase(key);
+        entries.push_front(Entry{key, tag, reply});
+        index[key] = entries.begin();
+        bytes += key.size() + tag.size() + reply.size();
+        while (bytes > REPLY_CACHE_BYTES)
+        {
+            std::string oldest = entries.back().key;
+            erase(oldest);
+        }
+    }
+
+    void erase(const std::string& key)
+    {
+        std::unordered_map<std::string, std::list<Entry>::iterator>::iterator it = index.find(key);
+        if (it == index.end())
+            return;
+        Entry& entry = *it->second;
+        bytes -= entry.key.size() + entry.tag.size() + entry.reply.size();
+        entries.erase(it->second);
+        index.erase(it);
+    }
+};
+
 class Database
 {
 public:
@@ -273,6 +531,101 @@ public:
     std::list<CustomLevel> custom_levels;
 
     std::map<uint64_t, std::string> paste_designs;
+    std::vector<uint64_t> cold_pastes;
+    ReplyCache replies;
+    std::map<uint64_t, UserSave> user_saves;
+    uint64_t user_save_clock = 0;
+
+    // Applies an uploaded save to the copy kept for the player, returning
+    // it, or NULL if the upload was based on something else.  A base of 0
+    // means the upload has every level.  Only the most recently used copies
+    // are kept; anyone evicted is asked to resync.  Level counts and indices
+    // are checked before the copy is touched.
+
+    SaveObjectMap* merge_user_save(uint64_t steam_id, uint64_t base, SaveObjectMap* content)
+    {
+        static const char* const set_keys[3] = {"levels", "levels_price", "levels_steam"};
+        std::map<uint64_t, UserSave>::iterator found = user_saves.find(steam_id);
+        if (base && (found == user_saves.end() || base != found->second.base))
+            return NULL;
+        for (SaveObjectMap::Map::iterator it = content->omap.begin(); it != content->omap.end(); ++it)
+        {
+            std::string_view key = it->key;
+            for (int set = 0; set < 3; set++)
+                if (key == set_keys[set])
+                    LevelSetSnapshot::check(it->value->get_map());
+        }
+        if (found == user_saves.end() && user_saves.size() >= USER_SAVE_LIMIT)
+        {
+            std::map<uint64_t, UserSave>::iterator oldest = user_saves.begin();
+            for (std::map<uint64_t, UserSave>::iterator it = user_saves.begin(); it != user_saves.end(); ++it)
+                if (it->second.last_used < oldest->second.last_used)
+                    oldest = it;
+            user_saves.erase(oldest);
+        }
+        UserSave& user_save = user_saves[steam_id];
+        user_save.last_used = ++user_save_clock;
+        user_save.base = 0;
+        if (!base)
+        {
+            delete user_save.content;
+            user_save.content = new SaveObjectMap;
+            for (int i = 0; i < 3; i++)
+                user_save.hashes[i].clear();
+        }
+        for (SaveObjectMap::Map::iterator it = content->omap.begin(); it != content->omap.end(); ++it)
+        {
+            std::string_view key = it->key;
+            int set = 0;
+            while (set < 3 && key != set_keys[set])
+                set++;
+            if (set == 3)
+            {
+                user_save.content->set_item(key, it->value->dup());
+                continue;
+            }
+            SaveObjectMap* changes = it->value->get_map();
+            LevelSetSnapshot::apply(user_save.content, key, changes);
+            std::vector<uint64_t>& hashes = user_save.hashes[set];
+            hashes.resize(LevelSetSnapshot::check(changes));
+            SaveObjectList* levels = changes->get_item("levels")->get_list();
+            for (unsigned i = 0; i < levels->get_count(); i++)
+            {
+                SaveObjectMap* change = levels->get_item(i)->get_map();
+                hashes[change->get_num("index")] = change->get_num("hash");
+            }
+        }
+        user_save.base = LevelSetSnapshot::base_hash(user_save.hashes);
+        return user_save.content;
+    }
+
+    void add_paste(uint64_t paste_id, const std::string& design)
+    {
+        paste_designs[paste_id] = compress_string(design, design_profile());
+        if (background_recompress)
+            cold_pastes.push_back(paste_id);
+        replies.erase("paste:" + std::to_string(paste_id));
+    }
+
+    // Recompresses one design stored at the interactive level, returning
+    // false once there are none left.
+
+    bool recompress_cold()
+    {
+        if (design_store.recompress_cold())
+            return true;
+        while (!cold_pastes.empty())
+        {
+            uint64_t paste_id = cold_pastes.back();
+            cold_pastes.pop_back();
+            std::map<uint64_t, std::string>::iterator it = paste_designs.find(paste_id);
+            if (it == paste_designs.end() || it->second.empty())
+                continue;
+            it->second = compress_string(decompress_string(it->second), COMPRESS_ARCHIVAL);
+            return true;
+        }
+        return false;
+    }
 
     void update_name(uint64_t steam_id, std::string& steam_username)
     {
@@ -285,7 +638,7 @@ public:
 //         players[steam_id].priv = priv;
 //     }
 // 
-    void update_score(uint64_t steam_id, unsigned level, int64_t score, SaveObject* sobj, unsigned version)
+    void update_score(uint64_t steam_id, unsigned level, int64_t score, DesignSubmission& design, unsigned version)
     {
         if (level > players[steam_id].top_level)
         {
@@ -294,21 +647,21 @@ public:
         }
         if (level >= levels.size())
             levels.resize(level + 1);
-        levels[level].add_score(steam_id, score, sobj, version);
+        levels[level].add_score(steam_id, score, design, version);
     }
 
-    void update_price(uint64_t steam_id, unsigned level, int64_t score, SaveObject* sobj, unsigned version)
+    void update_price(uint64_t steam_id, unsigned level, int64_t score, DesignSubmission& design, unsigned version)
     {
         if (level >= levels_price.size())
             levels_price.resize(level + 1);
-        levels_price[level].add_score(steam_id, INT64_MAX - score, sobj, version);
+        levels_price[level].add_score(steam_id, INT64_MAX - score, design, version);
     }
 
-    void update_steam(uint64_t steam_id, unsigned level, int64_t score, SaveObject* sobj, unsigned version)
+    void update_steam(uint64_t steam_id, unsigned level, int64_t score, DesignSubmission& design, unsigned version)
     {
         if (level >= levels_steam.size())
             levels_steam.resize(level + 1);
-        levels_steam[level].add_score(steam_id, INT64_MAX - score, sobj, version);
+        levels_steam[level].add_score(steam_id, INT64_MAX - score, design, version);
     }
 
     void load(SaveObject* sobj)
@@ -544,6 +897,45 @@ public:
         return omap;
     }
 
+    // The score behind a design_fetch, and the key and tag its reply is
+    // cached under.  NULL if there is no such design.
+
+    Score* find_design(uint64_t level_steam_id, unsigned level_index, unsigned type, std::string& key)
+    {
+        std::vector<ScoreTable> *level_ptr = &levels;
+        if (type == 1)
+            level_ptr = &levels_price;
+        else if (type == 2)
+            level_ptr = &levels_steam;
+        if (level_index >= level_ptr->size())
+            return NULL;
+        key = "design:" + std::to_string(type) + ":" + std::to_string(level_index) + ":" + std::to_string(level_steam_id);
+        return (*level_ptr)[level_index].find_score(level_steam_id);
+    }
+
+    Score* find_design(uint64_t level_steam_id, std::string name, unsigned type, std::string& key)
+    {
+        for (CustomLevel &clevel :custom_levels)
+        {
+            if (clevel.name == name)
+            {
+                ScoreTable* table = &clevel.accuracy_scores;
+                if (type == 1)
+                    table = &clevel.price_scores;
+                else if (type == 2)
+                    table = &clevel.steam_scores;
+                key = "custom_design:" + std::to_string(type) + ":" + name + ":" + std::to_string(level_steam_id);
+                return table->find_score(level_steam_id);
+            }
+        }
+        return NULL;
+    }
+
+    std::string design_tag(Score* score, uint64_t level_steam_id)
+    {
+        return std::to_string(score->stamp) + ":" + players[level_steam_id].steam_username;
+    }
+
     SaveObject* get_design(uint64_t level_steam_id, std::string name, unsigned type = 0)
     {
         for (CustomLevel &clevel :custom_levels)
@@ -619,35 +1011,35 @@ public:
         custom_levels.push_back(CustomLevel(name, level_index, sobj, COMPRESSURE_VERSION));
     }
 
-    void update_custom_score(std::string name, uint64_t steam_id, unsigned level, int64_t score, SaveObject* sobj, unsigned version)
+    void update_custom_score(std::string name, uint64_t steam_id, unsigned level, int64_t score, DesignSubmission& design, unsigned version)
     {
         for (CustomLevel &clevel :custom_levels)
         {
             if (clevel.name == name)
             {
-                clevel.accuracy_scores.add_score(steam_id, score, sobj, version);
+                clevel.accuracy_scores.add_score(steam_id, score, design, version);
             }
         }
     }
 
-    void update_custom_price(std::string name, uint64_t steam_id, unsigned level, int64_t score, SaveObject* sobj, unsigned version)
+    void update_custom_price(std::string name, uint64_t steam_id, unsigned level, int64_t score, DesignSubmission& design, unsigned version)
     {
         for (CustomLevel &clevel :custom_levels)
         {
             if (clevel.name == name)
             {
-                clevel.price_scores.add_score(steam_id, INT64_MAX - score, sobj, version);
+                clevel.price_scores.add_score(steam_id, INT64_MAX - score, design, version);
             }
         }
     }
 
-    void update_custom_steam(std::string name, uint64_t steam_id, unsigned level, int64_t score, SaveObject* sobj, unsigned version)
+    void update_custom_steam(std::string name, uint64_t steam_id, unsigned level, int64_t score, DesignSubmission& design, unsigned version)
     {
         for (CustomLevel &clevel :custom_levels)
         {
             if (clevel.name == name)
             {
-                clevel.steam_scores.add_score(steam_id, INT64_MAX - score, sobj, version);
+                clevel.steam_scores.add_score(steam_id, INT64_MAX - score, design, version);
             }
         }
     }
@@ -669,6 +1061,205 @@ public:
 };
 
 
+class CommandStats
+{
+public:
+    uint64_t count = 0;
+    uint64_t errors = 0;
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    LatencyHistogram latency;
+};
+
+// Counters for the main loop.  Everything here is only touched from the main
+// thread, so nothing is atomic.  The rates are recomputed at each periodic
+// save and each stats request, so they cover the time since the previous
+// report rather than the whole uptime.
+
+class ServerStats
+{
+public:
+    time_t start_time;
+    std::map<std::string, CommandStats> commands;
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    uint64_t connections_accepted = 0;
+    unsigned connections_open = 0;
+    unsigned workload_depth = 0;
+    unsigned workload_depth_max = 0;
+    uint64_t sim_ticks = 0;
+    uint64_t busy_us = 0;
+    LatencyHistogram compress_time;
+    LatencyHistogram workload_time;
+    LatencyHistogram submit_time;
+    LatencyHistogram loop_time;
+    LatencyHistogram db_save_time;
+    LatencyHistogram recompress_time;
+    uint64_t reply_cache_hits = 0;
+    uint64_t reply_cache_misses = 0;
+
+    uint64_t interval_start = 0;
+    uint64_t interval_sim_ticks = 0;
+    uint64_t interval_busy_us = 0;
+    uint64_t sim_ticks_per_second = 0;
+    unsigned busy_percent = 0;
+
+    ServerStats()
+    {
+        time(&start_time);
+        const char* names[] = {"save", "score_submit", "global_design_submit", "paste_submit", "score_fetch", "design_fetch", "paste_fetch", "server_levels_fetch", "server_level_fetch", "help_fetch", "capabilities", "stats", "unknown"};
+        for (const char* name : names)
+            commands[name];
+        interval_start = stats_time_us();
+    }
+
+    void record(std::string command, uint64_t duration, uint64_t request_bytes, uint64_t reply_bytes, bool error)
+    {
+        if (!commands.count(command))
+            command = "unknown";
+        CommandStats& cmd = commands[command];
+        cmd.count++;
+        if (error)
+            cmd.errors++;
+        cmd.bytes_in += request_bytes;
+        cmd.bytes_out += reply_bytes;
+        cmd.latency.add(duration);
+    }
+
+    void end_interval()
+    {
+        uint64_t now = stats_time_us();
+        uint64_t elapsed = now - interval_start;
+        if (!elapsed)
+            return;
+        sim_ticks_per_second = (sim_ticks - interval_sim_ticks) * 1000000 / elapsed;
+        busy_percent = (busy_us - interval_busy_us) * 100 / elapsed;
+        interval_start = now;
+        interval_sim_ticks = sim_ticks;
+        interval_busy_us = busy_us;
+    }
+
+    SaveObject* save_histogram(const LatencyHistogram& histogram)
+    {
+        SaveObjectMap* omap = new SaveObjectMap;
+        omap->add_num("count", histogram.count);
+        omap->add_num("mean_us", histogram.mean());
+        omap->add_num("p50_us", histogram.percentile(50));
+        omap->add_num("p99_us", histogram.percentile(99));
+        omap->add_num("max_us", histogram.max);
+        return omap;
+    }
+
+    // The rates in a stats reply cover the interval so far, leaving the
+    // interval itself to the periodic stats.prom dump.
+
+    SaveObject* save()
+    {
+        uint64_t elapsed = stats_time_us() - interval_start;
+        uint64_t ticks_per_second = sim_ticks_per_second;
+        unsigned busy = busy_percent;
+        if (elapsed)
+        {
+            ticks_per_second = (sim_ticks - interval_sim_ticks) * 1000000 / elapsed;
+            busy = (busy_us - interval_busy_us) * 100 / elapsed;
+        }
+        SaveObjectMap* omap = new SaveObjectMap;
+        omap->add_num("uptime", time(NULL) - start_time);
+        omap->add_num("bytes_in", bytes_in);
+        omap->add_num("bytes_out", bytes_out);
+        omap->add_num("connections_accepted", connections_accepted);
+        omap->add_num("connections_open", connections_open);
+        omap->add_num("workload_depth", workload_depth);
+        omap->add_num("workload_depth_max", workload_depth_max);
+        omap->add_num("sim_ticks", sim_ticks);
+        omap->add_num("sim_ticks_per_second", ticks_per_second);
+        omap->add_num("busy_percent", busy);
+        omap->add_num("reply_cache_hits", reply_cache_hits);
+        omap->add_num("reply_cache_misses", reply_cache_misses);
+        omap->add_item("compress_time", save_histogram(compress_time));
+        omap->add_item("workload_time", save_histogram(workload_time));
+        omap->add_item("submit_time", save_histogram(submit_time));
+        omap->add_item("loop_time", save_histogram(loop_time));
+        omap->add_item("db_save_time", save_histogram(db_save_time));
+        omap->add_item("recompress_time", save_histogram(recompress_time));
+
+        SaveObjectMap* command_map = new SaveObjectMap;
+        for (auto& cmd : commands)
+        {
+            SaveObjectMap* cmd_map = save_histogram(cmd.second.latency)->get_map();
+            cmd_map->add_num("errors", cmd.second.errors);
+            cmd_map->add_num("bytes_in", cmd.second.bytes_in);
+            cmd_map->add_num("bytes_out", cmd.second.bytes_out);
+            command_map->add_item(cmd.first, cmd_map);
+        }
+        omap->add_item("commands", command_map);
+        return omap;
+    }
+
+    void write_prometheus(const char* filename)
+    {
+        std::string tmp_filename = std::string(filename) + ".tmp";
+        {
+            std::ofstream f(tmp_filename.c_str());
+            f << "# TYPE compressure_uptime_seconds gauge\n";
+            f << "compressure_uptime_seconds " << (time(NULL) - start_time) << "\n";
+            f << "# TYPE compressure_bytes_in_total counter\n";
+            f << "compressure_bytes_in_total " << bytes_in << "\n";
+            f << "# TYPE compressure_bytes_out_total counter\n";
+            f << "compressure_bytes_out_total " << bytes_out << "\n";
+            f << "# TYPE compressure_connections_accepted_total counter\n";
+            f << "compressure_connections_accepted_total " << connections_accepted << "\n";
+            f << "# TYPE compressure_connections_open gauge\n";
+            f << "compressure_connections_open " << connections_open << "\n";
+            f << "# TYPE compressure_workload_depth gauge\n";
+            f << "compressure_workload_depth " << workload_depth << "\n";
+            f << "# TYPE compressure_workload_depth_max gauge\n";
+            f << "compressure_workload_depth_max " << workload_depth_max << "\n";
+            f << "# TYPE compressure_sim_ticks_total counter\n";
+            f << "compressure_sim_ticks_total " << sim_ticks << "\n";
+            f << "# TYPE compressure_sim_ticks_per_second gauge\n";
+            f << "compressure_sim_ticks_per_second " << sim_ticks_per_second << "\n";
+            f << "# TYPE compressure_busy_ratio gauge\n";
+            f << "compressure_busy_ratio " << (busy_percent / 100.0) << "\n";
+            f << "# TYPE compressure_reply_cache_hits_total counter\n";
+            f << "compressure_reply_cache_hits_total " << reply_cache_hits << "\n";
+            f << "# TYPE compressure_reply_cache_misses_total counter\n";
+            f << "compressure_reply_cache_misses_total " << reply_cache_misses << "\n";
+
+            f << "# TYPE compressure_requests_total counter\n";
+            for (auto& cmd : commands)
+                f << "compressure_requests_total{command=\"" << cmd.first << "\"} " << cmd.second.count << "\n";
+            f << "# TYPE compressure_request_errors_total counter\n";
+            for (auto& cmd : commands)
+                f << "compressure_request_errors_total{command=\"" << cmd.first << "\"} " << cmd.second.errors << "\n";
+            f << "# TYPE compressure_request_bytes_in_total counter\n";
+            for (auto& cmd : commands)
+                f << "compressure_request_bytes_in_total{command=\"" << cmd.first << "\"} " << cmd.second.bytes_in << "\n";
+            f << "# TYPE compressure_request_bytes_out_total counter\n";
+            for (auto& cmd : commands)
+                f << "compressure_request_bytes_out_total{command=\"" << cmd.first << "\"} " << cmd.second.bytes_out << "\n";
+            f << "# TYPE compressure_request_duration_seconds histogram\n";
+            for (auto& cmd : commands)
+                cmd.second.latency.write_prometheus(f, "compressure_request_duration_seconds", "command=\"" + cmd.first + "\"");
+
+            f << "# TYPE compressure_compress_duration_seconds histogram\n";
+            compress_time.write_prometheus(f, "compressure_compress_duration_seconds", "");
+            f << "# TYPE compressure_workload_duration_seconds histogram\n";
+            workload_time.write_prometheus(f, "compressure_workload_duration_seconds", "");
+            f << "# TYPE compressure_submit_duration_seconds histogram\n";
+            submit_time.write_prometheus(f, "compressure_submit_duration_seconds", "");
+            f << "# TYPE compressure_loop_duration_seconds histogram\n";
+            loop_time.write_prometheus(f, "compressure_loop_duration_seconds", "");
+            f << "# TYPE compressure_db_save_duration_seconds histogram\n";
+            db_save_time.write_prometheus(f, "compressure_db_save_duration_seconds", "");
+            f << "# TYPE compressure_recompress_duration_seconds histogram\n";
+            recompress_time.write_prometheus(f, "compressure_recompress_duration_seconds", "");
+        }
+        rename(tmp_filename.c_str(), filename);
+    }
+};
+
+ServerStats server_stats;
 
 class Workload
 {
@@ -686,9 +1277,11 @@ public:
     std::string steam_username;
     uint64_t steam_id;
     Database& db;
+    uint64_t start_time;
     
     SubmitScore(Database& db_, SaveObjectMap* omap):
-        db(db_)
+        db(db_),
+        start_time(stats_time_us())
     {
         int level_index = omap->get_num("level_index");
         unsigned version = 0;
@@ -718,9 +1311,10 @@ public:
                         SaveObject* save_object = level_set->save_one(level_index);
                         if (score)
                         {
-                            db.update_custom_score(level_set->levels[level_index]->name, steam_id, level_index, level_set->levels[level_index]->last_score, save_object, COMPRESSURE_VERSION);
-                            db.update_custom_price(level_set->levels[level_index]->name, steam_id, level_index, level_set->levels[level_index]->last_price, save_object, COMPRESSURE_VERSION);
-                            db.update_custom_steam(level_set->levels[level_index]->name, steam_id, level_index, level_set->levels[level_index]->last_steam, save_object, COMPRESSURE_VERSION);
+                            DesignSubmission design(save_object);
+                            db.update_custom_score(level_set->levels[level_index]->name, steam_id, level_index, level_set->levels[level_index]->last_score, design, COMPRESSURE_VERSION);
+                            db.update_custom_price(level_set->levels[level_index]->name, steam_id, level_index, level_set->levels[level_index]->last_price, design, COMPRESSURE_VERSION);
+                            db.update_custom_steam(level_set->levels[level_index]->name, steam_id, level_index, level_set->levels[level_index]->last_steam, design, COMPRESSURE_VERSION);
                             printf("New score:%s - %f\n", level_set->levels[level_index]->name.c_str(), (float)score/65536);
                         }
                         delete save_object;
@@ -729,9 +1323,12 @@ public:
                 else if (score)
                 {
                     SaveObject* save_object = level_set->save_one(level_index);
-                    db.update_score(steam_id, level_index, level_set->levels[level_index]->last_score, save_object, COMPRESSURE_VERSION);
-                    db.update_price(steam_id, level_index, level_set->levels[level_index]->last_price, save_object, COMPRESSURE_VERSION);
-                    db.update_steam(steam_id, level_index, level_set->levels[level_index]->last_steam, save_object, COMPRESSURE_VERSION);
+                    {
+                        DesignSubmission design(save_object);
+                        db.update_score(steam_id, level_index, level_set->levels[level_index]->last_score, design, COMPRESSURE_VERSION);
+                        db.update_price(steam_id, level_index, level_set->levels[level_index]->last_price, design, COMPRESSURE_VERSION);
+                        db.update_steam(steam_id, level_index, level_set->levels[level_index]->last_steam, design, COMPRESSURE_VERSION);
+                    }
 
                     printf("New score:%d - %f\n", level_index, (float)score/65536);
                     delete save_object;
@@ -748,6 +1345,7 @@ public:
             if (current_level >= 10000)
             {
                 update_scores();
+                server_stats.submit_time.add(stats_time_us() - start_time);
                 return true;
             }
         }
@@ -769,6 +1367,7 @@ public:
             init_level = true;
         }
         level_set->levels[current_level]->advance(1000);
+        server_stats.sim_ticks += 1000;
         if (level_set->levels[current_level]->score_set)
         {
             current_level++;
@@ -786,6 +1385,7 @@ public:
     int length;
     std::string inbuf;
     std::string outbuf;
+    bool reply_binary = false;
     Connection(int conn_fd_):
         conn_fd(conn_fd_),
         length(-1)
@@ -794,6 +1394,7 @@ public:
 
     Workload* recieve(Database& db)
     {
+        TRACE_SCOPE("Connection::recieve");
         Workload* resp = NULL;
         static char buf[1024];
         while (true)
@@ -811,6 +1412,7 @@ public:
                 break;
             }
             inbuf.append(buf, num_bytes_received);
+            server_stats.bytes_in += num_bytes_received;
         }
 
         while (true)
@@ -827,6 +1429,7 @@ public:
                 break;
             }
             outbuf.erase(0, num_bytes_received);
+            server_stats.bytes_out += num_bytes_received;
         }
         while (true)
         {
@@ -842,55 +1445,98 @@ public:
             }
             else if (length > 0 && inbuf.length() >= length)
             {
+                uint64_t request_start = stats_time_us();
+                uint64_t request_bytes = length + 4;
+                size_t reply_start = outbuf.length();
+                std::string command;
                 try
                 {
                     std::string decomp = decompress_string(inbuf);
-                    std::istringstream decomp_stream(decomp);
-                    SaveObjectMap* omap = SaveObject::load(decomp_stream)->get_map();
+                    reply_binary = !decomp.empty() && (unsigned char)decomp[0] == SAVE_BINARY_MAGIC;
+                    SaveArena request_arena;
+                    SaveObjectMap* omap;
+                    {
+                        SaveArenaScope scope(&request_arena);
+                        omap = SaveObject::load(decomp)->get_map();
+                    }
                     inbuf.erase(0, length);
                     length = -1;
 
-                    std::string command;
                     omap->get_string("command", command);
                     if (command == "save")
                     {
+                        TRACE_SCOPE("save");
                         std::string steam_username;
                         omap->get_string("steam_username", steam_username);
                         db.update_name(omap->get_num("steam_id"), steam_username);
                         printf("save: %s %lld\n", steam_username.c_str(), omap->get_num("steam_id"));
-                        std::ofstream outfile (steam_username.c_str());
-                        omap->save(outfile);
-
-                        std::ostringstream stream;
-                        omap->get_item("content")->save(stream);
-                        std::string comp = compress_string(stream.str());
-                        std::u32string s32;
-                        std::string reply;
-
-                        s32 += '\n';
-                        s32 += 0x1F682;                 // steam engine
-                        unsigned spaces = 2;
-                        for(char& c : comp)
+                        bool delta = omap->has_key("base");
+                        SaveObjectMap* merged = NULL;
+                        if (delta)
+                        {
+                            merged = db.merge_user_save(omap->get_num("steam_id"), omap->get_num("base"), omap->get_item("content")->get_map());
+                            SaveObjectMap* reply = new SaveObjectMap;
+                            if (merged)
+                                reply->add_num("base", db.user_saves[omap->get_num("steam_id")].base);
+                            else
+                                reply->add_num("resync", 1);
+                            send_reply(reply);
+                            delete reply;
+                        }
+                        else
+                        {
+                            db.user_saves.erase(omap->get_num("steam_id"));
+                        }
+                        if (merged)
                         {
-                            if (spaces >= 80)
+                            SaveArenaScope scope(&request_arena);
+                            SaveObjectMap* full = new SaveObjectMap;
+                            full->add_string("command", "save");
+                            full->add_item("content", merged->dup());
+                            full->add_num("steam_id", omap->get_num("steam_id"));
+                            full->add_string("steam_username", steam_username);
+                            omap = full;
+                        }
+                        if (!delta || merged)
+                        {
+                            std::ofstream outfile (steam_username.c_str());
+                            omap->save(outfile);
+
+                            std::string content = omap->get_item("content")->to_string();
+                            std::string comp;
                             {
-                                s32 += '\n';
-                                spaces = 0;
+                                StatsTimer timer(server_stats.compress_time);
+                                comp = compress_string(content, COMPRESS_INTERACTIVE);
                             }
-                            spaces++;
-                            s32 += uint32_t(0x2800 + (unsigned char)(c));
-
-                        } 
-                        s32 += 0x1F6D1;                 // stop sign
+                            std::u32string s32;
+                            std::string reply;
 
-                        std::wstring_convert<std::codecvt_utf8<char32_t>, char32_t> conv;
-                        reply += conv.to_bytes(s32);
-                        reply += "\n";
-                        outfile << reply;
-                        outfile.close();
+                            s32 += '\n';
+                            s32 += 0x1F682;                 // steam engine
+                            unsigned spaces = 2;
+                            for(char& c : comp)
+                            {
+                                if (spaces >= 80)
+                                {
+                                    s32 += '\n';
+                                    spaces = 0;
+                                }
+                                spaces++;
+                                s32 += uint32_t(0x2800 + (unsigned char)(c));
+
+                            } 
+                            s32 += 0x1F6D1;                 // stop sign
+
+                            std::wstring_convert<std::codecvt_utf8<char32_t>, char32_t> conv;
+                            reply += conv.to_bytes(s32);
+                            reply += "\n";
+                            outfile << reply;
+                            outfile.close();
+                        }
                     }
                     else if (command == "score_submit")
                     {
+                        TRACE_SCOPE("score_submit");
                         std::string steam_username;
                         omap->get_string("steam_username", steam_username);
                         db.update_name(omap->get_num("steam_id"), steam_username);
@@ -899,6 +1545,7 @@ public:
                     }
                     else if (command == "global_design_submit" && omap->get_num("steam_id") == CHARLES_ID)
                     {
+                        TRACE_SCOPE("global_design_submit");
                         std::string steam_username;
                         int level_index = omap->get_num("level_index");
                         unsigned load_game_version = 0;
@@ -918,14 +1565,19 @@ public:
                     }
                     else if (command == "paste_submit")
                     {
+                        TRACE_SCOPE("paste_submit");
                         std::string steam_username = omap->get_string("steam_username");
                         uint64_t paste_id = omap->get_num("paste_id");
                         SaveObject* save_object = omap->get_item("levels");
-                        db.paste_designs[paste_id] = compress_string(omap->to_string());
+                        {
+                            StatsTimer timer(server_stats.compress_time);
+                            db.add_paste(paste_id, omap->to_string());
+                        }
                         printf("paste_submit: %s %llu\n", steam_username.c_str(), paste_id);
                     }
                     else if (command == "score_fetch")
                     {
+                        TRACE_SCOPE("score_fetch");
                         std::string steam_username;
                         omap->get_string("steam_username", steam_username);
                         db.update_name(omap->get_num("steam_id"), steam_username);
@@ -946,68 +1598,77 @@ public:
                             scores = db.get_scores(omap->get_num("level_index"), omap->get_num("steam_id"), friends, type);
                         else
                             scores = db.get_scores(omap->get_string("name"), omap->get_num("steam_id"), friends, type);
-                        std::ostringstream stream;
-                        scores->save(stream);
-                        std::string comp = compress_string_zlib(stream.str());
-                        uint32_t length = comp.length();
-                        outbuf.append((char*)&length, 4);
-                        outbuf.append(comp);
+                        send_reply(scores);
                         delete scores;
                     }
                     else if (command == "design_fetch")
                     {
+                        TRACE_SCOPE("design_fetch");
                         std::string steam_username;
                         omap->get_string("steam_username", steam_username);
                         db.update_name(omap->get_num("steam_id"), steam_username);
                         uint64_t level_steam_id = omap->get_num("level_steam_id");
                         unsigned type = omap->get_num("type");
                         printf("design_fetch: %s %lld  req %lld\n", steam_username.c_str(), omap->get_num("steam_id"), level_steam_id);
-                        SaveObject* design;
+                        std::string key;
+                        Score* score;
                         if (omap->has_key("level_index"))
-                            design = db.get_design(level_steam_id, omap->get_num("level_index"), type);
+                            score = db.find_design(level_steam_id, omap->get_num("level_index"), type, key);
                         else
-                            design = db.get_design(level_steam_id, omap->get_string("name"), type);
-                        std::ostringstream stream;
-                        design->save(stream);
-                        std::string comp = compress_string_zlib(stream.str());
-                        uint32_t length = comp.length();
-                        outbuf.append((char*)&length, 4);
-                        outbuf.append(comp);
-                        delete design;
+                            score = db.find_design(level_steam_id, omap->get_string("name"), type, key);
+                        std::string tag;
+                        if (score)
+                        {
+                            key += reply_binary ? ":binary" : ":text";
+                            tag = db.design_tag(score, level_steam_id);
+                        }
+                        if (!score || !send_cached(db, key, tag))
+                        {
+                            SaveObject* design;
+                            if (omap->has_key("level_index"))
+                                design = db.get_design(level_steam_id, omap->get_num("level_index"), type);
+                            else
+                                design = db.get_design(level_steam_id, omap->get_string("name"), type);
+                            size_t reply_pos = outbuf.length();
+                            send_reply(design);
+                            delete design;
+                            if (score)
+                                db.replies.put(key, tag, outbuf.substr(reply_pos));
+                        }
                     }
                     else if (command == "paste_fetch")
                     {
+                        TRACE_SCOPE("paste_fetch");
                         std::string steam_username;
                         omap->get_string("steam_username", steam_username);
                         uint64_t paste_id = omap->get_num("paste_id");
                         printf("paste_fetch: %s %lld \n", steam_username.c_str(), paste_id);
                         if (!db.paste_designs[paste_id].empty())
                         {
-                            std::string dec = decompress_string(db.paste_designs[paste_id]);
-                            std::string comp = compress_string_zlib(dec);
-                            uint32_t length = comp.length();
-                            outbuf.append((char*)&length, 4);
-                            outbuf.append(comp);
+                            std::string key = "paste:" + std::to_string(paste_id);
+                            if (!send_cached(db, key, ""))
+                            {
+                                size_t reply_pos = outbuf.length();
+                                send_reply(decompress_string(db.paste_designs[paste_id]));
+                                db.replies.put(key, "", outbuf.substr(reply_pos));
+                            }
                         }
                     }
                     else if (command == "server_levels_fetch")
                     {
+                        TRACE_SCOPE("server_levels_fetch");
                         std::string steam_username;
                         omap->get_string("steam_username", steam_username);
                         db.update_name(omap->get_num("steam_id"), steam_username);
                         printf("server_levels_fetch: %s %lld\n", steam_username.c_str(), omap->get_num("steam_id"));
 
                         SaveObject* custom_levels = db.get_custom_levels(omap->get_num("steam_id"));
-                        std::ostringstream stream;
-                        custom_levels->save(stream);
-                        std::string comp = compress_string_zlib(stream.str());
-                        uint32_t length = comp.length();
-                        outbuf.append((char*)&length, 4);
-                        outbuf.append(comp);
+                        send_reply(custom_levels);
                         delete custom_levels;
                     }
                     else if (command == "server_level_fetch")
                     {
+                        TRACE_SCOPE("server_level_fetch");
                         std::string steam_username;
                         omap->get_string("steam_username", steam_username);
                         db.update_name(omap->get_num("steam_id"), steam_username);
@@ -1016,30 +1677,44 @@ public:
                         printf("server_level_design_fetch: %s %lld  req %s\n", steam_username.c_str(), omap->get_num("steam_id"), name.c_str());
                         SaveObject* design;
                         design = db.get_server_level_design(name);
-                        std::ostringstream stream;
-                        design->save(stream);
-                        std::string comp = compress_string_zlib(stream.str());
-                        uint32_t length = comp.length();
-                        outbuf.append((char*)&length, 4);
-                        outbuf.append(comp);
+                        send_reply(design);
                         delete design;
                     }
                     else if (command == "help_fetch")
                     {
+                        TRACE_SCOPE("help_fetch");
                         omap->save(std::cout);
                         close();
                     }
+                    else if (command == "capabilities")
+                    {
+                        SaveObjectMap* reply = new SaveObjectMap;
+                        SaveObjectList* accept = new SaveObjectList;
+                        accept->add_string("binary");
+                        accept->add_string("save_delta");
+                        reply->add_item("accept", accept);
+                        send_reply(reply);
+                        delete reply;
+                    }
+                    else if (command == "stats")
+                    {
+                        TRACE_SCOPE("stats");
+                        SaveObject* stats = server_stats.save();
+                        send_reply(stats);
+                        delete stats;
+                    }
                     else
                     {
                         printf("unknown command: %s \n", command.c_str());
                         close();
                     }
                     
-                    delete omap;
+                    server_stats.record(command, stats_time_us() - request_start, request_bytes, outbuf.length() - reply_start, false);
                 }
                 catch (const std::runtime_error& error)
                 {
                     std::cerr << error.what() << "\n";
+                    server_stats.record(command, stats_time_us() - request_start, request_bytes, 0, true);
                     close();
                     break;
                 }
@@ -1050,6 +1725,38 @@ public:
         return resp;
     }
     
+    void send_reply(const std::string& reply)
+    {
+        std::string comp;
+        {
+            StatsTimer timer(server_stats.compress_time);
+            comp = compress_string_zlib(reply, COMPRESS_REALTIME);
+        }
+        uint32_t length = comp.length();
+        outbuf.append((char*)&length, 4);
+        outbuf.append(comp);
+    }
+
+    bool send_cached(Database& db, const std::string& key, const std::string& tag)
+    {
+        const std::string* reply = db.replies.get(key, tag);
+        if (!reply)
+        {
+            server_stats.reply_cache_misses++;
+            return false;
+        }
+        server_stats.reply_cache_hits++;
+        outbuf.append(*reply);
+        return true;
+    }
+
+    // Only clients which sent a binary request are known to read binary.
+
+    void send_reply(SaveObject* reply)
+    {
+        send_reply(reply_binary ? reply->to_binary() : reply->to_string());
+    }
+
     void close()
     {
         if (conn_fd < 0)
@@ -1061,6 +1768,30 @@ public:
 
 };
 
+// The snapshots only live long enough to be written out, so they are built in
+// an arena and dropped in one go rather than deleted node by node.  db.save is
+// binary and compressed on its way to the file; db.save.lite stays plain text
+// so it can be read by eye.
+
+void save_db(Database& db)
+{
+    {
+        SaveArena arena;
+        SaveArenaScope scope(&arena);
+        std::ofstream outfile ("db.save", std::ios::binary);
+        CompressOutBuf compress(outfile, COMPRESS_ARCHIVAL);
+        std::ostream out(&compress);
+        db.save(false)->save_binary(out);
+        compress.finish();
+    }
+    {
+        SaveArena arena;
+        SaveArenaScope scope(&arena);
+        std::ofstream outfile_lite ("db.save.lite");
+        db.save(true)->save(outfile_lite);
+    }
+}
+
 bool power_down = false;
 
 void sig_handler(int signo)
@@ -1076,18 +1807,29 @@ void sig_handler(int signo)
 int main(int argc, char *argv[])
 {
     Database db;
+    trace_init();
+    if (getenv("COMPRESSURE_NO_RECOMPRESS"))
+        background_recompress = false;
     signal(SIGUSR1, sig_handler);
     signal(SIGINT,  sig_handler);
     signal(SIGTERM, sig_handler);
 
     try 
     {
-        std::ifstream loadfile("db.save");
+        TRACE_SCOPE("db_load");
+        StartupPhase phase("db_load");
+        std::ifstream loadfile("db.save", std::ios::binary);
         if (!loadfile.fail() && !loadfile.eof())
         {
-            SaveObjectMap* omap = SaveObject::load(loadfile)->get_map();
+            SaveArena arena;
+            SaveObjectMap* omap;
+            {
+                SaveArenaScope scope(&arena);
+                DecompressInBuf decompress(loadfile);
+                std::istream in(&decompress);
+                omap = SaveObject::load(in)->get_map();
+            }
             db.load(omap);
-            delete omap;
         }
     }
     catch (const std::runtime_error& error)
@@ -1128,6 +1870,7 @@ int main(int argc, char *argv[])
         perror("listen");
         return 1;
     }
+    startup_report();
     
     
     std::list<Connection> conns;
@@ -1135,15 +1878,17 @@ int main(int argc, char *argv[])
 
     time_t old_time = 0;
 
+    bool cold_designs = background_recompress;
     while(true)
     {
+        int ready = 1;
         if (workloads.empty())
         {
             fd_set w_fds;
             fd_set r_fds;
             struct timeval timeout;
-            timeout.tv_sec = 5;
-            timeout.tv_usec = 0;
+            timeout.tv_sec = cold_designs ? 0 : 5;
+            timeout.tv_usec = cold_designs ? 50000 : 0;
 
             FD_ZERO(&r_fds);
             FD_ZERO(&w_fds);
@@ -1156,8 +1901,9 @@ int main(int argc, char *argv[])
                     FD_SET(conn.conn_fd, &w_fds);
             }
             
-            select(1024, &r_fds, &w_fds, NULL, &timeout);
+            ready = select(1024, &r_fds, &w_fds, NULL, &timeout);
         }
+        uint64_t loop_start = stats_time_us();
 
         while (true)
         {
@@ -1167,6 +1913,7 @@ int main(int argc, char *argv[])
             if (conn_fd >= 1024)
                 ::close(conn_fd);
             conns.push_back(conn_fd);
+            server_stats.connections_accepted++;
         }
 
         for (std::list<Connection>::iterator it = conns.begin(); it != conns.end();)
@@ -1188,6 +1935,8 @@ int main(int argc, char *argv[])
         for (std::list<Workload*>::iterator it = workloads.begin();it != workloads.end();)
         {
             Workload* workload = (*it);
+            TRACE_SCOPE("Workload::execute");
+            StatsTimer timer(server_stats.workload_time);
             if (workload->execute())
             {
                 delete workload;
@@ -1197,6 +1946,23 @@ int main(int argc, char *argv[])
                 it++;
         }
 
+        server_stats.connections_open = conns.size();
+        server_stats.workload_depth = workloads.size();
+        if (workloads.size() > server_stats.workload_depth_max)
+            server_stats.workload_depth_max = workloads.size();
+        if (ready > 0 && background_recompress)
+            cold_designs = true;
+        uint64_t loop_time = stats_time_us() - loop_start;
+        server_stats.loop_time.add(loop_time);
+        server_stats.busy_us += loop_time;
+
+        if (ready == 0 && cold_designs)
+        {
+            TRACE_SCOPE("recompress");
+            StatsTimer timer(server_stats.recompress_time);
+            cold_designs = db.recompress_cold();
+        }
+
         fflush(stdout);
         if (power_down)
             break;
@@ -1206,28 +1972,21 @@ int main(int argc, char *argv[])
         if ((old_time + 60) < new_time)
         {
             old_time = new_time;
-            std::ofstream outfile ("db.save");
-            SaveObject* savobj = db.save(false);
-            savobj->save(outfile);
-            delete savobj;
-            std::ofstream outfile_lite ("db.save.lite");
-            SaveObject* savobj_lite = db.save(true);
-            savobj_lite->save(outfile_lite);
-            delete savobj_lite;
+            {
+                TRACE_SCOPE("db_save");
+                StatsTimer timer(server_stats.db_save_time);
+                save_db(db);
+            }
+            server_stats.end_interval();
+            server_stats.write_prometheus("stats.prom");
+            trace_flush();
         }
     }
     close(sockid);
-    {
-        std::ofstream outfile ("db.save");
-        SaveObject* savobj = db.save(false);
-        savobj->save(outfile);
-        delete savobj;
-        std::ofstream outfile_lite ("db.save.lite");
-        SaveObject* savobj_lite = db.save(true);
-        savobj_lite->save(outfile_lite);
-        delete savobj_lite;
-    }
-    delete level_desc;
+    save_db(db);
+    server_stats.end_interval();
+    server_stats.write_prometheus("stats.prom");
+    trace_flush();
     return 0;
 }
 
@@ -1261,7 +2020,7 @@ void ScoreTable::fetch_scores(SaveObjectMap* omap, uint64_t user_id, std::set<ui
         i++;
     }
 
-    SaveObjectList* score_list = new SaveObjectList;
+    SaveObjectIntArray* score_list = new SaveObjectIntArray;
 
     unsigned count = scores.size();
     for (unsigned i = 0; i < 200; i++)
@@ -4,6 +4,7 @@
 #include <iomanip>
 #include <sstream>
 #include <string.h>
+#include <vector>
 
 #include <zlib.h>
 #include <zstd.h>
@@ -387,11 +388,49 @@ static unsigned char dictionary[] = {
   0x74, 0x79, 0x70, 0x65, 0x22, 0x3a, 0x30, 0x7d, 0x5d, 0x2c, 0x5b, 0x7b,
   0x22, 0x74, 0x79, 0x70
 };
-static unsigned int dictionary_len = 4492;
 
+// Every dictionary that stored data may have been compressed with.  zstd
+// frames carry the ID of their dictionary, so decompression picks it from
+// the frame header and old dictionaries stay to read existing data.  New
+// ones come from ComPressureDictTrain; they are added at the end and made
+// current.  Frames with no ID use the first entry.
 
+class CompressDictionary
+{
+public:
+    const unsigned char* data;
+    size_t size;
+};
+
+static const CompressDictionary compress_dictionaries[] =
+{
+    {dictionary, sizeof(dictionary)},
+};
+
+#define COMPRESS_DICTIONARY_COUNT (sizeof(compress_dictionaries) / sizeof(compress_dictionaries[0]))
+#define COMPRESS_DICTIONARY_CURRENT 0
+
+// zstd works out its window and search strategy from the level (and the
+// dictionary fixes them when it is digested), so a profile only picks the
+// level there.  zlib takes all three directly.
+
+class CompressSettings
+{
+public:
+    int zstd_level;
+    int zlib_level;
+    int zlib_window_bits;
+    int zlib_strategy;
+};
+
+static const CompressSettings compress_settings[COMPRESS_PROFILE_COUNT] =
+{
+    {3, Z_BEST_SPEED, 15, Z_DEFAULT_STRATEGY},
+    {9, Z_DEFAULT_COMPRESSION, 15, Z_DEFAULT_STRATEGY},
+    {ZSTD_maxCLevel(), Z_BEST_COMPRESSION, 15, Z_DEFAULT_STRATEGY},
+};
 
-std::string compress_string_zlib(const std::string& str)
+std::string compress_string_zlib(const std::string& str, CompressProfile profile)
 {
     if (str.empty())
         return "";
@@ -400,7 +439,8 @@ std::string compress_string_zlib(const std::string& str)
     zs.zalloc = Z_NULL;
     zs.zfree = Z_NULL;
 
-    if (deflateInit(&zs, Z_BEST_COMPRESSION) != Z_OK)
+    const CompressSettings& settings = compress_settings[profile];
+    if (deflateInit2(&zs, settings.zlib_level, Z_DEFLATED, settings.zlib_window_bits, 8, settings.zlib_strategy) != Z_OK)
         throw(std::runtime_error("deflateInit failed while compressing."));
 
     zs.next_in = (Bytef*)str.data();
@@ -477,48 +517,143 @@ std::string decompress_string_zlib(const std::string& str)
     return outstring;
 }
 
-std::string compress_string_zstd(const std::string& str)
+// The dictionaries are digested once per process, the current one for each
+// profile, and each thread keeps its own contexts, so a call only pays for
+// the data it is given.
+
+static ZSTD_CDict* create_cdict(CompressProfile profile)
+{
+    const CompressDictionary& dict = compress_dictionaries[COMPRESS_DICTIONARY_CURRENT];
+    return ZSTD_createCDict(dict.data, dict.size, compress_settings[profile].zstd_level);
+}
+
+static ZSTD_CDict* get_cdict(CompressProfile profile)
+{
+    static ZSTD_CDict* const cdicts[COMPRESS_PROFILE_COUNT] =
+    {
+        create_cdict(COMPRESS_REALTIME),
+        create_cdict(COMPRESS_INTERACTIVE),
+        create_cdict(COMPRESS_ARCHIVAL),
+    };
+    return cdicts[profile];
+}
+
+static std::vector<ZSTD_DDict*> create_ddicts()
+{
+    std::vector<ZSTD_DDict*> ddicts;
+    for (const CompressDictionary& dict : compress_dictionaries)
+        ddicts.push_back(ZSTD_createDDict(dict.data, dict.size));
+    return ddicts;
+}
+
+static ZSTD_DDict* get_ddict(unsigned id)
+{
+    static const std::vector<ZSTD_DDict*> ddicts = create_ddicts();
+    if (!id)
+        return ddicts[0];
+    for (ZSTD_DDict* ddict : ddicts)
+        if (ZSTD_getDictID_fromDDict(ddict) == id)
+            return ddict;
+    throw(std::runtime_error("Unknown ZSTD dictionary"));
+}
+
+unsigned compress_dictionary_id()
+{
+    const CompressDictionary& dict = compress_dictionaries[COMPRESS_DICTIONARY_CURRENT];
+    return ZSTD_getDictID_fromDict(dict.data, dict.size);
+}
+
+std::string compress_dictionary_data()
+{
+    const CompressDictionary& dict = compress_dictionaries[COMPRESS_DICTIONARY_CURRENT];
+    return std::string((const char*)dict.data, dict.size);
+}
+
+class ZstdContexts
+{
+public:
+    ZSTD_CCtx* cctx = NULL;
+    ZSTD_DCtx* dctx = NULL;
+
+    ~ZstdContexts()
+    {
+        ZSTD_freeCCtx(cctx);
+        ZSTD_freeDCtx(dctx);
+    }
+    ZSTD_CCtx* get_cctx()
+    {
+        if (!cctx)
+            cctx = ZSTD_createCCtx();
+        return cctx;
+    }
+    ZSTD_DCtx* get_dctx()
+    {
+        if (!dctx)
+            dctx = ZSTD_createDCtx();
+        return dctx;
+    }
+};
+
+static thread_local ZstdContexts zstd_contexts;
+
+std::string compress_string_zstd(const std::string& str, CompressProfile profile)
 {
-    size_t buf_size = ZSTD_compressBound(str.size());
-    char* buf = (char*) malloc(buf_size);
-    
-    ZSTD_CCtx* const cctx = ZSTD_createCCtx();
-    ZSTD_CDict* const cdict = ZSTD_createCDict(dictionary, dictionary_len, ZSTD_maxCLevel());
-    
-    size_t got_size = ZSTD_compress_usingCDict(cctx, buf, buf_size, str.c_str(), str.size(), cdict);
     std::string outstring;
-    outstring.append(buf, got_size);
-    ZSTD_freeCCtx(cctx);
-    ZSTD_freeCDict(cdict);
-    free(buf);
+    outstring.resize(ZSTD_compressBound(str.size()));
+    size_t got_size = ZSTD_compress_usingCDict(zstd_contexts.get_cctx(), &outstring[0], outstring.size(), str.c_str(), str.size(), get_cdict(profile));
+    if (ZSTD_isError(got_size))
+        throw(std::runtime_error("ZSTD failed"));
+    outstring.resize(got_size);
+    return outstring;
+}
+
+#define DECOMPRESS_STRING_MAX 10000000
+
+// Frames written by CompressOutBuf do not record their size up front, so
+// they are decompressed a chunk at a time, still capped like the rest.
 
+static std::string decompress_string_zstd_stream(const std::string& str)
+{
+    ZSTD_DCtx* dctx = zstd_contexts.get_dctx();
+    ZSTD_DCtx_reset(dctx, ZSTD_reset_session_and_parameters);
+    ZSTD_DCtx_refDDict(dctx, get_ddict(ZSTD_getDictID_fromFrame(str.data(), str.size())));
+
+    ZSTD_inBuffer input = {str.data(), str.size(), 0};
+    std::string outstring;
+    size_t ret = 1;
+    while (ret && input.pos < input.size)
+    {
+        size_t pos = outstring.size();
+        outstring.resize(pos + ZSTD_DStreamOutSize());
+        ZSTD_outBuffer output = {&outstring[pos], outstring.size() - pos, 0};
+        ret = ZSTD_decompressStream(dctx, &output, &input);
+        outstring.resize(pos + output.pos);
+        if (ZSTD_isError(ret) || outstring.size() > DECOMPRESS_STRING_MAX)
+        {
+            ZSTD_DCtx_reset(dctx, ZSTD_reset_session_and_parameters);
+            throw(std::runtime_error("ZSTD failed"));
+        }
+    }
+    ZSTD_DCtx_reset(dctx, ZSTD_reset_session_and_parameters);
+    if (ret || outstring.empty())
+        throw(std::runtime_error("ZSTD failed"));
     return outstring;
 }
 
 std::string decompress_string_zstd(const std::string& str)
 {
     unsigned long long buf_size = ZSTD_getFrameContentSize(str.c_str(), str.size());
-    if (!buf_size || buf_size > 10000000)
+    if (buf_size == ZSTD_CONTENTSIZE_UNKNOWN)
+        return decompress_string_zstd_stream(str);
+    if (!buf_size || buf_size > DECOMPRESS_STRING_MAX)
         throw(std::runtime_error("ZSTD failed"));
 
-
-    char* buf = (char*) malloc(buf_size);
-    
-    ZSTD_DCtx* const dctx = ZSTD_createDCtx();
-    ZSTD_DDict* const ddict = ZSTD_createDDict(dictionary, dictionary_len);    
-    
-    size_t got_size = ZSTD_decompress_usingDDict(dctx, buf, buf_size, str.c_str(), str.size(), ddict);
-    if (!got_size)
-        throw(std::runtime_error("ZSTD failed"));
-    if (got_size > 10000000)
-        throw(std::runtime_error("ZSTD failed"));
-        
-    
     std::string outstring;
-    outstring.append(buf, got_size);
-    ZSTD_freeDCtx(dctx);
-    ZSTD_freeDDict(ddict);
-    free(buf);
+    outstring.resize(buf_size);
+    size_t got_size = ZSTD_decompress_usingDDict(zstd_contexts.get_dctx(), &outstring[0], buf_size, str.c_str(), str.size(), get_ddict(ZSTD_getDictID_fromFrame(str.data(), str.size())));
+    if (!got_size || ZSTD_isError(got_size))
+        throw(std::runtime_error("ZSTD failed"));
+    outstring.resize(got_size);
     return outstring;
 }
 
@@ -529,7 +664,188 @@ std::string decompress_string(const std::string& str)
     return decompress_string_zstd(str);
 }
 
-std::string compress_string(const std::string& str)
+std::string compress_string(const std::string& str, CompressProfile profile)
+{
+    return compress_string_zstd(str, profile);
+}
+
+CompressOutBuf::CompressOutBuf(std::ostream& out_, CompressProfile profile):
+    out(out_),
+    in_buf(ZSTD_CStreamInSize()),
+    out_buf(ZSTD_CStreamOutSize())
+{
+    cctx = ZSTD_createCCtx();
+    ZSTD_CCtx_refCDict(cctx, get_cdict(profile));
+    setp(in_buf.data(), in_buf.data() + in_buf.size());
+}
+
+CompressOutBuf::~CompressOutBuf()
+{
+    try
+    {
+        finish();
+    }
+    catch (const std::runtime_error& error)
+    {
+        std::cerr << error.what() << "\n";
+    }
+    ZSTD_freeCCtx(cctx);
+}
+
+void CompressOutBuf::compress(ZSTD_EndDirective mode)
+{
+    ZSTD_inBuffer input = {pbase(), size_t(pptr() - pbase()), 0};
+    size_t remaining;
+    do
+    {
+        ZSTD_outBuffer output = {out_buf.data(), out_buf.size(), 0};
+        remaining = ZSTD_compressStream2(cctx, &output, &input, mode);
+        if (ZSTD_isError(remaining))
+            throw(std::runtime_error("ZSTD failed"));
+        out.write(out_buf.data(), output.pos);
+    }
+    while (mode == ZSTD_e_continue ? input.pos < input.size : remaining != 0);
+    setp(in_buf.data(), in_buf.data() + in_buf.size());
+}
+
+int CompressOutBuf::overflow(int c)
+{
+    if (finished)
+        return traits_type::eof();
+    compress(ZSTD_e_continue);
+    if (c != traits_type::eof())
+    {
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+    }
+    return traits_type::not_eof(c);
+}
+
+int CompressOutBuf::sync()
 {
-    return compress_string_zstd(str);
+    if (finished)
+        return 0;
+    compress(ZSTD_e_flush);
+    out.flush();
+    return out.fail() ? -1 : 0;
+}
+
+void CompressOutBuf::finish()
+{
+    if (finished)
+        return;
+    finished = true;
+    compress(ZSTD_e_end);
+    out.flush();
+}
+
+DecompressInBuf::DecompressInBuf(std::istream& in_):
+    in(in_),
+    in_buf(ZSTD_DStreamInSize()),
+    out_buf(ZSTD_DStreamOutSize())
+{
+    memset(&zs, 0, sizeof(zs));
+    setg(out_buf.data(), out_buf.data(), out_buf.data());
+}
+
+DecompressInBuf::~DecompressInBuf()
+{
+    if (format == FORMAT_ZLIB)
+        inflateEnd(&zs);
+    ZSTD_freeDCtx(dctx);
+}
+
+void DecompressInBuf::fill()
+{
+    in.read(in_buf.data(), in_buf.size());
+    in_len = in.gcount();
+    in_pos = 0;
+    if (!in_len)
+        in_eof = true;
+}
+
+int DecompressInBuf::underflow()
+{
+    if (gptr() < egptr())
+        return traits_type::to_int_type(*gptr());
+    while (!done)
+    {
+        if (in_pos == in_len && !in_eof)
+            fill();
+        if (format == FORMAT_UNKNOWN)
+        {
+            unsigned char* head = (unsigned char*)in_buf.data();
+            if (in_len >= 4 && head[0] == 0x28 && head[1] == 0xB5 && head[2] == 0x2F && head[3] == 0xFD)
+            {
+                format = FORMAT_ZSTD;
+                dctx = ZSTD_createDCtx();
+                ZSTD_DCtx_refDDict(dctx, get_ddict(ZSTD_getDictID_fromFrame(in_buf.data(), in_len)));
+            }
+            else if (in_len && head[0] == 0x78)
+            {
+                format = FORMAT_ZLIB;
+                if (inflateInit(&zs) != Z_OK)
+                    throw(std::runtime_error("inflateInit failed while decompressing."));
+            }
+            else
+            {
+                format = FORMAT_PLAIN;
+            }
+        }
+
+        if (format == FORMAT_PLAIN)
+        {
+            if (in_pos == in_len)
+                break;
+            setg(in_buf.data(), in_buf.data() + in_pos, in_buf.data() + in_len);
+            in_pos = in_len;
+            return traits_type::to_int_type(*gptr());
+        }
+
+        size_t got = 0;
+        if (format == FORMAT_ZSTD)
+        {
+            // Once the input is used up the decoder may still hold output
+            // from the last call if that call filled the buffer; otherwise
+            // the stream has to end on a frame boundary.
+            if (in_eof && in_pos == in_len && !out_full)
+            {
+                if (frame_open)
+                    throw(std::runtime_error("ZSTD failed"));
+                done = true;
+                break;
+            }
+            ZSTD_inBuffer input = {in_buf.data(), in_len, in_pos};
+            ZSTD_outBuffer output = {out_buf.data(), out_buf.size(), 0};
+            size_t ret = ZSTD_decompressStream(dctx, &output, &input);
+            if (ZSTD_isError(ret))
+                throw(std::runtime_error("ZSTD failed"));
+            in_pos = input.pos;
+            got = output.pos;
+            frame_open = ret != 0;
+            out_full = got == out_buf.size();
+        }
+        else
+        {
+            zs.next_in = (Bytef*)in_buf.data() + in_pos;
+            zs.avail_in = in_len - in_pos;
+            zs.next_out = (Bytef*)out_buf.data();
+            zs.avail_out = out_buf.size();
+            int ret = inflate(&zs, 0);
+            in_pos = in_len - zs.avail_in;
+            got = out_buf.size() - zs.avail_out;
+            if (ret == Z_STREAM_END)
+                done = true;
+            else if (ret != Z_OK && !(ret == Z_BUF_ERROR && !in_eof))
+                throw(std::runtime_error("ERROR zlib decompress"));
+            else if (!got && in_eof && in_pos == in_len)
+                throw(std::runtime_error("ERROR zlib decompress"));
+        }
+        if (got)
+        {
+            setg(out_buf.data(), out_buf.data(), out_buf.data() + got);
+            return traits_type::to_int_type(*gptr());
+        }
+    }
+    return traits_type::eof();
 }
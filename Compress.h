@@ -1,13 +1,92 @@
 #pragma once
 #include <string>
+#include <vector>
+#include <istream>
+#include <ostream>
+#include <streambuf>
 #include <zlib.h>
+#include <zstd.h>
 
-std::string compress_string_zlib(const std::string& str);
+// How much time to spend on compression.  Network traffic is compressed
+// while someone waits on it, designs the server keeps are written on every
+// submission, and archived data is written once and kept, so it gets the
+// smallest output whatever the cost.  There is no default; every caller
+// says which it is.
+
+enum CompressProfile
+{
+    COMPRESS_REALTIME,
+    COMPRESS_INTERACTIVE,
+    COMPRESS_ARCHIVAL,
+    COMPRESS_PROFILE_COUNT
+};
+
+std::string compress_string_zlib(const std::string& str, CompressProfile profile);
 std::string decompress_string_zlib(const std::string& str);
 
-std::string compress_string_zstd(const std::string& str);
+std::string compress_string_zstd(const std::string& str, CompressProfile profile);
 std::string decompress_string_zstd(const std::string& str);
 
-std::string compress_string(const std::string& str);
+std::string compress_string(const std::string& str, CompressProfile profile);
 std::string decompress_string(const std::string& str);
 
+unsigned compress_dictionary_id();
+std::string compress_dictionary_data();
+
+
+// Streaming versions for payloads too big to hold twice.  CompressOutBuf
+// turns whatever is written through it into a single zstd frame on out, and
+// DecompressInBuf reads zstd, zlib or uncompressed data from in, telling them
+// apart by the first bytes.  Each keeps one fixed size buffer per direction.
+
+class CompressOutBuf :
+    public std::streambuf
+{
+public:
+    std::ostream& out;
+    ZSTD_CCtx* cctx;
+    std::vector<char> in_buf;
+    std::vector<char> out_buf;
+    bool finished = false;
+
+    CompressOutBuf(std::ostream& out_, CompressProfile profile);
+    ~CompressOutBuf();
+    void finish();
+
+protected:
+    int overflow(int c);
+    int sync();
+    void compress(ZSTD_EndDirective mode);
+};
+
+class DecompressInBuf :
+    public std::streambuf
+{
+public:
+    enum Format
+    {
+        FORMAT_UNKNOWN,
+        FORMAT_PLAIN,
+        FORMAT_ZLIB,
+        FORMAT_ZSTD
+    };
+    std::istream& in;
+    Format format = FORMAT_UNKNOWN;
+    ZSTD_DCtx* dctx = NULL;
+    z_stream zs;
+    bool in_eof = false;
+    bool done = false;
+    bool frame_open = false;
+    bool out_full = false;
+    std::vector<char> in_buf;
+    std::vector<char> out_buf;
+    size_t in_pos = 0;
+    size_t in_len = 0;
+
+    DecompressInBuf(std::istream& in_);
+    ~DecompressInBuf();
+
+protected:
+    int underflow();
+    void fill();
+};
@@ -4,6 +4,7 @@
 #include "GameState.h"
 #include "SaveState.h"
 #include "Misc.h"
+#include "Trace.h"
 #include "clip/clip.h"
 
 #include <cassert>
@@ -31,6 +32,8 @@
     #include <filesystem>
 #endif
 
+static const char* const discord_prompt = "If you are stuck, consider discussing your challenges with the brightest minds of our High Pressure Steam Society on Discord. Press Esc and click the \"Join our Discord group\" button.";
+
 static void DisplayWebsite(const char* url)
 {
 #ifdef __linux__
@@ -46,11 +49,10 @@ static void DisplayWebsite(const char* url)
 
 void GameState::load_lang()
 {
-    delete languages;
     {
         std::string save_filename =  "lang.json";
         std::ifstream loadfile(save_filename);
-        languages = SaveObject::load(loadfile)->get_map();
+        translation.read(loadfile);
     }
 
     {
@@ -60,26 +62,182 @@ void GameState::load_lang()
 
         std::ifstream loadfile(save_filename);
         if (!loadfile.fail() && !loadfile.eof())
+            translation.read(loadfile);
+    }
+}
+
+// Startup work which does not touch the renderer, the mixer channels or the
+// rest of GameState runs on worker threads while the save is parsed.
+
+class StartupLoad
+{
+public:
+    GameState* game_state;
+    std::string lang_error;
+    const char* image_filenames[4] = {"texture.png", "tutorial.png", "levels.png", "icon.png"};
+    SDL_Surface* images[4] = {NULL, NULL, NULL, NULL};
+    Mix_Chunk* vent_steam_wav = NULL;
+    Mix_Chunk* move_steam_wav = NULL;
+};
+
+// Joins whichever startup threads are still running when it goes out of
+// scope, so a throw from the constructor cannot leave them writing into its
+// StartupLoad.
+
+class StartupThreads
+{
+public:
+    SDL_Thread* lang = NULL;
+    SDL_Thread* images = NULL;
+    SDL_Thread* sounds = NULL;
+
+    static void wait(SDL_Thread*& thread)
+    {
+        if (thread)
+            SDL_WaitThread(thread, NULL);
+        thread = NULL;
+    }
+    ~StartupThreads()
+    {
+        wait(lang);
+        wait(images);
+        wait(sounds);
+    }
+};
+
+static int load_lang_thread_func(void *ptr)
+{
+    StartupLoad* startup = (StartupLoad*)ptr;
+    StartupPhase phase("load_lang");
+    try
+    {
+        startup->game_state->load_lang();
+    }
+    catch (const std::runtime_error& error)
+    {
+        startup->lang_error = error.what();
+    }
+    return 0;
+}
+
+static int decode_images_thread_func(void *ptr)
+{
+    StartupLoad* startup = (StartupLoad*)ptr;
+    StartupPhase phase("decode_images");
+    for (int i = 0; i < 4; i++)
+        startup->images[i] = IMG_Load(startup->image_filenames[i]);
+    return 0;
+}
+
+static int decode_sounds_thread_func(void *ptr)
+{
+    StartupLoad* startup = (StartupLoad*)ptr;
+    StartupPhase phase("decode_sounds");
+    startup->vent_steam_wav = Mix_LoadWAV("vent_steam.ogg");
+    startup->move_steam_wav = Mix_LoadWAV("move_steam.ogg");
+    return 0;
+}
+
+// The journal is a series of records, each a 32 bit little endian length
+// and a compressed binary save holding the changed levels.  Records from an
+// older snapshot or game version are skipped, and a torn record at the end,
+// from a crash part way through an append, ends the journal.  If it does
+// not end cleanly, torn_at is set to the length of the good records so the
+// torn bytes can be cut off before anything is appended after them.
+
+static unsigned apply_save_journal(SaveObjectMap* omap, std::istream& journal, int64_t& torn_at)
+{
+    int64_t generation = omap->has_key("save_generation") ? omap->get_num("save_generation") : 0;
+    int64_t version = omap->has_key("version") ? omap->get_num("version") : 0;
+    unsigned count = 0;
+    int64_t good_size = 0;
+    std::string data;
+    while (true)
+    {
+        unsigned char header[4];
+        if (!journal.read((char*)header, 4))
         {
-            delete languages;
-            languages = SaveObject::load(loadfile)->get_map();
+            if (journal.gcount())
+                torn_at = good_size;
+            break;
+        }
+        uint32_t size = header[0] | header[1] << 8 | header[2] << 16 | uint32_t(header[3]) << 24;
+        if (size > 64 * 1024 * 1024)
+        {
+            torn_at = good_size;
+            break;
+        }
+        data.resize(size);
+        if (!journal.read(&data[0], size))
+        {
+            torn_at = good_size;
+            break;
+        }
+        try
+        {
+            SaveObject* sobj = SaveObject::load(decompress_string(data));
+            SaveObjectMap* record = sobj->get_map();
+            if (record->get_num("save_generation") == generation && record->get_num("version") == version)
+            {
+                for (SaveObjectMap::Entry& entry : record->omap)
+                {
+                    std::string_view key = entry.key;
+                    if (key == "levels" || key == "levels_price" || key == "levels_steam")
+                        LevelSetSnapshot::apply(omap, key, entry.value->get_map());
+                    else
+                        omap->set_item(key, entry.value->dup());
+                }
+                count++;
+            }
+            delete sobj;
+        }
+        catch (const std::runtime_error& error)
+        {
+            std::cerr << "save journal: " << error.what() << "\n";
+            torn_at = good_size;
+            break;
         }
+        good_size += 4 + size;
     }
+    return count;
 }
 
-GameState::GameState(std::ifstream& loadfile)
+GameState::GameState(std::ifstream& loadfile, std::ifstream& journalfile)
 {
-    load_lang();
+    StartupLoad startup;
+    startup.game_state = this;
+    StartupThreads threads;
+    threads.lang = SDL_CreateThread(load_lang_thread_func, "load_lang", (void *)&startup);
+    threads.images = SDL_CreateThread(decode_images_thread_func, "decode_images", (void *)&startup);
+    {
+        StartupPhase phase("open_audio");
+        Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 2048);
+        Mix_AllocateChannels(16);
+    }
+    threads.sounds = SDL_CreateThread(decode_sounds_thread_func, "decode_sounds", (void *)&startup);
+
     bool load_was_good = false;
     try 
     {
         if (!loadfile.fail() && !loadfile.eof())
         {
+            SaveArena arena;
             SaveObjectMap* omap;
-            omap = SaveObject::load(loadfile)->get_map();
+            {
+                StartupPhase phase("parse_save");
+                SaveArenaScope scope(&arena);
+                DecompressInBuf decompress(loadfile);
+                std::istream in(&decompress);
+                omap = SaveObject::load(in)->get_map();
+                if (!journalfile.fail())
+                    journal_records = apply_save_journal(omap, journalfile, journal_torn_at);
+            }
+            StartupPhase phase("build_level_sets");
             unsigned load_game_version = 0;
             if (omap->has_key("version"))
                 load_game_version = omap->get_num("version");
+            if (omap->has_key("save_generation"))
+                save_generation = omap->get_num("save_generation");
             level_set_accuracy = new LevelSet(omap->get_item("levels"), load_game_version);
             if (omap->has_key("levels_price"))
                 level_set_price = new LevelSet(omap->get_item("levels_price"), load_game_version);
@@ -128,8 +286,9 @@ GameState::GameState(std::ifstream& loadfile)
             	language_name = omap->get_string("language");
             if (omap->has_key("number_high_precision"))
                 number_high_precision = omap->get_num("number_high_precision");
+            journal_highest_level = highest_level;
+            snapshot_needed = (load_game_version != COMPRESSURE_VERSION) || journal_torn_at >= 0;
 
-            delete omap;
             load_was_good = true;
         }
     }
@@ -150,37 +309,45 @@ GameState::GameState(std::ifstream& loadfile)
         display_language_dialogue = true;
     }
 
-    if (!languages->has_key(language_name))
+    StartupThreads::wait(threads.lang);
+    if (!startup.lang_error.empty())
+        throw(std::runtime_error(startup.lang_error));
+    if (!translation.has_language(language_name))
         language_name = "English";
-    current_language = languages->get_item(language_name)->get_map();
+    translation.load(language_name);
+    discord_prompt_tooltip_id = translation.get_tooltip_id(discord_prompt);
 
 
 
     set_level(current_level_index);
 
-    sdl_window = SDL_CreateWindow( "ComPressure", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 640*scale, 360*scale, SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE | (full_screen? SDL_WINDOW_FULLSCREEN_DESKTOP  | SDL_WINDOW_BORDERLESS : 0));
-    sdl_renderer = SDL_CreateRenderer(sdl_window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_TARGETTEXTURE);
-	sdl_texture = loadTexture("texture.png");
-	sdl_tutorial_texture = loadTexture("tutorial.png");
-	sdl_levels_texture = loadTexture("levels.png");
-    SDL_SetRenderDrawColor(sdl_renderer, 0x0, 0x0, 0x0, 0xFF);
-    
     {
-        SDL_Surface* icon_surface = IMG_Load("icon.png");
-        SDL_SetWindowIcon(sdl_window, icon_surface);
-	    SDL_FreeSurface(icon_surface);
+        StartupPhase phase("create_window");
+        sdl_window = SDL_CreateWindow( "ComPressure", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 640*scale, 360*scale, SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE | (full_screen? SDL_WINDOW_FULLSCREEN_DESKTOP  | SDL_WINDOW_BORDERLESS : 0));
+        sdl_renderer = SDL_CreateRenderer(sdl_window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_TARGETTEXTURE);
+    }
+    StartupThreads::wait(threads.images);
+    {
+        StartupPhase phase("create_textures");
+        sdl_texture = loadTexture(startup.images[0]);
+        sdl_tutorial_texture = loadTexture(startup.images[1]);
+        sdl_levels_texture = loadTexture(startup.images[2]);
+        SDL_SetRenderDrawColor(sdl_renderer, 0x0, 0x0, 0x0, 0xFF);
+        SDL_SetWindowIcon(sdl_window, startup.images[3]);
+        SDL_FreeSurface(startup.images[3]);
     }
 
-    font = TTF_OpenFont("fixed.ttf", 19);
+    {
+        StartupPhase phase("open_font");
+        font = TTF_OpenFont("fixed.ttf", 19);
+    }
 
-    Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 2048);
-    Mix_AllocateChannels(16);
-    
-    vent_steam_wav = Mix_LoadWAV("vent_steam.ogg");
+    StartupThreads::wait(threads.sounds);
+    vent_steam_wav = startup.vent_steam_wav;
     Mix_PlayChannel(0, vent_steam_wav, -1);
     Mix_Volume(0, 0);
     
-    move_steam_wav = Mix_LoadWAV("move_steam.ogg");
+    move_steam_wav = startup.move_steam_wav;
     Mix_PlayChannel(1, move_steam_wav, -1);
     Mix_Volume(1, 0);
     
@@ -199,41 +366,149 @@ GameState::GameState(std::ifstream& loadfile)
     
 SaveObject* GameState::save(bool lite)
 {
-    SaveObjectMap* omap = new SaveObjectMap;
-    omap->add_num("version", COMPRESSURE_VERSION);
-    omap->add_item("levels", level_set_accuracy->save_all(highest_level, lite));
-    omap->add_item("levels_price", level_set_price->save_all(highest_level, lite));
-    omap->add_item("levels_steam", level_set_steam->save_all(highest_level, lite));
+    SaveTreeWriter writer;
+    save(writer, lite);
+    return writer.take();
+}
+
+void GameState::save(SaveWriter& writer, bool lite)
+{
+    SaveSnapshot* snap = snapshot(lite, false);
+    snap->save(writer);
+    delete snap;
+}
+
+// Keys are in byte order so the output matches what a SaveObjectMap of the
+// same values writes; the level sets go in amongst the settings.
+
+static const char* const snapshot_set_keys[3] = {"levels", "levels_price", "levels_steam"};
+
+void SaveSnapshot::save(SaveWriter& writer)
+{
+    TRACE_SCOPE("SaveSnapshot::save");
+    unsigned next_set = 0;
+    writer.begin_map();
+    for (SaveObjectMap::Entry& entry : settings->omap)
+    {
+        while (next_set < 3 && std::string_view(snapshot_set_keys[next_set]) < std::string_view(entry.key))
+        {
+            writer.key(snapshot_set_keys[next_set]);
+            levels[next_set++].save(writer);
+        }
+        writer.write_key(entry.key, entry.id);
+        writer.object(entry.value);
+    }
+    while (next_set < 3)
+    {
+        writer.key(snapshot_set_keys[next_set]);
+        levels[next_set++].save(writer);
+    }
+    writer.end_map();
+}
+
+// Everything a save needs, taken on the main thread without serialising any
+// level that has not changed.  A journal snapshot has the same settings but
+// only the levels that changed.
 
+SaveSnapshot* GameState::snapshot(bool lite, bool journal)
+{
+    TRACE_SCOPE("GameState::snapshot");
+    bool all = highest_level != journal_highest_level;
+    SaveSnapshot* snap = new SaveSnapshot;
+    SaveObjectMap* omap = snap->settings;
     omap->add_num("current_level_index", current_level_index);
+    omap->add_num("discord_joined", discord_joined);
+    omap->add_num("fade_type", fade_type);
+    omap->add_num("flash_editor_menu", flash_editor_menu);
+    omap->add_num("flash_steam_inlet", flash_steam_inlet);
+    omap->add_num("flash_valve", flash_valve);
+    omap->add_num("full_screen", full_screen);
     omap->add_num("game_speed", game_speed);
-    omap->add_num("show_debug", show_debug);
     omap->add_num("highest_level", highest_level);
+    omap->add_string("language", language_name);
+    omap->add_num("minutes_played", minutes_played + SDL_GetTicks()/ 1000 / 60);
+    omap->add_num("music_volume", music_volume);
     omap->add_num("next_dialogue_level", next_dialogue_level);
-    omap->add_num("show_help_page", show_help_page);
     omap->add_num("next_help_highlight", next_help_highlight);
- 
-    omap->add_num("flash_editor_menu", flash_editor_menu);
-    omap->add_num("flash_steam_inlet", flash_steam_inlet);
-    omap->add_num("flash_valve", flash_valve);
+    omap->add_num("number_high_precision", number_high_precision);
 //    omap->add_num("requesting_help", requesting_help);
+    if (!lite)
+        omap->add_num("save_generation", save_generation);
     omap->add_num("scale", scale);
-    omap->add_num("full_screen", full_screen);
+    omap->add_num("show_debug", show_debug);
+    omap->add_num("show_help_page", show_help_page);
     omap->add_num("sound_volume", sound_volume);
-    omap->add_num("music_volume", music_volume);
-    omap->add_num("minutes_played", minutes_played + SDL_GetTicks()/ 1000 / 60);
-    omap->add_num("discord_joined", discord_joined);
-    omap->add_string("language", language_name);
-    omap->add_num("number_high_precision", number_high_precision);
-    omap->add_num("fade_type", fade_type);
-    return omap;
+    omap->add_num("version", COMPRESSURE_VERSION);
+
+    LevelSet* sets[3] = {level_set_accuracy, level_set_price, level_set_steam};
+    for (int i = 0; i < 3; i++)
+    {
+        snap->levels[i].journal = journal;
+        sets[i]->snapshot(snap->levels[i], highest_level, lite, all);
+    }
+    return snap;
+}
+
+// A full snapshot starts a new generation, so journal records appended
+// before it are ignored on load even if the journal could not be cleared.
+// The generation only moves on once save_finished hears the save is on disk.
+
+SaveSnapshot* GameState::save_snapshot()
+{
+    if (current_level_index < edited_level_set->levels.size())
+        edited_level_set->levels[current_level_index]->changed();
+    SaveSnapshot* snap = snapshot(false, false);
+    snap->settings->set_item("save_generation", new SaveObjectNumber(save_generation + 1));
+    level_set_accuracy->clear_dirty();
+    level_set_price->clear_dirty();
+    level_set_steam->clear_dirty();
+    journal_highest_level = highest_level;
+    return snap;
+}
+
+// Custom level edits and running tests change the level being edited
+// directly rather than through Level, so it always goes in.
+
+SaveSnapshot* GameState::save_journal()
+{
+    if (current_level_index < edited_level_set->levels.size())
+        edited_level_set->levels[current_level_index]->changed();
+    SaveSnapshot* snap = snapshot(false, true);
+    journal_highest_level = highest_level;
+    return snap;
+}
+
+// Called with what the save thread reported for the last save.  If it did
+// not reach the disk, the file and journal still hold the old generation,
+// so the next save is a full one and any journal record written before it
+// carries every level.
+
+void GameState::save_finished(bool full, bool ok)
+{
+    if (!ok)
+    {
+        journal_highest_level = -1;
+        snapshot_needed = true;
+        return;
+    }
+    if (full)
+    {
+        save_generation++;
+        journal_records = 0;
+        snapshot_needed = false;
+    }
+    else
+    {
+        journal_records++;
+    }
 }
 
 void GameState::save(std::ostream& outfile, bool lite)
 {
-    SaveObject* omap = save(lite);
-    omap->save(outfile);
-    delete omap;
+    SaveTextWriter writer;
+    writer.buf.sink = &outfile;
+    save(writer, lite);
+    writer.buf.flush();
 }
 
 
@@ -249,18 +524,41 @@ class ServerComms
 public:
     SaveObject* send;
     ServerResp* resp;
+    bool binary;
 
-    ServerComms(SaveObject* send_, ServerResp* resp_ = NULL):
+    ServerComms(SaveObject* send_, ServerResp* resp_, bool binary_):
         send(send_),
-        resp(resp_)
+        resp(resp_),
+        binary(binary_)
     {}
 };
 
+// A server that has gone quiet must not hold a reply slot forever, so each
+// read gives up after a while.
+
+static const uint32_t SERVER_REPLY_TIMEOUT = 10000;
+
+static void server_recv(TCPsocket tcpsock, SDLNet_SocketSet set, char* data, int length)
+{
+    int got = 0;
+    while (got != length)
+    {
+        if (SDLNet_CheckSockets(set, SERVER_REPLY_TIMEOUT) <= 0)
+            throw(std::runtime_error("Timed out waiting for the server"));
+        int n = SDLNet_TCP_Recv(tcpsock, &data[got], length - got);
+        if (n <= 0)
+            throw(std::runtime_error("Connection closed early"));
+        got += n;
+    }
+}
+
 static int fetch_from_server_thread(void *ptr)
 {
     IPaddress ip;
     TCPsocket tcpsock;
     ServerComms* comms = (ServerComms*)ptr;
+    trace_thread_name("FetchFromServer");
+    TRACE_SCOPE("fetch_from_server_thread");
     if (SDLNet_ResolveHost(&ip, "compressure.brej.org", 42069) == -1)
 //    if (SDLNet_ResolveHost(&ip, "192.168.0.81", 42069) == -1)
     {
@@ -291,11 +589,10 @@ static int fetch_from_server_thread(void *ptr)
         return 0;
     }
     
+    SDLNet_SocketSet reply_set = NULL;
     try 
     {
-        std::ostringstream stream;
-        comms->send->save(stream);
-        std::string comp = compress_string(stream.str());
+        std::string comp = compress_string(comms->binary ? comms->send->to_binary() : comms->send->to_string(), COMPRESS_REALTIME);
 
         uint32_t length = comp.length();
         SDLNet_TCP_Send(tcpsock, (char*)&length, 4);
@@ -303,26 +600,13 @@ static int fetch_from_server_thread(void *ptr)
 
         if (comms->resp)
         {
-            int got = SDLNet_TCP_Recv(tcpsock, (char*)&length, 4);
-            if (got != 4)
-                throw(std::runtime_error("Connection closed early"));
-            char* data = (char*)malloc(length);
-            got = 0;
-            while (got != length)
-            {
-                int n = SDLNet_TCP_Recv(tcpsock, &data[got], length - got);
-                got += n;
-                if (!n)
-                {
-                    free (data);
-                    throw(std::runtime_error("Connection closed early"));
-                }
-            }
-            std::string in_str(data, length);
-            free (data);
+            reply_set = SDLNet_AllocSocketSet(1);
+            SDLNet_TCP_AddSocket(reply_set, tcpsock);
+            server_recv(tcpsock, reply_set, (char*)&length, 4);
+            std::string in_str(length, '\0');
+            server_recv(tcpsock, reply_set, in_str.data(), length);
             std::string decomp = decompress_string(in_str);
-            std::istringstream decomp_stream(decomp);
-            comms->resp->resp = SaveObject::load(decomp_stream);
+            comms->resp->resp = SaveObject::load(decomp);
         }
         
     }
@@ -334,6 +618,8 @@ static int fetch_from_server_thread(void *ptr)
             comms->resp->error = true;
         }
     }
+    if (reply_set)
+        SDLNet_FreeSocketSet(reply_set);
     SDLNet_TCP_Close(tcpsock);
     if (comms->resp)
     {
@@ -347,7 +633,8 @@ static int fetch_from_server_thread(void *ptr)
 
 void GameState::post_to_server(SaveObject* send, bool sync)
 {
-    SDL_Thread *thread = SDL_CreateThread(fetch_from_server_thread, "PostToServer", (void *)new ServerComms(send));
+    capabilities_update();
+    SDL_Thread *thread = SDL_CreateThread(fetch_from_server_thread, "PostToServer", (void *)new ServerComms(send, NULL, server_binary));
     if (sync)
         SDL_WaitThread(thread, NULL);
 }
@@ -355,23 +642,167 @@ void GameState::post_to_server(SaveObject* send, bool sync)
 
 void GameState::fetch_from_server(SaveObject* send, ServerResp* resp)
 {
+    capabilities_update();
     SDL_AtomicLock(&resp->working);
     resp->done = false;
     resp->error = false;
     delete resp->resp;
     resp->resp = NULL;
-    SDL_Thread *thread = SDL_CreateThread(fetch_from_server_thread, "FetchFromServer", (void *)new ServerComms(send, resp));
+    SDL_Thread *thread = SDL_CreateThread(fetch_from_server_thread, "FetchFromServer", (void *)new ServerComms(send, resp, server_binary));
 }
 
+// Requests go as text until the server says which encodings it accepts,
+// and saves go whole until it says it keeps them.  A server that predates
+// the question drops the connection, so it only ever sees the old requests.
+
+void GameState::capabilities_fetch()
+{
+    SaveObjectMap* omap = new SaveObjectMap;
+    SaveObjectList* accept = new SaveObjectList;
+    accept->add_string("binary");
+    accept->add_string("save_delta");
+    omap->add_item("accept", accept);
+    omap->add_string("command", "capabilities");
+    fetch_from_server(omap, &capabilities_from_server);
+}
+
+void GameState::capabilities_update()
+{
+    if (!capabilities_from_server.done || !SDL_AtomicTryLock(&capabilities_from_server.working))
+        return;
+    SaveObject* resp = capabilities_from_server.resp;
+    if (!capabilities_from_server.error && resp && resp->is_map() && resp->get_map()->has_key("accept"))
+    {
+        SaveObjectList* accept = resp->get_map()->get_item("accept")->get_list();
+        for (unsigned i = 0; i < accept->get_count(); i++)
+        {
+            std::string capability = accept->get_string(i);
+            if (capability == "binary")
+                server_binary = true;
+            if (capability == "save_delta")
+                server_save_delta = true;
+        }
+    }
+    delete capabilities_from_server.resp;
+    capabilities_from_server.resp = NULL;
+    capabilities_from_server.done = false;
+    SDL_AtomicUnlock(&capabilities_from_server.working);
+}
+
+
+// The server keeps the last save each player uploaded, so only the levels
+// whose hashes differ from the last upload it acknowledged are sent, along
+// with the base hash of that upload.  If the server no longer has it, it
+// says so and everything goes next time.  Nothing is sent while only the
+// minutes played have changed.  Servers that do not keep saves, and the
+// save at exit, which cannot wait for a reply, get the whole lite save
+// without one; the server then forgets its copy.
 
 void GameState::save_to_server(bool sync)
 {
+    capabilities_update();
+    if (!SDL_AtomicTryLock(&save_from_server.working))
+    {
+        if (!sync)
+            return;
+        SDL_AtomicLock(&save_from_server.working);
+    }
+    SDL_AtomicUnlock(&save_from_server.working);
+    if (sync || !server_save_delta)
+    {
+        SaveObjectMap* omap = new SaveObjectMap;
+        omap->add_string("command", "save");
+        omap->add_item("content", save(true));
+        omap->add_num("steam_id", steam_id);
+        omap->add_string("steam_username", steam_username);
+        post_to_server(omap, sync);
+        server_save_base = 0;
+        return;
+    }
+    if (save_from_server.done)
+    {
+        SaveObject* resp = save_from_server.resp;
+        uint64_t base = LevelSetSnapshot::base_hash(pending_save_hashes);
+        if (resp && resp->is_map() && resp->get_map()->has_key("base") && uint64_t(resp->get_map()->get_num("base")) == base)
+        {
+            server_save_base = base;
+            for (int i = 0; i < 3; i++)
+                server_save_hashes[i] = pending_save_hashes[i];
+            server_save_settings = pending_save_settings;
+        }
+        else if (!save_from_server.error)
+        {
+            server_save_base = 0;
+        }
+        delete save_from_server.resp;
+        save_from_server.resp = NULL;
+        save_from_server.done = false;
+    }
+
+    if (current_level_index < edited_level_set->levels.size())
+        edited_level_set->levels[current_level_index]->changed();
+    SaveSnapshot* snap = snapshot(true, false);
+    SaveObjectMap* content = snap->settings->dup()->get_map();
+    content->set_item("minutes_played", new SaveObjectNumber(0));
+    pending_save_settings = content->to_binary();
+    content->set_item("minutes_played", snap->settings->get_item("minutes_played")->dup());
+
+    static const char* const set_keys[3] = {"levels", "levels_price", "levels_steam"};
+    bool changed = !server_save_base || pending_save_settings != server_save_settings;
+    for (int i = 0; i < 3; i++)
+    {
+        LevelSetSnapshot& set = snap->levels[i];
+        std::vector<uint64_t>& acked = server_save_hashes[i];
+        pending_save_hashes[i].clear();
+        if (set.count != acked.size())
+            changed = true;
+        SaveTreeWriter writer;
+        writer.begin_map();
+        writer.num("count", set.count);
+        writer.key("levels");
+        writer.begin_list();
+        for (auto& level : set.levels)
+        {
+            uint64_t hash = level.second ? hash_bytes(level.second->data(), level.second->size()) : 0;
+            pending_save_hashes[i].push_back(hash);
+            if (server_save_base && level.first < acked.size() && acked[level.first] == hash)
+                continue;
+            changed = true;
+            writer.begin_map();
+            writer.num("hash", hash);
+            writer.num("index", level.first);
+            writer.key("level");
+            if (level.second)
+            {
+                SaveReader* reader = SaveReader::open(level.second->data(), level.second->size());
+                reader->copy(writer);
+                delete reader;
+            }
+            else
+            {
+                writer.null();
+            }
+            writer.end_map();
+        }
+        writer.end_list();
+        writer.end_map();
+        content->add_item(set_keys[i], writer.take());
+    }
+    delete snap;
+
+    if (!changed)
+    {
+        delete content;
+        return;
+    }
+
     SaveObjectMap* omap = new SaveObjectMap;
+    omap->add_num("base", server_save_base);
     omap->add_string("command", "save");
-    omap->add_item("content", save(true));
+    omap->add_item("content", content);
     omap->add_num("steam_id", steam_id);
     omap->add_string("steam_username", steam_username);
-    post_to_server(omap, sync);
+    fetch_from_server(omap, &save_from_server);
 }
 
 void GameState::score_submit(int level, bool sync)
@@ -383,7 +814,9 @@ void GameState::score_submit(int level, bool sync)
     omap->add_string("command", "score_submit");
     omap->add_num("level_index", level);
     omap->add_num("version", COMPRESSURE_VERSION);
-    omap->add_item("levels", edited_level_set->levels[level]->best_design->save_all(highest_level, true));
+    SaveTreeWriter writer;
+    edited_level_set->levels[level]->best_design.save(writer);
+    omap->add_item("levels", writer.take());
     omap->add_num("steam_id", steam_id);
     omap->add_string("steam_username", steam_username);
     post_to_server(omap, sync);
@@ -530,7 +963,6 @@ GameState::~GameState()
     delete level_set_price;
     delete level_set_steam;
     delete clipboard_level_set;
-    delete languages;
 
 	SDL_DestroyTexture(sdl_texture);
 	SDL_DestroyTexture(sdl_tutorial_texture);
@@ -548,6 +980,11 @@ SDL_Texture* GameState::loadTexture(const char* filename)
     SDL_Surface* loadedSurface = IMG_Load(filename);
 //    SDL_Surface* loadedSurface = IMG_Load_RW(SDL_RWFromMem((void*)&embedded_data_binary_texture_png_start,
 //                                    &embedded_data_binary_texture_png_end - &embedded_data_binary_texture_png_start),1);
+    return loadTexture(loadedSurface);
+}
+
+SDL_Texture* GameState::loadTexture(SDL_Surface* loadedSurface)
+{
 	assert(loadedSurface);
     SDL_Texture* new_texture = SDL_CreateTextureFromSurface(sdl_renderer, loadedSurface);
 	assert(new_texture);
@@ -557,6 +994,8 @@ SDL_Texture* GameState::loadTexture(const char* filename)
 
 void GameState::advance()
 {
+    TRACE_SCOPE("GameState::advance");
+    FrameStageTimer stage_timer(frame_stats, FRAME_STAGE_SIM);
     unsigned period = 200;
     unsigned time = SDL_GetTicks();
 
@@ -585,7 +1024,10 @@ void GameState::advance()
         debug_frames = 0;
         debug_last_time = SDL_GetTicks();
     }
-    deal_with_design_fetch();
+    {
+        FrameStageTimer network_timer(frame_stats, FRAME_STAGE_NETWORK);
+        deal_with_design_fetch();
+    }
 
     int count = pow(1.2, game_speed) * 2;
     if (game_speed == 0)
@@ -668,6 +1110,8 @@ void GameState::advance()
 
 void GameState::audio()
 {
+    TRACE_SCOPE("GameState::audio");
+    FrameStageTimer stage_timer(frame_stats, FRAME_STAGE_AUDIO);
     Mix_Volume(0, pressure_as_percent(current_circuit->last_vented*10) * sound_volume / 100);
     Mix_Volume(1, pressure_as_percent(current_circuit->last_moved*10) * sound_volume / 100);
     Mix_VolumeMusic(music_volume);
@@ -776,8 +1220,13 @@ void GameState::render_text(XYPos tl, const char* string, SDL_Color color, int m
         {
             std::string sub = text.substr(prev, pos - prev);
 
-            SDL_Surface* text_surface = TTF_RenderUTF8_Blended(font, sub.c_str(), color);
-            SDL_Texture* new_texture = SDL_CreateTextureFromSurface(sdl_renderer, text_surface);
+            SDL_Surface* text_surface;
+            SDL_Texture* new_texture;
+            {
+                FrameStageTimer text_timer(frame_stats, FRAME_STAGE_TEXT);
+                text_surface = TTF_RenderUTF8_Blended(font, sub.c_str(), color);
+                new_texture = SDL_CreateTextureFromSurface(sdl_renderer, text_surface);
+            }
 
             SDL_Rect src_rect;
             SDL_GetClipRect(text_surface, &src_rect);
@@ -1133,15 +1582,32 @@ void GameState::render_button(XYPos pos, XYPos content, unsigned colour, const c
         texture = sdl_texture;
     render_texture_custom(texture, src_rect, dst_rect);
     if (((mouse - pos)/scale).inside(XYPos(32,32)) && tooltip)
-        tooltip_string = tooltip;
+        set_tooltip(tooltip);
+}
+
+// The translation is looked up by id, which is only resolved again when the
+// mouse moves onto something with a different tooltip.
+
+void GameState::set_tooltip(const std::string& text, bool translate)
+{
+    tooltip_string = text;
+    tooltip_translate = translate;
+    if (translate && tooltip_key != text)
+    {
+        tooltip_key = text;
+        tooltip_id = translation.get_tooltip_id(tooltip_key);
+    }
 }
 
 void GameState::render_tooltip()
 {
     if (tooltip_string != "")
     {
-        if (current_language->get_item("tooltips")->get_map()->has_key(tooltip_string.c_str()))
-            tooltip_string = current_language->get_item("tooltips")->get_map()->get_string(tooltip_string.c_str());
+        if (tooltip_translate)
+        {
+            if (const std::string* translated = translation.tooltip(tooltip_id))
+                tooltip_string = *translated;
+        }
         XYPos tip_size = get_text_size(tooltip_string) + XYPos(2,0);
         XYPos tip_pos = mouse / scale - XYPos(tip_size.x, 0);
         if (tip_pos.x < 0)
@@ -1530,12 +1996,20 @@ void GameState::render_grid(int scale, XYPos grid_offset)
 
 void GameState::render(bool saving)
 {
+    TRACE_SCOPE("GameState::render");
+    FrameStageTimer stage_timer(frame_stats, FRAME_STAGE_RENDER);
     if ((frame_index % 100) == 0)
         check_clipboard();
-    deal_with_scores();
-    deal_with_server_levels_from_server();
-    deal_with_paste_from_server();
-    current_circuit->render_prep();
+    {
+        FrameStageTimer network_timer(frame_stats, FRAME_STAGE_NETWORK);
+        deal_with_scores();
+        deal_with_server_levels_from_server();
+        deal_with_paste_from_server();
+    }
+    {
+        FrameStageTimer prep_timer(frame_stats, FRAME_STAGE_RENDER_PREP);
+        current_circuit->render_prep();
+    }
 
     SDL_RenderClear(sdl_renderer);
     XYPos window_size;
@@ -2358,14 +2832,14 @@ void GameState::render(bool saving)
                     src_rect = {432 + 2 * 96, 80, 16, 16};
                 render_texture(src_rect, dst_rect);
                 if (((mouse - XYPos(dst_rect.x, dst_rect.y))/scale).inside(XYPos(16,16)))
-                    tooltip_string = "Save";
+                    set_tooltip("Save");
                 src_rect.y += 32;
                 dst_rect.y -= 16 * scale;
                 if (current_level->saved_designs[i])                     // restore stars star
                 {
                     render_texture(src_rect, dst_rect);
                     if (((mouse - XYPos(dst_rect.x, dst_rect.y))/scale).inside(XYPos(16,16)))
-                        tooltip_string = "Restore";
+                        set_tooltip("Restore");
                 }
             }
         }
@@ -2378,7 +2852,7 @@ void GameState::render(bool saving)
             SDL_Rect dst_rect = {panel_offset.x + (0) * scale, panel_offset.y + (32 + 8 + 16) * scale, 16 * scale, 16 * scale};
             render_texture(src_rect, dst_rect);
             if (((mouse - XYPos(panel_offset.x + (0) * scale, panel_offset.y + (32 + 8 + 16) * scale))/scale).inside(XYPos(16,16)))
-                tooltip_string = "Best solution";
+                set_tooltip("Best solution");
 
         }
 
@@ -2836,9 +3310,9 @@ void GameState::render(bool saving)
         if (level->global_score_graph_set && pos.y >= 0 && pos.x >= 0 && pos.x < 200)
         {
             if (test_mode == TEST_MODE_ACCURACY)
-                tooltip_string = std::to_string(pressure_as_percent_float(level->global_score_graph[pos.x]));
+                set_tooltip(std::to_string(pressure_as_percent_float(level->global_score_graph[pos.x])), false);
             else
-                tooltip_string = std::to_string(level->global_score_graph[pos.x]);
+                set_tooltip(std::to_string(level->global_score_graph[pos.x]), false);
         }
 
     } else if (panel_state == PANEL_STATE_SCORES && show_server_levels)
@@ -2881,6 +3355,18 @@ void GameState::render(bool saving)
     {
         render_number_2digit(XYPos(0, 0), debug_last_second_frames, 3*scale);
         render_number_long(XYPos(0, 3 * 7 * scale), debug_last_second_simticks, 3*scale);
+        XYPos pos(0, 3 * 7 * 2 * scale);
+        for (unsigned i = 0; i <= FRAME_STAGE_COUNT; i++)
+        {
+            LatencyHistogram histogram = i < FRAME_STAGE_COUNT ? frame_stats.stage_histogram(FrameStage(i)) : frame_stats.frame_histogram();
+            char line[128];
+            snprintf(line, sizeof(line), "%-12s p50 %6.2f  p99 %6.2f  max %6.2f ms  slow %llu",
+                     i < FRAME_STAGE_COUNT ? frame_stage_names[i] : "frame",
+                     histogram.percentile(50) / 1000.0, histogram.percentile(99) / 1000.0, histogram.max / 1000.0,
+                     (unsigned long long)(i < FRAME_STAGE_COUNT ? frame_stats.slow_by_stage[i] : frame_stats.slow_frames));
+            render_text(pos, line, {0xff,0xff,0xff}, scale);
+            pos.y += TTF_FontLineSkip(font) * scale;
+        }
     }
     if ((show_dialogue || show_dialogue_hint || show_dialogue_discord_prompt) && !display_language_dialogue)
     {
@@ -2898,7 +3384,9 @@ void GameState::render(bool saving)
         if (show_dialogue_discord_prompt)
         {
             character = DIALOGUE_CHARLES;
-            text = "If you are stuck, consider discussing your challenges with the brightest minds of our High Pressure Steam Society on Discord. Press Esc and click the \"Join our Discord group\" button.";
+            text = discord_prompt;
+            if (const std::string* translated = translation.tooltip(discord_prompt_tooltip_id))
+                text = *translated;
         }
         else
         {
@@ -2906,11 +3394,11 @@ void GameState::render(bool saving)
             std::string who = "charles";
             if (current_level_index < LEVEL_COUNT)
             {
-                const char* key = show_dialogue_hint ? "hints" : "dialogue";
-                if (current_language->has_key(key) && current_language->get_item(key)->is_list())
+                std::vector<std::vector<Translation::DialogueScreen>>& levels = show_dialogue_hint ? translation.hints : translation.dialogue;
+                if (current_level_index < levels.size())
                 {
-                    SaveObjectList* lis = current_language->get_item(key)->get_list()->get_item(current_level_index)->get_list();
-                    dialogue_index_max = lis->get_count();
+                    std::vector<Translation::DialogueScreen>& lis = levels[current_level_index];
+                    dialogue_index_max = lis.size();
                     if (dialogue_sat_inc && ((dialogue_index + 1) < dialogue_index_max))
                     {
                         dialogue_index++;
@@ -2919,9 +3407,8 @@ void GameState::render(bool saving)
                         
                     if (dialogue_index < dialogue_index_max)
                     {
-                        SaveObjectMap* dia = lis->get_item(dialogue_index)->get_map();
-                        text = dia->get_string("text");
-                        who = dia->get_string("who");
+                        text = lis[dialogue_index].text;
+                        who = lis[dialogue_index].who;
                         fail = false;
                     }
                 }
@@ -2971,9 +3458,6 @@ void GameState::render(bool saving)
         }
         if (show_dialogue || show_dialogue_hint || show_dialogue_discord_prompt)
         {
-        
-            if (current_language->get_item("tooltips")->get_map()->has_key(text))
-                text = current_language->get_item("tooltips")->get_map()->get_string(text);
 
             if (show_dialogue || show_dialogue_hint || show_dialogue_discord_prompt)
             {
@@ -3191,7 +3675,9 @@ void GameState::render(bool saving)
             
 
             HelpPage* page = &pages[show_help_page * 2 + i];
-            std::string text = current_language->get_item("help")->get_list()->get_string(show_help_page * 2 + i).c_str();
+            std::string text;
+            if (show_help_page * 2 + i < translation.help.size())
+                text = translation.help[show_help_page * 2 + i];
 
             if (page->frame_count == 0)
                 continue;
@@ -3215,10 +3701,10 @@ void GameState::render(bool saving)
         render_box(XYPos(160 * scale, 90 * scale), XYPos(320, 200), 0, scale);
         int i = 0;
         int col = 0;
-        for (std::map<std::string, SaveObject*>::iterator it = languages->omap.begin(); it != languages->omap.end(); ++it)
+        for (std::string& name : translation.languages)
         {
             render_box(XYPos((160 + 32 + col * 160) * scale, (90 + 16 + i * 24) * scale), XYPos(160 - 64, 24), 0, scale);
-            render_text(XYPos((160 + 32 + 4 + col * 160), (90 + 16 + i * 24 + 5)) * scale, it->first.c_str());
+            render_text(XYPos((160 + 32 + 4 + col * 160), (90 + 16 + i * 24 + 5)) * scale, name.c_str());
             i++;
             if (i >= 7)
             {
@@ -3296,11 +3782,20 @@ void GameState::render(bool saving)
         render_texture(src_rect, dst_rect);
     }
 
-    SDL_RenderPresent(sdl_renderer);
+    {
+        FrameStageTimer present_timer(frame_stats, FRAME_STAGE_PRESENT);
+        SDL_RenderPresent(sdl_renderer);
+    }
 }
 
+// Some edits change the current level in place without going through Level,
+// so it is marked changed when it is left, here or in set_level_set, and
+// when a snapshot is taken.
+
 void GameState::set_level(int level_index)
 {
+    if (level_set == edited_level_set && current_level_index < level_set->levels.size())
+        level_set->levels[current_level_index]->changed();
     dialogue_index = 0;
     editing_level = false;
     if (!level_set->is_playable(level_index, highest_level))
@@ -4000,7 +4495,7 @@ void GameState::mouse_click_in_panel(unsigned clicks)
             if (free_level_set_on_return)
                 delete level_set;
             deletable_level_set = NULL;
-            set_level_set(edited_level_set->levels[current_level_index]->help_design);
+            set_level_set(edited_level_set->levels[current_level_index]->help_design.get());
             free_level_set_on_return = false;
             set_current_circuit_read_only();
             current_level_set_is_inspected = true;
@@ -4075,13 +4570,17 @@ void GameState::mouse_click_in_panel(unsigned clicks)
                     }
                 }
                 if (changed)
+                {
+                    level_set->levels[current_level_index]->changed();
                     set_level_set(level_set);
+                }
             }
             else
             {
                 if (level_set->levels[current_level_index]->icon_pixels[pixel_pos.y][pixel_pos.x + editing_icon_index * 24] != pixel_colour)
                 {
                     level_set->levels[current_level_index]->icon_pixels[pixel_pos.y][pixel_pos.x + editing_icon_index * 24] = pixel_colour;
+                    level_set->levels[current_level_index]->changed();
                     set_level_set(level_set);
                 }
             }
@@ -4238,10 +4737,8 @@ void GameState::mouse_click_in_panel(unsigned clicks)
                     omap->add_num("level_index", current_level_index);
                     omap->add_num("version", COMPRESSURE_VERSION);
                     omap->add_item("levels", edited_level_set->save_one(current_level_index));
-                    std::ostringstream stream;
-                    omap->save(stream);
+                    std::string comp = compress_string_zstd(omap->to_string(), COMPRESS_INTERACTIVE);
                     delete omap;
-                    std::string comp = compress_string_zstd(stream.str());
 
                     SDL_Texture* my_canvas = SDL_CreateTexture(sdl_renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, 360, 360);
                     SDL_SetTextureBlendMode(my_canvas, SDL_BLENDMODE_BLEND);
@@ -4330,7 +4827,7 @@ void GameState::mouse_click_in_panel(unsigned clicks)
                     else if (clicks == 1)
                     {
                         std::string comp;
-                        comp = compress_string_zstd(stream.str());
+                        comp = compress_string_zstd(stream.str(), COMPRESS_INTERACTIVE);
                         std::u32string s32;
 
                         s32 += 0x1F682;                 // steam engine
@@ -4360,7 +4857,7 @@ void GameState::mouse_click_in_panel(unsigned clicks)
                         SaveObjectMap* pmap = new SaveObjectMap;
                         pmap->add_num("paste_id", paste_id);
                         std::string comp;
-                        comp = compress_string_zstd(pmap->to_string());
+                        comp = compress_string_zstd(pmap->to_string(), COMPRESS_INTERACTIVE);
                         delete pmap;
                         std::u32string s32;
 
@@ -4410,7 +4907,7 @@ void GameState::mouse_click_in_panel(unsigned clicks)
                         {
                             std::string level_name = current_level->name;
                             deletable_level_set = &current_level->saved_designs[index];
-                            set_level_set(current_level->saved_designs[index]);
+                            set_level_set(current_level->saved_designs[index].get());
                             set_current_circuit_read_only();
                             current_level_set_is_inspected = true;
                             set_level(level_name);
@@ -4453,12 +4950,14 @@ void GameState::mouse_click_in_panel(unsigned clicks)
         {
             current_level->tests.insert(current_level->tests.begin() + current_level->test_index, current_level->tests[current_level->test_index]);
             current_level->test_index++;
+            current_level->changed();
         }
         if (editing_level && (panel_grid_pos == XYPos(current_level->tests.size() + 1, 3)))
         {
             if (current_level->tests.size() > 1)
             {
                 current_level->tests.erase(current_level->tests.begin() + current_level->test_index);
+                current_level->changed();
 
                 if (current_level->test_index >= current_level->tests.size())
                 {
@@ -4471,7 +4970,7 @@ void GameState::mouse_click_in_panel(unsigned clicks)
         {
             std::string level_name = current_level->name;
             deletable_level_set = &current_level->best_design;
-            set_level_set(current_level->best_design);
+            set_level_set(current_level->best_design.get());
             set_current_circuit_read_only();
             current_level_set_is_inspected = true;
             set_level(level_name);
@@ -4499,14 +4998,17 @@ void GameState::mouse_click_in_panel(unsigned clicks)
                         s_index--;
                 }
                 current_level->substep_count = s_steps[s_index];
+                current_level->changed();
             }
             if (panel_pos.x >= 132 && panel_pos.x < 148)
             {
                 current_level->tests[current_level->test_index].first_simpoint = current_level->sim_point_index;
+                current_level->changed();
             }
             if (panel_pos.x >= 156 && panel_pos.x < 172)
             {
                 current_level->tests[current_level->test_index].reset = TestResetType((current_level->tests[current_level->test_index].reset + 1) % 3);
+                current_level->changed();
             }
             for (int i = 0 ; i < 4; i++)
             {
@@ -4544,6 +5046,7 @@ void GameState::mouse_click_in_panel(unsigned clicks)
                         current_level->pin_order[p] = i;
                         current_level->connection_mask |= 1 << i;
                     }
+                    current_level->changed();
                     set_level_set(level_set);
                 }
             }
@@ -4565,6 +5068,7 @@ void GameState::mouse_click_in_panel(unsigned clicks)
                 if ((subtest_pos.y >= offset) && (subtest_pos.y < (offset + 16)))
                 {
                     current_level->tests[current_level->test_index].tested_direction = Direction(pin_index);
+                    current_level->changed();
                     break;
                 }
             }
@@ -4588,6 +5092,7 @@ void GameState::mouse_click_in_panel(unsigned clicks)
                     std::vector<SimPoint> &sim_points = current_level->tests[current_level->test_index].sim_points;
                     sim_points.insert(sim_points.begin() + current_level->sim_point_index, sim_points[current_level->sim_point_index]);
                     current_level->sim_point_index++;
+                    current_level->changed();
                 }
                 else if (subtest_pos.y >= 32 && subtest_pos.y < 48)
                 {
@@ -4601,7 +5106,7 @@ void GameState::mouse_click_in_panel(unsigned clicks)
                         if (current_level->tests[current_level->test_index].first_simpoint >= current_level->tests[current_level->test_index].sim_points.size())
                             current_level->tests[current_level->test_index].first_simpoint = current_level->tests[current_level->test_index].sim_points.size() - 1;
                         current_level->current_simpoint = current_level->tests[current_level->test_index].sim_points[current_level->sim_point_index];
-
+                        current_level->changed();
                     }
                 
                 }
@@ -4751,13 +5256,17 @@ void GameState::mouse_motion()
                         }
                     }
                     if (changed)
+                    {
+                        level_set->levels[current_level_index]->changed();
                         set_level_set(level_set);
+                    }
                 }
                 else
                 {
                     if (level_set->levels[current_level_index]->icon_pixels[pixel_pos.y][pixel_pos.x + editing_icon_index * 24] != 8)
                     {
                         level_set->levels[current_level_index]->icon_pixels[pixel_pos.y][pixel_pos.x + editing_icon_index * 24] = 8;
+                        level_set->levels[current_level_index]->changed();
                         set_level_set(level_set);
                     }
                 }
@@ -4844,6 +5353,7 @@ void GameState::mouse_motion()
         if (editing_level)
         {
             current_level->tests[current_level->test_index].sim_points[current_level->sim_point_index] = current_level->current_simpoint;
+            current_level->changed();
         }
         return;
     }
@@ -4868,13 +5378,17 @@ void GameState::mouse_motion()
                     }
                 }
                 if (changed)
+                {
+                    level_set->levels[current_level_index]->changed();
                     set_level_set(level_set);
+                }
             }
             else
             {
                 if (level_set->levels[current_level_index]->icon_pixels[pixel_pos.y][pixel_pos.x + editing_icon_index * 24] != pixel_colour)
                 {
                     level_set->levels[current_level_index]->icon_pixels[pixel_pos.y][pixel_pos.x + editing_icon_index * 24] = pixel_colour;
+                    level_set->levels[current_level_index]->changed();
                     set_level_set(level_set);
                 }
             }
@@ -4894,6 +5408,8 @@ void replace_string_all(std::string& subject, const std::string search, const st
 
 bool GameState::events()
 {
+    TRACE_SCOPE("GameState::events");
+    FrameStageTimer stage_timer(frame_stats, FRAME_STAGE_EVENTS);
     SDL_Event e;
     while(SDL_PollEvent(&e))
     {
@@ -5410,10 +5926,8 @@ bool GameState::events()
                         omap->add_num("level_index", current_level_index);
                         omap->add_num("version", COMPRESSURE_VERSION);
                         omap->add_item("levels", edited_level_set->save_one(current_level_index));
-                        std::ostringstream stream;
-                        omap->save(stream);
+                        std::string reply = omap->to_string();
                         delete omap;
-                        std::string reply = stream.str();
                         clip::set_text(reply);
                         break;
                     }
@@ -5426,6 +5940,16 @@ bool GameState::events()
                         delete sav;
                         break;
                     }
+                    case SDL_SCANCODE_F9:
+                    {
+                        char* pref_path = SDL_GetPrefPath("CharlieBrej", "ComPressure");
+                        std::string summary_filename = std::string(pref_path) + "frame_stats.csv";
+                        std::string history_filename = std::string(pref_path) + "frame_times.csv";
+                        SDL_free(pref_path);
+                        frame_stats.write_csv(summary_filename, history_filename);
+                        printf("frame stats written to %s and %s\n", summary_filename.c_str(), history_filename.c_str());
+                        break;
+                    }
                    case SDL_SCANCODE_F11:
                         full_screen = !full_screen;
                         SDL_SetWindowFullscreen(sdl_window, full_screen? SDL_WINDOW_FULLSCREEN_DESKTOP : 0);
@@ -5439,7 +5963,10 @@ bool GameState::events()
                             if (keyboard_shift)
                                 global_design_submit(current_level_index);
                             else
+                            {
                                 current_level->global = !current_level->global;
+                                current_level->changed();
+                            }
                         }
                         break;
                     case SDL_SCANCODE_LSHIFT:
@@ -5610,13 +6137,12 @@ bool GameState::events()
                     {
                         int i = 0;
                         int col = 0;
-                        for (std::map<std::string, SaveObject*>::iterator it = languages->omap.begin(); it != languages->omap.end(); it++)
+                        for (std::string& name : translation.languages)
                         {
                             if ((mouse / scale - XYPos((160 + 32 + col * 160), (90 + 16 + i * 24))).inside(XYPos(160 - 64, 24)))
                             {
-                                language_name = it->first;
-                                load_lang();
-                                current_language = languages->get_item(language_name)->get_map();
+                                language_name = name;
+                                translation.load(language_name);
                                 break;
                             }
                             i++;
@@ -5704,8 +6230,8 @@ bool GameState::events()
                                 current_level_set_is_inspected = false;
                                 if (deletable_level_set)
                                 {
-                                    delete *deletable_level_set;
-                                    *deletable_level_set = NULL;
+                                    deletable_level_set->clear();
+                                    current_level->changed();
                                 }
                                 else if (free_level_set_on_return)
                                 {
@@ -5983,6 +6509,8 @@ static uint32_t get_hidden_val(uint32_t** dat, unsigned roff, unsigned goff, uns
 
 void GameState::check_clipboard()
 {
+    TRACE_SCOPE("GameState::check_clipboard");
+    FrameStageTimer stage_timer(frame_stats, FRAME_STAGE_CLIPBOARD);
     clip::set_x11_wait_timeout(1);
     std::string new_value;
     std::string comp;
@@ -6056,8 +6584,7 @@ void GameState::check_clipboard()
             if (decomp == "")
                 return;
         }
-        std::istringstream decomp_stream(decomp);
-        omap = SaveObject::load(decomp_stream)->get_map();
+        omap = SaveObject::load(decomp)->get_map();
         if (omap->has_key("paste_id"))
         {
             paste_fetch(omap->get_num("paste_id"));
@@ -6116,15 +6643,18 @@ void GameState::deal_with_scores()
             
             
             level->global_fetched_score = omap->get_num("score");
-            SaveObjectList* glist = omap->get_item("graph")->get_list();
+            std::vector<int64_t> graph;
+            omap->get_item("graph")->get_ints(graph);
+            if (graph.size() < 200)
+                throw(std::runtime_error("Bad list index"));
             for (unsigned i = 0; i < 200; i++)
             {
-                level->global_score_graph[i] = glist->get_num(i);
+                level->global_score_graph[i] = graph[i];
             }
             level->global_score_graph_set = true;
             level->friend_scores.clear();
             
-            glist = omap->get_item("friend_scores")->get_list();
+            SaveObjectList* glist = omap->get_item("friend_scores")->get_list();
             for (unsigned i = 0; i < glist->get_count(); i++)
             {
                 SaveObjectMap* fmap = glist->get_item(i)->get_map();
@@ -6237,6 +6767,8 @@ void GameState::deal_with_design_fetch()
 
 void GameState::set_level_set(LevelSet* new_level_set)
 {
+    if (level_set == edited_level_set && current_level_index < level_set->levels.size())
+        level_set->levels[current_level_index]->changed();
     level_set = new_level_set;
     for (int i = LEVEL_COUNT; i < level_set->levels.size(); i++)
     {
@@ -3,6 +3,8 @@
 #include "Circuit.h"
 #include "Level.h"
 #include "Compress.h"
+#include "Stats.h"
+#include "Translation.h"
 
 #include <SDL.h>
 #include <SDL_image.h>
@@ -21,6 +23,26 @@ struct ServerResp
     SDL_SpinLock working = 0;
 };
 
+// An immutable copy of the game for saving, taken on the main thread.  The
+// levels in it are shared with the game rather than copied, so it is cheap
+// to take, and it can be written out on any thread.
+
+class SaveSnapshot
+{
+public:
+    SaveObjectMap* settings;
+    LevelSetSnapshot levels[3];
+
+    SaveSnapshot():
+        settings(new SaveObjectMap)
+    {}
+    ~SaveSnapshot()
+    {
+        delete settings;
+    }
+    void save(SaveWriter& writer);
+};
+
 class GameState
 {
 public:
@@ -87,8 +109,7 @@ public:
     };
 
     std::string language_name = "English";
-    SaveObjectMap* languages = NULL;
-    SaveObjectMap* current_language;
+    Translation translation;
 
     ScrollBar level_select_scroll = ScrollBar(4, XYPos(640 - 22, 48), 4 * 32);
     ScrollBar friend_score_scroll = ScrollBar(11, XYPos(640 - 22, 48), 11 * 16);
@@ -113,6 +134,16 @@ public:
     ServerResp scores_from_server;
     ServerResp design_from_server;
     ServerResp paste_from_server;
+    ServerResp save_from_server;
+    ServerResp capabilities_from_server;
+    bool server_binary = false;
+    bool server_save_delta = false;
+
+    uint64_t server_save_base = 0;
+    std::vector<uint64_t> server_save_hashes[3];
+    std::string server_save_settings;
+    std::vector<uint64_t> pending_save_hashes[3];
+    std::string pending_save_settings;
 
     LevelSet* level_set_accuracy;
     LevelSet* level_set_price;
@@ -121,6 +152,12 @@ public:
     
     LevelSet* level_set;
     LevelSet* edited_level_set;
+
+    unsigned save_generation = 0;
+    unsigned journal_records = 0;
+    bool snapshot_needed = true;
+    int journal_highest_level = -1;
+    int64_t journal_torn_at = -1;
     bool free_level_set_on_return = false;
     Level* current_level;
 
@@ -146,7 +183,7 @@ public:
     LevelSet* clipboard_level_set = NULL;
     int clipboard_level_index;
 
-    LevelSet** deletable_level_set = NULL;
+    LazyLevelSet* deletable_level_set = NULL;
 
     bool skip_to_next_subtest = false;
     int skip_to_subtest_index = -1;
@@ -183,6 +220,7 @@ public:
 
     unsigned debug_last_second_frames = 0;
     unsigned debug_last_second_simticks = 0;
+    FrameStats frame_stats;
     unsigned minutes_played = 0;
 
     bool show_help = false;
@@ -211,6 +249,10 @@ public:
 
 
     std::string tooltip_string;
+    std::string tooltip_key;
+    unsigned tooltip_id = 0;
+    bool tooltip_translate = false;
+    unsigned discord_prompt_tooltip_id = 0;
 
 //    bool requesting_help = false;
 
@@ -276,12 +318,19 @@ public:
     
 
     void load_lang();
-    GameState(std::ifstream& loadfile);
+    GameState(std::ifstream& loadfile, std::ifstream& journalfile);
     SaveObject* save(bool lite = false);
+    void save(SaveWriter& writer, bool lite = false);
+    SaveSnapshot* snapshot(bool lite, bool journal);
+    SaveSnapshot* save_snapshot();
+    SaveSnapshot* save_journal();
+    void save_finished(bool full, bool ok);
     void save(std::ostream& outfile, bool lite = false);
     void save(const char* filename, bool lite = false);
     void post_to_server(SaveObject* send, bool sync);
     void fetch_from_server(SaveObject* send, ServerResp* resp);
+    void capabilities_fetch();
+    void capabilities_update();
     void save_to_server(bool sync = false);
     void score_submit(int level_index, bool sync = false);
     void paste_submit(int level, uint64_t paste_id);
@@ -296,6 +345,7 @@ public:
 
     ~GameState();
     SDL_Texture* loadTexture(const char* filename);
+    SDL_Texture* loadTexture(SDL_Surface* loadedSurface);
 
     void audio();
     XYPos get_text_size(std::string& text);
@@ -310,6 +360,7 @@ public:
     int render_number_compact_get_width(int64_t value, unsigned scale_mul = 1);
     void render_box(XYPos pos, XYPos size, unsigned colour, int scale);
     void render_button(XYPos pos, XYPos content, unsigned colour, const char* tooltip = NULL, SDL_Texture* texture = NULL, int myscale = 0);
+    void set_tooltip(const std::string& text, bool translate = true);
     void render_tooltip();
     void render_scroll_bar(ScrollBar& sbar);
 
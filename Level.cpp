@@ -1,5 +1,6 @@
 #include "Level.h"
 #include "SaveState.h"
+#include "Stats.h"
 
 #include <iostream>
 #include <iomanip>
@@ -13,16 +14,7 @@
 #include <sstream>
 #include <codecvt>
 
-static SaveObjectList* make_level_desc()
-{
-    std::string text;
-    #include "Level.string"
-    std::istringstream decomp_stream(text);
-
-    return SaveObject::load(decomp_stream)->get_list();
-}
-
-SaveObjectList* level_desc = make_level_desc();
+#include "Level.tables"
 
 Test::Test()
 {
@@ -35,54 +27,57 @@ Test::Test()
 
 }
 
-void Test::load(SaveObjectMap* player_map, SaveObjectMap* test_map)
+void Test::load_scores(SaveObjectMap* player_map)
 {
-    if (player_map && player_map->has_key("last_score"))
+    if (player_map && player_map->has_key(SAVE_KEY_LAST_SCORE))
     {
-        last_score = player_map->get_num("last_score");
-        best_score = player_map->get_num("best_score");
+        last_score = player_map->get_num(SAVE_KEY_LAST_SCORE);
+        best_score = player_map->get_num(SAVE_KEY_BEST_SCORE);
 
-        {
-            SaveObjectList* slist = player_map->get_item("best_pressure_log")->get_list();
-            for (int i = 0; i < HISTORY_POINT_COUNT; i++)
-                best_pressure_log[i] = slist->get_num(i);
-        }
+        std::vector<int64_t> log;
+        player_map->get_item(SAVE_KEY_BEST_PRESSURE_LOG)->get_ints(log);
+        if (log.size() < HISTORY_POINT_COUNT)
+            throw(std::runtime_error("Bad list index"));
+        for (int i = 0; i < HISTORY_POINT_COUNT; i++)
+            best_pressure_log[i] = log[i];
 
-        {
-            SaveObjectList* slist = player_map->get_item("last_pressure_log")->get_list();
-            for (int i = 0; i < HISTORY_POINT_COUNT; i++)
-                last_pressure_log[i] = slist->get_num(i);
-        }
-        last_pressure_index = player_map->get_num("last_pressure_index");
+        player_map->get_item(SAVE_KEY_LAST_PRESSURE_LOG)->get_ints(log);
+        if (log.size() < HISTORY_POINT_COUNT)
+            throw(std::runtime_error("Bad list index"));
+        for (int i = 0; i < HISTORY_POINT_COUNT; i++)
+            last_pressure_log[i] = log[i];
+        last_pressure_index = player_map->get_num(SAVE_KEY_LAST_PRESSURE_INDEX);
     }
-    
-    if (test_map->has_key("tested_direction"))
-        tested_direction = Direction(test_map->get_num("tested_direction"));
-    if (test_map->has_key("reset"))
-        reset = TestResetType(test_map->get_num("reset"));
-    if (test_map->has_key("first_simpoint"))
-        first_simpoint = test_map->get_num("first_simpoint");
-
-    SaveObjectList* pointlist = test_map->get_item("points")->get_list();
+}
+
+void Test::load(SaveObjectMap* player_map, SaveObjectMap* test_map)
+{
+    load_scores(player_map);
+    if (test_map->has_key(SAVE_KEY_TESTED_DIRECTION))
+        tested_direction = Direction(test_map->get_num(SAVE_KEY_TESTED_DIRECTION));
+    if (test_map->has_key(SAVE_KEY_RESET))
+        reset = TestResetType(test_map->get_num(SAVE_KEY_RESET));
+    if (test_map->has_key(SAVE_KEY_FIRST_SIMPOINT))
+        first_simpoint = test_map->get_num(SAVE_KEY_FIRST_SIMPOINT);
+
+    SaveObjectList* pointlist = test_map->get_item(SAVE_KEY_POINTS)->get_list();
     for (unsigned j = 0; j < pointlist->get_count(); j++)
     {
         SimPoint point;
         SaveObjectMap* point_map = pointlist->get_item(j)->get_map();
-        if (point_map->has_key("N")) point.values[0] = point_map->get_num("N");
-        if (point_map->has_key("E")) point.values[1] = point_map->get_num("E");
-        if (point_map->has_key("S")) point.values[2] = point_map->get_num("S");
-        if (point_map->has_key("W")) point.values[3] = point_map->get_num("W");
-
-        if (point_map->has_key("NF")) point.force[0] = point_map->get_num("NF");
-        else point.force[0] = tested_direction == DIRECTION_N ? 0 : 50;
-        if (point_map->has_key("EF")) point.force[1] = point_map->get_num("EF");
-        else point.force[1] = tested_direction == DIRECTION_E ? 0 : 50;
-        if (point_map->has_key("SF")) point.force[2] = point_map->get_num("SF");
-        else point.force[2] = tested_direction == DIRECTION_S ? 0 : 50;
-        if (point_map->has_key("WF")) point.force[3] = point_map->get_num("WF");
-        else point.force[3] = tested_direction == DIRECTION_W ? 0 : 50;
-
-        if (point_map->has_key("PRESET"))
+        static const SaveKey value_keys[4] = {SAVE_KEY_N, SAVE_KEY_E, SAVE_KEY_S, SAVE_KEY_W};
+        static const SaveKey force_keys[4] = {SAVE_KEY_NF, SAVE_KEY_EF, SAVE_KEY_SF, SAVE_KEY_WF};
+        for (int d = 0; d < 4; d++)
+        {
+            if (SaveObject* value = point_map->find(value_keys[d]))
+                point.values[d] = value->get_num();
+            if (SaveObject* force = point_map->find(force_keys[d]))
+                point.force[d] = force->get_num();
+            else
+                point.force[d] = tested_direction == Direction(d) ? 0 : 50;
+        }
+
+        if (point_map->has_key(SAVE_KEY_PRESET))
             first_simpoint = j + 1;
 
         sim_points.push_back(point);
@@ -90,56 +85,65 @@ void Test::load(SaveObjectMap* player_map, SaveObjectMap* test_map)
 
 }
 
-SaveObject* Test::save(bool custom, bool lite)
+void Test::load(SaveObjectMap* player_map, const LevelDescTest& desc)
 {
-    SaveObjectMap* omap = new SaveObjectMap;
+    load_scores(player_map);
+    tested_direction = desc.tested_direction;
+    reset = desc.reset;
+    first_simpoint = desc.first_simpoint;
+    sim_points.assign(desc.points, desc.points + desc.point_count);
+}
+
+void Test::save(SaveWriter& writer, bool custom, bool lite)
+{
+    writer.begin_map();
     if (!lite)
     {
-        omap->add_num("last_score", last_score);
-        omap->add_num("best_score", best_score);
-
-        {
-            SaveObjectList* slist = new SaveObjectList;
-                for (int i = 0; i < HISTORY_POINT_COUNT; i++)
-                    slist->add_num(best_pressure_log[i]);
-            omap->add_item("best_pressure_log", slist);
-        }
-
-        {
-            SaveObjectList* slist = new SaveObjectList;
-            for (int i = 0; i < HISTORY_POINT_COUNT; i++)
-                slist->add_num(last_pressure_log[i]);
-            omap->add_item("last_pressure_log", slist);
-        }
-
-        omap->add_num("last_pressure_index", last_pressure_index);
+        writer.key(SAVE_KEY_BEST_PRESSURE_LOG);
+        writer.begin_ints();
+        for (int i = 0; i < HISTORY_POINT_COUNT; i++)
+            writer.num(best_pressure_log[i]);
+        writer.end_list();
+        writer.num(SAVE_KEY_BEST_SCORE, best_score);
+    }
+    if (custom && first_simpoint)
+        writer.num(SAVE_KEY_FIRST_SIMPOINT, first_simpoint);
+    if (!lite)
+    {
+        writer.num(SAVE_KEY_LAST_PRESSURE_INDEX, last_pressure_index);
+        writer.key(SAVE_KEY_LAST_PRESSURE_LOG);
+        writer.begin_ints();
+        for (int i = 0; i < HISTORY_POINT_COUNT; i++)
+            writer.num(last_pressure_log[i]);
+        writer.end_list();
+        writer.num(SAVE_KEY_LAST_SCORE, last_score);
     }
     if (custom)
     {
-        if (tested_direction != DIRECTION_E)
-            omap->add_num("tested_direction", tested_direction);
-        SaveObjectList* slist = new SaveObjectList;
+        writer.key(SAVE_KEY_POINTS);
+        writer.begin_list();
         for (SimPoint& sp: sim_points)
         {
-            SaveObjectMap* sp_map = new SaveObjectMap;
-            if (sp.values[0]) sp_map->add_num("N", sp.values[0]);
-            if (sp.values[1]) sp_map->add_num("E", sp.values[1]);
-            if (sp.values[2]) sp_map->add_num("S", sp.values[2]);
-            if (sp.values[3]) sp_map->add_num("W", sp.values[3]);
-            if (sp.force[0] != ((tested_direction == DIRECTION_N) ? 0 : 50)) sp_map->add_num("NF", sp.force[0]);
-            if (sp.force[1] != ((tested_direction == DIRECTION_E) ? 0 : 50)) sp_map->add_num("EF", sp.force[1]);
-            if (sp.force[2] != ((tested_direction == DIRECTION_S) ? 0 : 50)) sp_map->add_num("SF", sp.force[2]);
-            if (sp.force[3] != ((tested_direction == DIRECTION_W) ? 0 : 50)) sp_map->add_num("WF", sp.force[3]);
-            slist->add_item(sp_map);
+            static const int order[4] = {DIRECTION_E, DIRECTION_N, DIRECTION_S, DIRECTION_W};
+            static const SaveKey value_keys[4] = {SAVE_KEY_N, SAVE_KEY_E, SAVE_KEY_S, SAVE_KEY_W};
+            static const SaveKey force_keys[4] = {SAVE_KEY_NF, SAVE_KEY_EF, SAVE_KEY_SF, SAVE_KEY_WF};
+            writer.begin_map();
+            for (int d : order)
+            {
+                if (sp.values[d])
+                    writer.num(value_keys[d], sp.values[d]);
+                if (sp.force[d] != ((tested_direction == Direction(d)) ? 0 : 50))
+                    writer.num(force_keys[d], sp.force[d]);
+            }
+            writer.end_map();
         }
-        omap->add_item("points", slist);
+        writer.end_list();
         if (reset)
-            omap->add_num("reset", reset);
-        if (first_simpoint)
-            omap->add_num("first_simpoint", first_simpoint);
+            writer.num(SAVE_KEY_RESET, reset);
+        if (tested_direction != DIRECTION_E)
+            writer.num(SAVE_KEY_TESTED_DIRECTION, tested_direction);
     }
-
-    return omap;
+    writer.end_map();
 }
 
 Level::Level(int level_index_, bool hidden_):
@@ -157,19 +161,19 @@ Level::Level(int level_index_, SaveObject* sobj, unsigned version, bool inspecte
 {
     pin_order[0] = -1; pin_order[1] = -1; pin_order[2] = -1; pin_order[3] = -1;
     SaveObjectMap* omap = sobj->get_map();
-    circuit = new Circuit(omap->get_item("circuit")->get_map(), version);
-    if (omap->has_key("best_design"))
-        best_design = new LevelSet(omap->get_item("best_design"), version, true);
-    if (omap->has_key("saved_designs"))
+    circuit = new Circuit(omap->get_item(SAVE_KEY_CIRCUIT)->get_map(), version);
+    if (omap->has_key(SAVE_KEY_BEST_DESIGN))
+        best_design.load(omap->get_item(SAVE_KEY_BEST_DESIGN), version);
+    if (omap->has_key(SAVE_KEY_SAVED_DESIGNS))
     {
-        SaveObjectList* slist = omap->get_item("saved_designs")->get_list();
+        SaveObjectList* slist = omap->get_item(SAVE_KEY_SAVED_DESIGNS)->get_list();
         for (unsigned i = 0; i < 4; i++)
         {
             if (i < slist->get_count())
             {
                 SaveObject *sobj = slist->get_item(i);
                 if (!sobj->is_null())
-                    saved_designs[i] = new LevelSet(sobj, version, true);
+                    saved_designs[i].load(sobj, version);
             }
         }
     }
@@ -180,142 +184,108 @@ Level::Level(int level_index_, SaveObject* sobj, unsigned version, bool inspecte
 Level::~Level()
 {
     delete circuit;
-    delete best_design;
-    delete help_design;
-    for (unsigned i = 0; i < 4; i++)
-        delete saved_designs[i];
     delete texture;
 }
 
 SaveObject* Level::save(bool lite)
 {
-    SaveObjectMap* omap = new SaveObjectMap;
-    omap->add_item("circuit", circuit->save());
+    SaveTreeWriter writer;
+    save(writer, lite);
+    return writer.take();
+}
+
+static void save_dialogue(SaveWriter& writer, SaveKey key, std::list<Level::DialogueScreen>& dialogue)
+{
+    writer.key(key);
+    writer.begin_list();
+    for (Level::DialogueScreen& dia: dialogue)
+    {
+        writer.begin_map();
+        writer.string(SAVE_KEY_TEXT, dia.text);
+        writer.string(SAVE_KEY_WHO, dia.who);
+        writer.end_map();
+    }
+    writer.end_list();
+}
+
+// Keys are written in byte order, the order SaveObjectMap keeps them in.
 
-    omap->add_num("level_version", level_version);
+void Level::save(SaveWriter& writer, bool lite)
+{
+    bool custom = level_index >= LEVEL_COUNT;
+    writer.begin_map();
     if (!lite)
     {
-        omap->add_num("best_score", best_score);
-        omap->add_num("last_score", last_score);
-        omap->add_num("best_price", best_price);
-        omap->add_num("last_price", last_price);
-        omap->add_num("best_steam", best_steam);
-        omap->add_num("last_steam", last_steam);
         if (best_design)
-            omap->add_item("best_design", best_design->save_all(LEVEL_COUNT, true));
-
-        SaveObjectList* slist = new SaveObjectList;
-        for (unsigned i = 0; i < 4; i++)
-            if (saved_designs[i])
-                slist->add_item(saved_designs[i]->save_all(LEVEL_COUNT, true));
-            else
-                slist->add_item(new SaveObjectNull);
-        omap->add_item("saved_designs", slist);
+        {
+            writer.key(SAVE_KEY_BEST_DESIGN);
+            best_design.save(writer);
+        }
+        writer.num(SAVE_KEY_BEST_PRICE, best_price);
+        writer.num(SAVE_KEY_BEST_SCORE, best_score);
+        writer.num(SAVE_KEY_BEST_STEAM, best_steam);
     }
     else
     {
-        omap->add_num("best_score", score_set ? last_score : 0);
-    }
-    if (!lite || level_index >= LEVEL_COUNT)
-    {
-        SaveObjectList* slist = new SaveObjectList;
-        unsigned test_count = tests.size();
-        for (unsigned i = 0; i < test_count; i++)
-            slist->add_item(tests[i].save(level_index >= LEVEL_COUNT, lite));
-        omap->add_item("tests", slist);
+        writer.num(SAVE_KEY_BEST_SCORE, score_set ? last_score : 0);
     }
+    writer.key(SAVE_KEY_CIRCUIT);
+    circuit->save(writer);
 
-    if (level_index >= LEVEL_COUNT)
+    if (custom)
     {
-        if (description != "")
-            omap->add_string("description", description);
-        if (global)
-            omap->add_num("global", 1);
-        omap->add_string("name", name);
-        {
-            SaveObjectList* slist = new SaveObjectList;
-            for (int i = 0; i < 4; i++)
-            {
-                if (pin_order[i] < 0)
-                    break;
-                slist->add_num(pin_order[i]);
-            }
-            omap->add_item("connections", slist);
-        }
-        omap->add_num("substep_count", substep_count);
-        omap->add_item("forced_elements", circuit->save_forced());
-        
-        uint8_t base_pixels[24][24];
-
-        SaveObjectList* y_list = new SaveObjectList;
-        for (unsigned y = 0; y < 24; y++)
-        {
-            SaveObjectList* x_list = new SaveObjectList;
-            for (unsigned x = 0; x < 24; x++)
-            {
-                int colour = icon_pixels[y][x];
-                for (int i = 0; i < 8; i++)
-                {
-                    XYPos npos = DirFlip(i).trans(XYPos(x,y), 24);
-                    if (colour != icon_pixels[npos.y][npos.x + i * 24])
-                    {
-                        colour = 8;
-                        break;
-                    }
-                }
-                base_pixels[y][x] = colour;
-                x_list->add_num(colour);
-            }
-            while (x_list->get_count() && x_list->get_num(x_list->get_count() - 1) == 8)
-                x_list->pop_back();
-            y_list->add_item(x_list);
-        }
-        omap->add_item("icon_bg", y_list);
-
-        y_list = new SaveObjectList;
-        for (unsigned y = 0; y < 24; y++)
+        writer.key(SAVE_KEY_CONNECTIONS);
+        writer.begin_list();
+        for (int i = 0; i < 4; i++)
         {
-            SaveObjectList* x_list = new SaveObjectList;
-            for (unsigned x = 0; x < 24*8; x++)
-            {
-                XYPos npos = DirFlip(x / 24).trans_inv(XYPos(x%24,y), 24);
-                if (base_pixels[npos.y][npos.x] != icon_pixels[y][x])
-                    x_list->add_num(icon_pixels[y][x]);
-                else
-                    x_list->add_num(8);
-            }
-            while (x_list->get_count() && x_list->get_num(x_list->get_count() - 1) == 8)
-                x_list->pop_back();
-            y_list->add_item(x_list);
+            if (pin_order[i] < 0)
+                break;
+            writer.num(pin_order[i]);
         }
-        omap->add_item("icon", y_list);
+        writer.end_list();
+        if (description != "")
+            writer.string(SAVE_KEY_DESCRIPTION, description);
         if (!dialogue.empty())
-        {
-            SaveObjectList* dia_list = new SaveObjectList;
-            for (DialogueScreen& dia: dialogue)
-            {
-                SaveObjectMap* dia_entry = new SaveObjectMap;
-                dia_entry->add_string("text", dia.text);
-                dia_entry->add_string("who", dia.who);
-                dia_list->add_item(dia_entry);
-            }
-            omap->add_item("dialogue", dia_list);
-        }
+            save_dialogue(writer, SAVE_KEY_DIALOGUE, dialogue);
+        writer.key(SAVE_KEY_FORCED_ELEMENTS);
+        circuit->save_forced(writer);
+        if (global)
+            writer.num(SAVE_KEY_GLOBAL, 1);
         if (!hints.empty())
-        {
-            SaveObjectList* dia_list = new SaveObjectList;
-            for (DialogueScreen& dia: hints)
-            {
-                SaveObjectMap* dia_entry = new SaveObjectMap;
-                dia_entry->add_string("text", dia.text);
-                dia_entry->add_string("who", dia.who);
-                dia_list->add_item(dia_entry);
-            }
-            omap->add_item("hints", dia_list);
-        }
-
+            save_dialogue(writer, SAVE_KEY_HINTS, hints);
+        save_icon_pixels(writer, icon_pixels);
+    }
+    if (!lite)
+    {
+        writer.num(SAVE_KEY_LAST_PRICE, last_price);
+        writer.num(SAVE_KEY_LAST_SCORE, last_score);
+        writer.num(SAVE_KEY_LAST_STEAM, last_steam);
+    }
+    writer.num(SAVE_KEY_LEVEL_VERSION, level_version);
+    if (custom)
+        writer.string(SAVE_KEY_NAME, name);
+    if (!lite)
+    {
+        writer.key(SAVE_KEY_SAVED_DESIGNS);
+        writer.begin_list();
+        for (unsigned i = 0; i < 4; i++)
+            if (saved_designs[i])
+                saved_designs[i].save(writer);
+            else
+                writer.null();
+        writer.end_list();
+    }
+    if (custom)
+        writer.num(SAVE_KEY_SUBSTEP_COUNT, substep_count);
+    if (!lite || custom)
+    {
+        writer.key(SAVE_KEY_TESTS);
+        writer.begin_list();
+        for (Test& test : tests)
+            test.save(writer, custom, lite);
+        writer.end_list();
     }
-    return omap;
+    writer.end_map();
 }
 
 XYPos Level::getimage(DirFlip dir_flip)
@@ -345,49 +315,53 @@ void Level::setimage_fg_texture(WrappedTexture* texture_)
 void Level::init_tests(SaveObjectMap* omap)
 {
     SaveObjectList* slist = NULL;
-    if (omap && omap->has_key("tests"))
-        slist = omap->get_item("tests")->get_list();
+    if (omap && omap->has_key(SAVE_KEY_TESTS))
+        slist = omap->get_item(SAVE_KEY_TESTS)->get_list();
 
     unsigned loaded_level_version = 0;
-    if (omap && omap->has_key("level_version"))
-        loaded_level_version = omap->get_num("level_version");
+    if (omap && omap->has_key(SAVE_KEY_LEVEL_VERSION))
+        loaded_level_version = omap->get_num(SAVE_KEY_LEVEL_VERSION);
     
-    SaveObjectMap* desc = level_index < LEVEL_COUNT ? level_desc->get_item(level_index)->get_map() : omap;
+    SaveObjectMap* desc = omap;
 
-    if (desc)
+    if (level_index < LEVEL_COUNT)
     {
-        name = desc->get_string("name");
-        SaveObjectList* conlist = desc->get_item("connections")->get_list();
+        init_tests(level_descs[level_index], slist, loaded_level_version);
+    }
+    else if (desc)
+    {
+        name = desc->get_string(SAVE_KEY_NAME);
+        SaveObjectList* conlist = desc->get_item(SAVE_KEY_CONNECTIONS)->get_list();
         for (unsigned i = 0; i < conlist->get_count(); i++)
         {
             unsigned port_num = conlist->get_num(i);
             pin_order[i] = port_num;
             connection_mask |= 1 << port_num;
         }
-        substep_count = desc->get_num("substep_count");
-        level_version = desc->get_num("level_version");
+        substep_count = desc->get_num(SAVE_KEY_SUBSTEP_COUNT);
+        level_version = desc->get_num(SAVE_KEY_LEVEL_VERSION);
 
-        if (desc->has_key("forced_elements"))
+        if (desc->has_key(SAVE_KEY_FORCED_ELEMENTS))
         {
-            SaveObjectList* forced_list = desc->get_item("forced_elements")->get_list();
+            SaveObjectList* forced_list = desc->get_item(SAVE_KEY_FORCED_ELEMENTS)->get_list();
             for (unsigned i = 0; i < forced_list->get_count(); i++)
             {
                 SaveObjectMap* forced_map = forced_list->get_item(i)->get_map();
-                XYPos pos(forced_map->get_num("x"), forced_map->get_num("y"));
-                CircuitElement* elem = CircuitElement::load(forced_map->get_item("element"), true);
+                XYPos pos(forced_map->get_num(SAVE_KEY_X), forced_map->get_num(SAVE_KEY_Y));
+                CircuitElement* elem = CircuitElement::load(forced_map->get_item(SAVE_KEY_ELEMENT), true);
                 circuit->force_element(pos, elem);
             }
         }
-        if (desc->has_key("help_design") && !inspected && !hidden)
-            help_design = new LevelSet(desc->get_item("help_design"), COMPRESSURE_VERSION, true);
-        if (desc->has_key("global"))
+        if (desc->has_key(SAVE_KEY_HELP_DESIGN) && !inspected && !hidden)
+            help_design.set(desc->get_item(SAVE_KEY_HELP_DESIGN)->to_binary());
+        if (desc->has_key(SAVE_KEY_GLOBAL))
             global = true;
-        if (desc->has_key("description"))
-            description = desc->get_string("description");
+        if (desc->has_key(SAVE_KEY_DESCRIPTION))
+            description = desc->get_string(SAVE_KEY_DESCRIPTION);
 
-        if (desc->has_key("forced_signs"))
+        if (desc->has_key(SAVE_KEY_FORCED_SIGNS))
         {
-            SaveObjectList* forced_list = desc->get_item("forced_signs")->get_list();
+            SaveObjectList* forced_list = desc->get_item(SAVE_KEY_FORCED_SIGNS)->get_list();
             for (unsigned i = 0; i < forced_list->get_count(); i++)
             {
                 Sign new_sign(forced_list->get_item(i));
@@ -395,7 +369,7 @@ void Level::init_tests(SaveObjectMap* omap)
             }
         }
 
-        SaveObjectList* testlist = desc->get_item("tests")->get_list();
+        SaveObjectList* testlist = desc->get_item(SAVE_KEY_TESTS)->get_list();
         for (unsigned i = 0; i < testlist->get_count(); i++)
         {
             tests.push_back({});
@@ -415,52 +389,54 @@ void Level::init_tests(SaveObjectMap* omap)
             for (unsigned x = 0; x < 24*8; x++)
                 icon_pixels[y][x] = 8;
 
-        if (desc->has_key("icon_bg"))
+        if (desc->has_key(SAVE_KEY_ICON_BG))
         {
-            SaveObjectList* icon_list_y = desc->get_item("icon_bg")->get_list();
+            SaveObjectList* icon_list_y = desc->get_item(SAVE_KEY_ICON_BG)->get_list();
+            std::vector<int64_t> icon_row;
             for (unsigned y = 0; y < icon_list_y->get_count() && y < 24; y++)
             {
-                SaveObjectList* icon_list_x = icon_list_y->get_item(y)->get_list();
-                for (unsigned x = 0; x < icon_list_x->get_count() && x < 24; x++)
+                icon_list_y->get_item(y)->get_ints(icon_row);
+                for (unsigned x = 0; x < icon_row.size() && x < 24; x++)
                 {
                     for (int i = 0; i < 8; i++)
                     {
                         XYPos pos = DirFlip(i).trans(XYPos(x,y), 24);
-                        icon_pixels[pos.y][pos.x + i * 24] = icon_list_x->get_num(x);
+                        icon_pixels[pos.y][pos.x + i * 24] = icon_row[x];
                     }
                 }
             }
         }
-        if (desc->has_key("icon"))
+        if (desc->has_key(SAVE_KEY_ICON))
         {
-            SaveObjectList* icon_list_y = desc->get_item("icon")->get_list();
+            SaveObjectList* icon_list_y = desc->get_item(SAVE_KEY_ICON)->get_list();
+            std::vector<int64_t> icon_row;
             for (unsigned y = 0; y < icon_list_y->get_count() && y < 24; y++)
             {
-                SaveObjectList* icon_list_x = icon_list_y->get_item(y)->get_list();
-                for (unsigned x = 0; x < icon_list_x->get_count() && x < 24*8; x++)
+                icon_list_y->get_item(y)->get_ints(icon_row);
+                for (unsigned x = 0; x < icon_row.size() && x < 24*8; x++)
                 {
-                    uint8_t colour = icon_list_x->get_num(x);
+                    uint8_t colour = icon_row[x];
                     if (colour != 8)
                         icon_pixels[y][x] = colour;
                 }
             }
         }
-        if (desc->has_key("dialogue"))
+        if (desc->has_key(SAVE_KEY_DIALOGUE))
         {
-            SaveObjectList* dialogue_list = desc->get_item("dialogue")->get_list();
+            SaveObjectList* dialogue_list = desc->get_item(SAVE_KEY_DIALOGUE)->get_list();
             for (unsigned i = 0; i < dialogue_list->get_count(); i++)
             {
                 SaveObjectMap* entry = dialogue_list->get_item(i)->get_map();
-                dialogue.push_back(DialogueScreen{entry->get_string("who"), entry->get_string("text")});
+                dialogue.push_back(DialogueScreen{entry->get_string(SAVE_KEY_WHO), entry->get_string(SAVE_KEY_TEXT)});
             }
         }
-        if (desc->has_key("hints"))
+        if (desc->has_key(SAVE_KEY_HINTS))
         {
-            SaveObjectList* dialogue_list = desc->get_item("hints")->get_list();
+            SaveObjectList* dialogue_list = desc->get_item(SAVE_KEY_HINTS)->get_list();
             for (unsigned i = 0; i < dialogue_list->get_count(); i++)
             {
                 SaveObjectMap* entry = dialogue_list->get_item(i)->get_map();
-                hints.push_back(DialogueScreen{entry->get_string("who"), entry->get_string("text")});
+                hints.push_back(DialogueScreen{entry->get_string(SAVE_KEY_WHO), entry->get_string(SAVE_KEY_TEXT)});
             }
         }
     }
@@ -485,26 +461,108 @@ void Level::init_tests(SaveObjectMap* omap)
 
     if (loaded_level_version == level_version && omap)
     {
-        if (omap->has_key("best_score"))
-            best_score = omap->get_num("best_score");
-        if (omap->has_key("last_score"))
-            last_score = omap->get_num("last_score");
-        if (omap->has_key("best_price"))
-            best_price = omap->get_num("best_price");
-        if (omap->has_key("last_price"))
-            last_price = omap->get_num("last_price");
-        if (omap->has_key("best_steam"))
-            best_steam = omap->get_num("best_steam");
-        if (omap->has_key("last_steam"))
-            last_steam = omap->get_num("last_steam");
+        if (omap->has_key(SAVE_KEY_BEST_SCORE))
+            best_score = omap->get_num(SAVE_KEY_BEST_SCORE);
+        if (omap->has_key(SAVE_KEY_LAST_SCORE))
+            last_score = omap->get_num(SAVE_KEY_LAST_SCORE);
+        if (omap->has_key(SAVE_KEY_BEST_PRICE))
+            best_price = omap->get_num(SAVE_KEY_BEST_PRICE);
+        if (omap->has_key(SAVE_KEY_LAST_PRICE))
+            last_price = omap->get_num(SAVE_KEY_LAST_PRICE);
+        if (omap->has_key(SAVE_KEY_BEST_STEAM))
+            best_steam = omap->get_num(SAVE_KEY_BEST_STEAM);
+        if (omap->has_key(SAVE_KEY_LAST_STEAM))
+            last_steam = omap->get_num(SAVE_KEY_LAST_STEAM);
+    }
+}
+
+void Level::init_tests(const LevelDesc& desc, SaveObjectList* slist, unsigned loaded_level_version)
+{
+    name = desc.name;
+    for (unsigned i = 0; i < desc.connection_count; i++)
+    {
+        unsigned port_num = desc.connections[i];
+        pin_order[i] = port_num;
+        connection_mask |= 1 << port_num;
+    }
+    substep_count = desc.substep_count;
+    level_version = desc.level_version;
+
+    for (unsigned i = 0; i < desc.forced_element_count; i++)
+    {
+        const LevelDescElement& forced = desc.forced_elements[i];
+        SaveReader* reader = SaveReader::open(forced.element.data(), forced.element.size());
+        CircuitElement* elem = CircuitElement::load(*reader, true);
+        delete reader;
+        circuit->force_element(XYPos(forced.x, forced.y), elem);
+    }
+    if (!desc.help_design.empty() && !inspected && !hidden)
+        help_design.set(std::string(desc.help_design));
+    if (desc.global)
+        global = true;
+    if (desc.description)
+        description = desc.description;
+
+    for (unsigned i = 0; i < desc.forced_sign_count; i++)
+    {
+        const LevelDescSign& forced = desc.forced_signs[i];
+        Sign new_sign;
+        new_sign.pos = XYPos(forced.x, forced.y);
+        new_sign.direction = forced.direction;
+        new_sign.text = forced.text;
+        circuit->force_sign(new_sign);
+    }
+
+    for (unsigned i = 0; i < desc.test_count; i++)
+    {
+        tests.push_back({});
+        Test& t = tests.back();
+        SaveObjectMap* player_map;
+
+        if (loaded_level_version == level_version && slist && slist->get_count() > i)
+            player_map = slist->get_item(i)->get_map();
+        else
+            player_map = NULL;
+
+        t.load(player_map, desc.tests[i]);
+    }
+
+    for (unsigned y = 0; y < 24; y++)
+        for (unsigned x = 0; x < 24*8; x++)
+            icon_pixels[y][x] = 8;
+
+    if (desc.icon_bg)
+    {
+        for (unsigned y = 0; y < 24; y++)
+        {
+            for (unsigned x = 0; x < 24; x++)
+            {
+                for (int i = 0; i < 8; i++)
+                {
+                    XYPos pos = DirFlip(i).trans(XYPos(x,y), 24);
+                    icon_pixels[pos.y][pos.x + i * 24] = desc.icon_bg[y][x];
+                }
+            }
+        }
+    }
+    if (desc.icon)
+    {
+        for (unsigned y = 0; y < 24; y++)
+            for (unsigned x = 0; x < 24*8; x++)
+                if (desc.icon[y][x] != 8)
+                    icon_pixels[y][x] = desc.icon[y][x];
     }
+    for (unsigned i = 0; i < desc.dialogue_count; i++)
+        dialogue.push_back(DialogueScreen{desc.dialogue[i].who, desc.dialogue[i].text});
+    for (unsigned i = 0; i < desc.hint_count; i++)
+        hints.push_back(DialogueScreen{desc.hints[i].who, desc.hints[i].text});
 }
 
 void Level::re_init_tests(SaveObjectMap* desc)
 {
-        substep_count = desc->get_num("substep_count");
+        substep_count = desc->get_num(SAVE_KEY_SUBSTEP_COUNT);
         tests.clear();
-        SaveObjectList* testlist = desc->get_item("tests")->get_list();
+        SaveObjectList* testlist = desc->get_item(SAVE_KEY_TESTS)->get_list();
         for (unsigned i = 0; i < testlist->get_count(); i++)
         {
             tests.push_back({});
@@ -656,6 +714,7 @@ void Level::update_score(bool fin)
     {
         last_steam = circuit->get_steam_used();
         score_set = true;
+        changed();
     }
     if (!score)
         return;
@@ -702,15 +761,35 @@ void Level::set_monitor_state(TestExecType monitor_state_)
 void Level::touch()
 {
     touched = true;
+    changed();
     score_set = false;
     circuit->fast_prepped = false;
     last_price = circuit->get_cost();
 //    remove_circles();
 }
-void Level::set_best_design(LevelSet* new_best)
+void Level::changed()
+{
+    dirty = true;
+    snapshot.reset();
+    lite_snapshot.reset();
+}
+
+std::shared_ptr<const std::string> Level::take_snapshot(bool lite)
+{
+    std::shared_ptr<const std::string>& cached = lite ? lite_snapshot : snapshot;
+    if (!cached)
+    {
+        SaveBinaryWriter writer;
+        save(writer, lite);
+        cached = std::make_shared<const std::string>(std::move(writer.buf.data));
+    }
+    return cached;
+}
+
+void Level::set_best_design(std::string data)
 {
-    delete best_design;
-    best_design =  new_best;
+    best_design.set(std::move(data));
+    changed();
 
     unsigned test_count = tests.size();
     for (unsigned t = 0; t < test_count; t++)
@@ -721,6 +800,64 @@ void Level::set_best_design(LevelSet* new_best)
     }
 }
 
+LazyLevelSet::~LazyLevelSet()
+{
+    delete level_set;
+}
+
+LevelSet* LazyLevelSet::get()
+{
+    if (!level_set && !data.empty())
+    {
+        SaveArena arena;
+        SaveObject* sobj;
+        {
+            SaveArenaScope scope(&arena);
+            sobj = SaveObject::load(data);
+        }
+        level_set = new LevelSet(sobj, COMPRESSURE_VERSION, true);
+        data = std::string();
+    }
+    return level_set;
+}
+
+void LazyLevelSet::set(LevelSet* level_set_)
+{
+    delete level_set;
+    level_set = level_set_;
+    data = std::string();
+}
+
+void LazyLevelSet::set(std::string data_)
+{
+    delete level_set;
+    level_set = NULL;
+    data = std::move(data_);
+}
+
+// Designs from older versions have their levels renumbered as they load, so
+// only current ones can be passed through untouched.
+
+void LazyLevelSet::load(SaveObject* sobj, unsigned version)
+{
+    if (version == COMPRESSURE_VERSION)
+        set(sobj->to_binary());
+    else
+        set(new LevelSet(sobj, version, true));
+}
+
+void LazyLevelSet::save(SaveWriter& writer)
+{
+    if (level_set)
+    {
+        level_set->save_all(writer, LEVEL_COUNT, true);
+        return;
+    }
+    SaveReader* reader = SaveReader::open(data.data(), data.size());
+    reader->copy(writer);
+    delete reader;
+}
+
 LevelSet::LevelSet(SaveObject* sobj, unsigned version, bool inspect)
 {
     read_only = inspect;
@@ -774,34 +911,188 @@ LevelSet::~LevelSet()
 
 SaveObject* LevelSet::save_all(int level_index, bool lite)
 {
-    SaveObjectList* slist = new SaveObjectList;
-    
+    SaveTreeWriter writer;
+    save_all(writer, level_index, lite);
+    return writer.take();
+}
+
+void LevelSet::save_all(SaveWriter& writer, int level_index, bool lite)
+{
+    writer.begin_list();
     for (int i = 0; i < levels.size(); i++)
     {
         if (is_playable(i, level_index))
-            slist->add_item(levels[i]->save(lite));
+            levels[i]->save(writer, lite);
         else
-            slist->add_item(new SaveObjectNull);
+            writer.null();
     }
-    return slist;
+    writer.end_list();
 }
 
-SaveObject* LevelSet::save_one(int level_index)
+// Levels are shared with the snapshot as the binary they last serialised
+// to, so only the ones that changed since are written out again.  A journal
+// snapshot leaves out levels that have not changed since the last one and
+// clears their dirty flags.
+
+void LevelSet::snapshot(LevelSetSnapshot& snap, int level_index, bool lite, bool all)
 {
-    SaveObjectList* slist = new SaveObjectList;
-    
+    snap.count = levels.size();
     for (int i = 0; i < levels.size(); i++)
     {
-        if (levels[level_index]->circuit->contains_subcircuit_level(i, this) || i == level_index)
-            slist->add_item(levels[i]->save(true));
+        if (snap.journal && !all && !levels[i]->dirty)
+            continue;
+        if (is_playable(i, level_index))
+            snap.levels.push_back(std::make_pair(i, levels[i]->take_snapshot(lite)));
         else
-            slist->add_item(new SaveObjectNull);
+            snap.levels.push_back(std::make_pair(i, std::shared_ptr<const std::string>()));
+        if (snap.journal)
+            levels[i]->dirty = false;
+    }
+}
+
+void LevelSet::clear_dirty()
+{
+    for (int i = 0; i < levels.size(); i++)
+        levels[i]->dirty = false;
+}
+
+void LevelSetSnapshot::save(SaveWriter& writer)
+{
+    if (!journal)
+    {
+        writer.begin_list();
+        for (auto& level : levels)
+        {
+            if (level.second)
+            {
+                SaveReader* reader = SaveReader::open(level.second->data(), level.second->size());
+                reader->copy(writer);
+                delete reader;
+            }
+            else
+            {
+                writer.null();
+            }
+        }
+        writer.end_list();
+        return;
+    }
+    writer.begin_map();
+    writer.num("count", count);
+    writer.key("levels");
+    writer.begin_list();
+    for (auto& level : levels)
+    {
+        writer.begin_map();
+        writer.num("index", level.first);
+        writer.key("level");
+        if (level.second)
+        {
+            SaveReader* reader = SaveReader::open(level.second->data(), level.second->size());
+            reader->copy(writer);
+            delete reader;
+        }
+        else
+        {
+            writer.null();
+        }
+        writer.end_map();
+    }
+    writer.end_list();
+    writer.end_map();
+}
+
+// Checks changes read from a journal or an upload before anything is sized
+// from them, returning the level count.  Throws if the count or any index
+// is out of range.
+
+unsigned LevelSetSnapshot::check(SaveObjectMap* changes)
+{
+    int64_t count = changes->get_num("count");
+    if (count < 0 || count > LEVEL_SET_LIMIT)
+        throw(std::runtime_error("Bad level count"));
+    SaveObjectList* levels = changes->get_item("levels")->get_list();
+    for (unsigned i = 0; i < levels->get_count(); i++)
+    {
+        int64_t index = levels->get_item(i)->get_map()->get_num("index");
+        if (index < 0 || index >= count)
+            throw(std::runtime_error("Bad level index"));
+    }
+    return count;
+}
+
+// Applies the changes a journal snapshot saved to the level list under key
+// in a loaded save.
+
+void LevelSetSnapshot::apply(SaveObjectMap* omap, std::string_view key, SaveObjectMap* changes)
+{
+    unsigned count = check(changes);
+    SaveObject* sobj = omap->find(key);
+    if (!sobj || !sobj->is_list())
+    {
+        sobj = new SaveObjectList;
+        omap->set_item(key, sobj);
     }
-    while (slist->get_count() && slist->get_item(slist->get_count() - 1)->is_null())
+    SaveObjectList* slist = sobj->get_list();
+    while (slist->get_count() > count)
         slist->pop_back();
+    while (slist->get_count() < count)
+        slist->add_item(new SaveObjectNull);
+
+    SaveObjectList* levels = changes->get_item("levels")->get_list();
+    for (unsigned i = 0; i < levels->get_count(); i++)
+    {
+        SaveObjectMap* change = levels->get_item(i)->get_map();
+        slist->set_item(change->get_num("index"), change->get_item("level")->dup());
+    }
+}
 
+// The hash the game and server agree on for an uploaded save: one over the
+// per level hashes of all three sets, so any difference in what either side
+// holds shows up.
 
-    return slist;
+uint64_t LevelSetSnapshot::base_hash(const std::vector<uint64_t> hashes[3])
+{
+    std::string data;
+    for (int i = 0; i < 3; i++)
+    {
+        uint64_t count = hashes[i].size();
+        for (int b = 0; b < 8; b++)
+            data += char(count >> (b * 8));
+        for (uint64_t hash : hashes[i])
+            for (int b = 0; b < 8; b++)
+                data += char(hash >> (b * 8));
+    }
+    return hash_bytes(data.data(), data.size());
+}
+
+SaveObject* LevelSet::save_one(int level_index)
+{
+    SaveTreeWriter writer;
+    save_one(writer, level_index);
+    return writer.take();
+}
+
+void LevelSet::save_one(SaveWriter& writer, int level_index)
+{
+    std::vector<bool> used(levels.size());
+    int count = 0;
+    for (int i = 0; i < levels.size(); i++)
+    {
+        used[i] = levels[level_index]->circuit->contains_subcircuit_level(i, this) || i == level_index;
+        if (used[i])
+            count = i + 1;
+    }
+
+    writer.begin_list();
+    for (int i = 0; i < count; i++)
+    {
+        if (used[i])
+            levels[i]->save(writer, true);
+        else
+            writer.null();
+    }
+    writer.end_list();
 }
 
 bool LevelSet::is_playable(unsigned level, unsigned highest_level)
@@ -834,17 +1125,17 @@ Pressure LevelSet::test_level(int level_index)
 
 void LevelSet::record_best_score(int level_index)
 {
-    SaveObject* sobj = save_one(level_index);
-    levels[level_index]->set_best_design(new LevelSet(sobj, COMPRESSURE_VERSION, true));
-    delete sobj;
+    SaveBinaryWriter writer;
+    save_one(writer, level_index);
+    levels[level_index]->set_best_design(std::move(writer.buf.data));
 }
 
 void LevelSet::save_design(int level_index, unsigned save_slot)
 {
-    SaveObject* sobj = save_one(level_index);
-    delete levels[level_index]->saved_designs[save_slot];
-    levels[level_index]->saved_designs[save_slot] =  new LevelSet(sobj, COMPRESSURE_VERSION, true);
-    delete sobj;
+    SaveBinaryWriter writer;
+    save_one(writer, level_index);
+    levels[level_index]->saved_designs[save_slot].set(std::move(writer.buf.data));
+    levels[level_index]->changed();
 }
 
 void LevelSet::reset(int level_index)
@@ -871,6 +1162,7 @@ unsigned LevelSet::new_user_level()
 {
     unsigned count = levels.size();
     levels.push_back(new Level(count));
+    levels[count]->changed();
     return count;
 }
 
@@ -912,6 +1204,7 @@ unsigned LevelSet::import_level(LevelSet* other_set, int level_index)
         new_level->pin_order[i] = old_level->pin_order[i];
         
     new_level->connection_mask = old_level->connection_mask;
+    new_level->changed();
 
     return new_index;
 }
@@ -937,6 +1230,8 @@ void LevelSet::delete_level(int level_index)
 
     delete levels[level_index];
     levels.erase(levels.begin() + level_index);
+    for (int i = 0; i < levels.size(); i++)
+        levels[i]->changed();
 }
 
 int LevelSet::find_level(int level_index, std::string name)
@@ -3,9 +3,11 @@
 #include "SaveState.h"
 #include "Circuit.h"
 #include <stdlib.h>
+#include <memory>
 
 
 #define LEVEL_COUNT 43
+#define LEVEL_SET_LIMIT (LEVEL_COUNT + 10000)
 #define HISTORY_POINT_COUNT 200
 
 #ifndef CHARLES_ID
@@ -14,8 +16,6 @@
 
 #define COMPRESSURE_VERSION 2
 
-extern SaveObjectList* level_desc;
-
 class WrappedTexture
 {
 public:
@@ -29,7 +29,7 @@ class SimPoint
 public:
     unsigned values[4] = {0, 0, 0, 0};
     unsigned force[4] = {0, 0, 0, 0};
-    SimPoint(unsigned N, unsigned E, unsigned S, unsigned W, unsigned NF, unsigned EF, unsigned SF, unsigned WF)
+    constexpr SimPoint(unsigned N, unsigned E, unsigned S, unsigned W, unsigned NF, unsigned EF, unsigned SF, unsigned WF)
     {
         values[0] = N;
         values[1] = E;
@@ -60,6 +60,71 @@ enum TestResetType
     RESET_ALL
 };
 
+// Descriptions of the built-in levels, generated from Level.json into
+// Level.tables by tabulate.py.  Forced elements and help designs are kept in
+// the binary save encoding and read when a level is set up.
+
+class LevelDescTest
+{
+public:
+    Direction tested_direction;
+    TestResetType reset;
+    unsigned first_simpoint;
+    const SimPoint* points;
+    unsigned point_count;
+};
+
+class LevelDescElement
+{
+public:
+    int x;
+    int y;
+    std::string_view element;
+};
+
+class LevelDescSign
+{
+public:
+    int x;
+    int y;
+    Direction direction;
+    const char* text;
+};
+
+class LevelDescDialogue
+{
+public:
+    const char* who;
+    const char* text;
+};
+
+class LevelDesc
+{
+public:
+    const char* name;
+    const char* description;
+    bool global;
+    unsigned substep_count;
+    unsigned level_version;
+    int connections[4];
+    unsigned connection_count;
+    const LevelDescTest* tests;
+    unsigned test_count;
+    const LevelDescElement* forced_elements;
+    unsigned forced_element_count;
+    const LevelDescSign* forced_signs;
+    unsigned forced_sign_count;
+    const LevelDescDialogue* dialogue;
+    unsigned dialogue_count;
+    const LevelDescDialogue* hints;
+    unsigned hint_count;
+    const uint8_t (*icon_bg)[24];
+    const uint8_t (*icon)[24 * 8];
+    std::string_view help_design;
+};
+
+extern const LevelDesc level_descs[LEVEL_COUNT];
+
 class Test
 {
 public:
@@ -75,8 +140,33 @@ public:
     unsigned last_pressure_index;
 
     Test();
+    void load_scores(SaveObjectMap* player_map);
     void load(SaveObjectMap* player_map, SaveObjectMap* test_map);
-    SaveObject* save(bool custom, bool lite);
+    void load(SaveObjectMap* player_map, const LevelDescTest& desc);
+    void save(SaveWriter& writer, bool custom, bool lite);
+};
+
+// A saved or best design.  Designs loaded from a save are kept as the binary
+// encoding of their level list and only built into a LevelSet when something
+// opens them; until then a save writes the stored bytes straight back out.
+
+class LazyLevelSet
+{
+public:
+    LevelSet* level_set = NULL;
+    std::string data;
+
+    LazyLevelSet(){};
+    LazyLevelSet(const LazyLevelSet&) = delete;
+    LazyLevelSet& operator=(const LazyLevelSet&) = delete;
+    ~LazyLevelSet();
+    explicit operator bool() const {return level_set || !data.empty();};
+    LevelSet* get();
+    void set(LevelSet* level_set_);
+    void set(std::string data_);
+    void clear(){set((LevelSet*)NULL);};
+    void load(SaveObject* sobj, unsigned version);
+    void save(SaveWriter& writer);
 };
 
 class Level
@@ -131,9 +221,9 @@ public:
     bool hidden = false;
     bool inspected = false;
     Circuit* circuit;
-    LevelSet *best_design = NULL;
-    LevelSet *saved_designs[4] = {NULL,NULL,NULL,NULL};
-    LevelSet *help_design = NULL;
+    LazyLevelSet best_design;
+    LazyLevelSet saved_designs[4];
+    LazyLevelSet help_design;
 
     int pin_order[4] = {-1, -1, -1, -1};
 
@@ -157,6 +247,9 @@ public:
     
     
     bool touched = false;
+    bool dirty = false;
+    std::shared_ptr<const std::string> snapshot;
+    std::shared_ptr<const std::string> lite_snapshot;
     bool score_set = false;
     bool best_score_set = false;
     bool best_price_set = false;
@@ -197,6 +290,7 @@ public:
     Level(int level_index_, bool hidden_ = false);
     ~Level();
     SaveObject* save(bool lite = false);
+    void save(SaveWriter& writer, bool lite = false);
 
     XYPos getimage(DirFlip dir_flip);
     XYPos getimage_fg(DirFlip dir_flip);
@@ -204,6 +298,7 @@ public:
     void setimage_fg_texture(WrappedTexture* texture_);
 
     void init_tests(SaveObjectMap* omap = NULL);
+    void init_tests(const LevelDesc& desc, SaveObjectList* slist, unsigned loaded_level_version);
     void re_init_tests(SaveObjectMap* desc);
     void reset();
     void advance(unsigned ticks);
@@ -212,7 +307,26 @@ public:
     void update_score(bool fin);
     void set_monitor_state(TestExecType monitor_state_);
     void touch();
-    void set_best_design(LevelSet* best);
+    void set_best_design(std::string data);
+    void changed();
+    std::shared_ptr<const std::string> take_snapshot(bool lite);
+};
+
+// The levels of a set as a save snapshot holds them: the length of the set
+// and the serialised levels, each with its index, or NULL where save_all
+// writes null.  A journal snapshot only has the levels that changed.
+
+class LevelSetSnapshot
+{
+public:
+    unsigned count = 0;
+    bool journal = false;
+    std::vector<std::pair<unsigned, std::shared_ptr<const std::string>>> levels;
+
+    void save(SaveWriter& writer);
+    static unsigned check(SaveObjectMap* changes);
+    static void apply(SaveObjectMap* omap, std::string_view key, SaveObjectMap* changes);
+    static uint64_t base_hash(const std::vector<uint64_t> hashes[3]);
 };
 
 
@@ -225,7 +339,11 @@ public:
     LevelSet();
     ~LevelSet();
     SaveObject* save_all(int level_index, bool lite = false);
+    void save_all(SaveWriter& writer, int level_index, bool lite = false);
     SaveObject* save_one(int level_index);
+    void save_one(SaveWriter& writer, int level_index);
+    void snapshot(LevelSetSnapshot& snap, int level_index, bool lite, bool all);
+    void clear_dirty();
     bool is_playable(unsigned level, unsigned highest_level);
     int top_playable(int highest_level);
     Pressure test_level(int level_index);
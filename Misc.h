@@ -5,9 +5,24 @@
 #include <iostream>
 #include <math.h>
 #include <assert.h>
+#include <stdint.h>
+#include <stddef.h>
 
 #define BREAKPOINT __asm__ volatile("int $0x03");
 
+// 64 bit FNV-1a, for telling blobs apart by their contents.
+
+inline uint64_t hash_bytes(const char* data, size_t size)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= (unsigned char)data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
 enum Direction
 {
     DIRECTION_N = 0,
@@ -1,209 +1,1454 @@
 #include "Misc.h"
 #include "SaveState.h"
+#include <algorithm>
 #include <assert.h>
-#define assert_exp(x) do { if (f.get() != x) throw (std::runtime_error("Unexpected character"));} while (false)
+#include <charconv>
+#include <string.h>
 
-static void skip_whitespace(std::istream& f)
+static thread_local SaveArena* save_arena = NULL;
+
+SaveArena::~SaveArena()
+{
+    for (char* block : blocks)
+        delete[] block;
+}
+
+void* SaveArena::allocate(size_t size, size_t align)
+{
+    size_t pad = (align - (uintptr_t(pos) & (align - 1))) & (align - 1);
+    if (pad + size <= left)
+    {
+        void* ptr = pos + pad;
+        pos += pad + size;
+        left -= pad + size;
+        return ptr;
+    }
+    if (size > block_size / 4)
+    {
+        char* block = new char[size + align];
+        blocks.push_back(block);
+        return block + ((align - (uintptr_t(block) & (align - 1))) & (align - 1));
+    }
+    char* block = new char[block_size];
+    blocks.push_back(block);
+    pos = block;
+    left = block_size;
+    if (block_size < 1024 * 1024)
+        block_size *= 2;
+    return allocate(size, align);
+}
+
+SaveArena* save_arena_current()
+{
+    return save_arena;
+}
+
+SaveArenaScope::SaveArenaScope(SaveArena* arena)
+{
+    prev = save_arena;
+    save_arena = arena;
+}
+
+SaveArenaScope::~SaveArenaScope()
+{
+    save_arena = prev;
+}
+
+// Every object carries a header recording where it came from, so delete can
+// tell arena objects (left for the arena to release) from heap objects.
+
+static const size_t SAVE_OBJECT_HEADER = 16;
+
+void* SaveObject::operator new(size_t size)
+{
+    SaveArena* arena = save_arena;
+    char* mem = arena ? (char*)arena->allocate(size + SAVE_OBJECT_HEADER, SAVE_OBJECT_HEADER) : (char*)::operator new(size + SAVE_OBJECT_HEADER);
+    *(SaveArena**)mem = arena;
+    return mem + SAVE_OBJECT_HEADER;
+}
+
+void SaveObject::operator delete(void* ptr, size_t size)
+{
+    char* mem = (char*)ptr - SAVE_OBJECT_HEADER;
+    if (!*(SaveArena**)mem)
+        ::operator delete(mem);
+}
+
+// Parser for the save format.  It works on a contiguous buffer and accepts
+// the same dialect the game has always written and read: trailing commas,
+// a UTF-8 BOM (skipped as whitespace) and backslash escapes where only \n
+// is special.
+
+class SaveParser
+{
+public:
+    const char* pos;
+    const char* end;
+
+    SaveParser(const char* data, size_t length):
+        pos(data),
+        end(data + length)
+    {}
+
+    void skip_whitespace()
+    {
+        while (pos < end)
+        {
+            unsigned char c = *pos;
+            if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+                pos++;
+            else if (c == 0xEF)
+                pos = (end - pos) > 3 ? pos + 3 : end;
+            else
+                break;
+        }
+    }
+
+    int peek()
+    {
+        return pos < end ? (unsigned char)*pos : -1;
+    }
+
+    void expect(char c)
+    {
+        if (pos >= end || *pos != c)
+            throw(std::runtime_error("Unexpected character"));
+        pos++;
+    }
+
+    SaveString parse_string()
+    {
+        expect('"');
+        SaveString str;
+        while (true)
+        {
+            const char* run = pos;
+            while (pos < end && *pos != '"' && *pos != '\\')
+                pos++;
+            str.append(run, pos - run);
+            if (pos >= end)
+                throw(std::runtime_error("Unterminated string"));
+            if (*pos == '"')
+                break;
+            pos++;
+            if (pos >= end)
+                throw(std::runtime_error("Unterminated string"));
+            str.push_back(*pos == 'n' ? '\n' : *pos);
+            pos++;
+        }
+        pos++;
+        return str;
+    }
+
+    SaveObject* parse_number()
+    {
+        int64_t number;
+        std::from_chars_result result = std::from_chars(pos, end, number);
+        if (result.ec != std::errc())
+            throw(std::runtime_error("Bad number"));
+        pos = result.ptr;
+        return new SaveObjectNumber(number);
+    }
+
+    SaveObject* parse_map()
+    {
+        SaveObjectMap* omap = new SaveObjectMap;
+        try
+        {
+            expect('{');
+            while (true)
+            {
+                skip_whitespace();
+                if (peek() == '}')
+                    break;
+                SaveString key = parse_string();
+                skip_whitespace();
+                expect(':');
+                SaveObject* obj = parse();
+                omap->add_item(key, obj);
+                skip_whitespace();
+                if (peek() == '}')
+                    break;
+                expect(',');
+            }
+            expect('}');
+        }
+        catch (const std::runtime_error& error)
+        {
+            delete omap;
+            throw;
+        }
+        return omap;
+    }
+
+    SaveObject* parse_list()
+    {
+        SaveObjectList* olist = new SaveObjectList;
+        try
+        {
+            expect('[');
+            while (true)
+            {
+                skip_whitespace();
+                if (peek() == ']')
+                    break;
+                olist->add_item(parse());
+                skip_whitespace();
+                if (peek() == ']')
+                    break;
+                expect(',');
+            }
+            expect(']');
+        }
+        catch (const std::runtime_error& error)
+        {
+            delete olist;
+            throw;
+        }
+        return olist;
+    }
+
+    SaveObject* parse()
+    {
+        skip_whitespace();
+        int c = peek();
+        if (c == '{')
+            return parse_map();
+        if (c == 'n')
+        {
+            if (end - pos < 4 || memcmp(pos, "null", 4))
+                throw(std::runtime_error("Unexpected character"));
+            pos += 4;
+            return new SaveObjectNull;
+        }
+        if (c == '[')
+            return parse_list();
+        if (c == '"')
+            return new SaveObjectString(parse_string());
+        if ((c >= '0' && c <= '9') || c == '-')
+            return parse_number();
+        printf("%d\n", c);
+        throw(std::runtime_error("Parse Error"));
+    }
+};
+
+void SaveBuffer::append_num(int64_t value)
+{
+    char str[24];
+    std::to_chars_result result = std::to_chars(str, str + sizeof(str), value);
+    data.append(str, result.ptr - str);
+}
+
+void SaveBuffer::append_escaped(std::string_view str)
 {
+    const char* pos = str.data();
+    const char* end = pos + str.size();
     while (true)
     {
-        int c = f.peek();
-        if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
-            f.get();
-        else if (c == 0xEF)
+        const char* run = pos;
+        while (pos < end && *pos != '\n' && *pos != '"' && *pos != '\\')
+            pos++;
+        data.append(run, pos - run);
+        if (pos >= end)
+            break;
+        data.push_back('\\');
+        data.push_back(*pos == '\n' ? 'n' : *pos);
+        pos++;
+    }
+}
+
+void SaveObject::save(std::ostream& f)
+{
+    SaveBuffer buf;
+    buf.sink = &f;
+    save(buf);
+    buf.flush();
+}
+
+void SaveObject::save_binary(std::ostream& f)
+{
+    SaveBinaryWriter writer;
+    writer.buf.sink = &f;
+    save_binary(writer);
+    writer.buf.flush();
+}
+
+enum SaveBinaryTag
+{
+    SAVE_BINARY_NULL,
+    SAVE_BINARY_NUMBER,
+    SAVE_BINARY_STRING,
+    SAVE_BINARY_LIST,
+    SAVE_BINARY_MAP,
+    SAVE_BINARY_INT_ARRAY
+};
+
+// Parser for the binary encoding.  Key strings point into the input buffer,
+// which outlives the parse.
+
+class SaveBinaryParser
+{
+public:
+    const char* pos;
+    const char* end;
+    std::vector<std::string_view> keys;
+
+    SaveBinaryParser(const char* data, size_t length):
+        pos(data),
+        end(data + length)
+    {}
+
+    unsigned get_byte()
+    {
+        if (pos >= end)
+            throw(std::runtime_error("Truncated binary save"));
+        return (unsigned char)*pos++;
+    }
+
+    uint64_t get_varint()
+    {
+        uint64_t value = 0;
+        for (unsigned shift = 0; shift < 64; shift += 7)
+        {
+            unsigned byte = get_byte();
+            value |= uint64_t(byte & 0x7F) << shift;
+            if (!(byte & 0x80))
+                return value;
+        }
+        throw(std::runtime_error("Bad varint"));
+    }
+
+    // Every element takes at least one byte, so a count larger than what is
+    // left of the input can only come from a corrupt file.
+
+    size_t get_count()
+    {
+        uint64_t count = get_varint();
+        if (count > uint64_t(end - pos))
+            throw(std::runtime_error("Truncated binary save"));
+        return count;
+    }
+
+    std::string_view get_string()
+    {
+        size_t length = get_count();
+        std::string_view str(pos, length);
+        pos += length;
+        return str;
+    }
+
+    std::string_view get_key()
+    {
+        uint64_t index = get_varint();
+        if (index == 0)
         {
-            f.get();f.get();f.get();
+            keys.push_back(get_string());
+            return keys.back();
         }
+        if (index > keys.size())
+            throw(std::runtime_error("Bad key index"));
+        return keys[index - 1];
+    }
+
+    SaveObject* parse()
+    {
+        switch (get_byte())
+        {
+            case SAVE_BINARY_NULL:
+                return new SaveObjectNull;
+            case SAVE_BINARY_NUMBER:
+            {
+                uint64_t value = get_varint();
+                return new SaveObjectNumber(int64_t(value >> 1) ^ -int64_t(value & 1));
+            }
+            case SAVE_BINARY_STRING:
+                return new SaveObjectString(get_string());
+            case SAVE_BINARY_LIST:
+            {
+                SaveObjectList* olist = new SaveObjectList;
+                try
+                {
+                    size_t count = get_count();
+                    olist->olist.reserve(count);
+                    for (size_t i = 0; i < count; i++)
+                        olist->add_item(parse());
+                }
+                catch (const std::runtime_error& error)
+                {
+                    delete olist;
+                    throw;
+                }
+                return olist;
+            }
+            case SAVE_BINARY_INT_ARRAY:
+            {
+                SaveObjectIntArray* array = new SaveObjectIntArray;
+                try
+                {
+                    size_t count = get_count();
+                    array->values.resize(count);
+                    int64_t value = 0;
+                    for (size_t i = 0; i < count; i++)
+                    {
+                        uint64_t delta = get_varint();
+                        value = int64_t(uint64_t(value) + uint64_t(int64_t(delta >> 1) ^ -int64_t(delta & 1)));
+                        array->values[i] = value;
+                    }
+                }
+                catch (const std::runtime_error& error)
+                {
+                    delete array;
+                    throw;
+                }
+                return array;
+            }
+            case SAVE_BINARY_MAP:
+            {
+                SaveObjectMap* omap = new SaveObjectMap;
+                try
+                {
+                    size_t count = get_count();
+                    omap->omap.reserve(count);
+                    for (size_t i = 0; i < count; i++)
+                    {
+                        std::string_view key = get_key();
+                        omap->add_item(key, parse());
+                    }
+                }
+                catch (const std::runtime_error& error)
+                {
+                    delete omap;
+                    throw;
+                }
+                return omap;
+            }
+            default:
+                throw(std::runtime_error("Bad binary tag"));
+        }
+    }
+};
+
+SaveBinaryWriter::SaveBinaryWriter()
+{
+    buf.put(char(SAVE_BINARY_MAGIC));
+    buf.put(char(SAVE_BINARY_VERSION));
+}
+
+static unsigned encode_varint(uint64_t value, char* bytes)
+{
+    unsigned length = 0;
+    while (value >= 0x80)
+    {
+        bytes[length++] = char(value | 0x80);
+        value >>= 7;
+    }
+    bytes[length++] = char(value);
+    return length;
+}
+
+void SaveBinaryWriter::put_varint(uint64_t value)
+{
+    char bytes[10];
+    buf.append(bytes, encode_varint(value, bytes));
+}
+
+void SaveBinaryWriter::put_key(std::string_view key, SaveKey id)
+{
+    unsigned* index;
+    if (id != SAVE_KEY_NONE)
+        index = &interned_keys[id];
+    else
+        index = &keys.emplace(key, 0).first->second;
+    if (*index)
+    {
+        put_varint(*index);
+        return;
+    }
+    put_varint(0);
+    put_string(key);
+    *index = ++key_count;
+}
+
+void SaveBinaryWriter::begin(char tag, bool map, bool ints)
+{
+    item();
+    buf.put(tag);
+    frames.push_back(Frame{buf.data.size(), 0, map, ints, 0});
+    buf.put(0);
+}
+
+void SaveBinaryWriter::end()
+{
+    Frame& frame = frames.back();
+    char bytes[10];
+    unsigned length = encode_varint(frame.count, bytes);
+    buf.data[frame.pos] = bytes[0];
+    if (length > 1)
+        buf.data.insert(frame.pos + 1, bytes + 1, length - 1);
+    frames.pop_back();
+}
+
+void SaveBinaryWriter::begin_map()
+{
+    begin(SAVE_BINARY_MAP, true, false);
+}
+
+void SaveBinaryWriter::begin_list()
+{
+    begin(SAVE_BINARY_LIST, false, false);
+}
+
+void SaveBinaryWriter::begin_ints()
+{
+    begin(SAVE_BINARY_INT_ARRAY, false, true);
+}
+
+void SaveBinaryWriter::write_num(int64_t value)
+{
+    if (!frames.empty() && frames.back().ints)
+    {
+        Frame& frame = frames.back();
+        frame.count++;
+        put_num(int64_t(uint64_t(value) - uint64_t(frame.prev)));
+        frame.prev = value;
+        return;
+    }
+    item();
+    buf.put(SAVE_BINARY_NUMBER);
+    put_num(value);
+}
+
+void SaveBinaryWriter::write_string(std::string_view value)
+{
+    item();
+    buf.put(SAVE_BINARY_STRING);
+    put_string(value);
+}
+
+void SaveBinaryWriter::write_null()
+{
+    item();
+    buf.put(SAVE_BINARY_NULL);
+}
+
+void SaveBinaryWriter::write_object(SaveObject* obj)
+{
+    item();
+    obj->save_binary(*this);
+}
+
+void SaveTextWriter::write_key(std::string_view key, SaveKey id)
+{
+    if (comma)
+        buf.put(',');
+    buf.put('"');
+    buf.append(key);
+    buf.append("\":", 2);
+    comma = false;
+}
+
+void SaveTextWriter::write_string(std::string_view value)
+{
+    separate();
+    buf.put('"');
+    buf.append_escaped(value);
+    buf.put('"');
+}
+
+void SaveTextWriter::write_object(SaveObject* obj)
+{
+    separate();
+    obj->save(buf);
+}
+
+void SaveTreeWriter::add(SaveObject* obj)
+{
+    if (stack.empty())
+    {
+        assert(!root);
+        root = obj;
+    }
+    else if (stack.back()->is_map())
+    {
+        SaveObjectMap* omap = (SaveObjectMap*)stack.back();
+        if (pending_id != SAVE_KEY_NONE)
+            omap->add_item(pending_id, obj);
         else
-            break;
+            omap->add_item(pending_key, obj);
+    }
+    else
+    {
+        stack.back()->get_list()->add_item(obj);
     }
 }
 
+void SaveTreeWriter::begin_map()
+{
+    SaveObjectMap* omap = new SaveObjectMap;
+    add(omap);
+    stack.push_back(omap);
+}
+
+void SaveTreeWriter::begin_list()
+{
+    SaveObjectList* olist = new SaveObjectList;
+    add(olist);
+    stack.push_back(olist);
+}
+
+void SaveTreeWriter::begin_ints()
+{
+    SaveObjectIntArray* array = new SaveObjectIntArray;
+    add(array);
+    stack.push_back(array);
+}
+
+void SaveTreeWriter::write_key(std::string_view key, SaveKey id)
+{
+    pending_id = id;
+    if (id == SAVE_KEY_NONE)
+        pending_key = key;
+}
+
+void SaveTreeWriter::write_num(int64_t value)
+{
+    if (!stack.empty() && stack.back()->is_int_array())
+        ((SaveObjectIntArray*)stack.back())->add_num(value);
+    else
+        add(new SaveObjectNumber(value));
+}
+
+std::string SaveObject::to_binary()
+{
+    SaveBinaryWriter writer;
+    save_binary(writer);
+    return std::move(writer.buf.data);
+}
+
 std::string SaveObject::to_string()
 {
-    std::ostringstream stream;
-    save(stream);
-    return stream.str();
+    SaveBuffer buf;
+    save(buf);
+    return std::move(buf.data);
+}
+
+SaveObject* SaveObject::load(const char* data, size_t length)
+{
+    if (length && (unsigned char)data[0] == SAVE_BINARY_MAGIC)
+    {
+        if (length < 2 || data[1] < 1 || data[1] > SAVE_BINARY_VERSION)
+            throw(std::runtime_error("Unknown binary save version"));
+        SaveBinaryParser parser(data + 2, length - 2);
+        return parser.parse();
+    }
+    SaveParser parser(data, length);
+    return parser.parse();
 }
-SaveObject* SaveObject::load(std::string& input)
+
+SaveObject* SaveObject::load(const std::string& input)
 {
-    std::istringstream stream(input);
-    return SaveObject::load(stream);
+    return load(input.data(), input.size());
 }
 
 SaveObject* SaveObject::load(std::istream& f)
 {
-    skip_whitespace(f);    
-    char c = f.peek();
-    if (c == '{')
-        return new SaveObjectMap(f);
-    if (c == 'n')
-        return new SaveObjectNull(f);
-    if (c == '[')
-        return new SaveObjectList(f);
-    if (c == '"')
-        return new SaveObjectString(f);
-    if ((c >= '0' && c <= '9') || c == '-')
-        return new SaveObjectNumber(f);
-    printf("%d\n", (int)(unsigned char)c);
-    throw(std::runtime_error("Parse Error"));
-}
-
-static std::string parse_string(std::istream& f)
-{
-    char c;
-    std::string str;
-    assert_exp('\"');
-    while ((c = f.get()) != '\"')
-    {
-        if (c == '\\')
+    std::string data;
+    std::streampos start = f.tellg();
+    if (start != std::streampos(-1) && f.seekg(0, std::ios::end))
+    {
+        std::streampos stop = f.tellg();
+        f.seekg(start);
+        data.resize(stop - start);
+        f.read(&data[0], data.size());
+        data.resize(f.gcount());
+    }
+    else
+    {
+        f.clear();
+        size_t length = 0;
+        while (f)
         {
-            c = f.get();
-            if (c == 'n')
-                c = '\n';
+            data.resize(length + SAVE_BUFFER_SPILL);
+            f.read(&data[length], SAVE_BUFFER_SPILL);
+            length += f.gcount();
         }
-        
-        str.push_back(c);
+        data.resize(length);
     }
-    return str;
+    return load(data);
 }
-SaveObjectString::SaveObjectString(std::istream& f)
+
+bool SaveReader::next_key(SaveKey& id)
 {
-    str = parse_string(f);
+    std::string_view key;
+    if (!next_key(key))
+        return false;
+    id = save_key_lookup(key);
+    return true;
 }
 
-std::string SaveObjectString::get_string()
+void SaveReader::skip()
 {
-    return str;
+    switch (peek())
+    {
+        case SAVE_READER_MAP:
+        {
+            std::string_view key;
+            begin_map();
+            while (next_key(key))
+                skip();
+            break;
+        }
+        case SAVE_READER_LIST:
+        case SAVE_READER_INTS:
+            begin_list();
+            while (next_item())
+                skip();
+            break;
+        case SAVE_READER_NUM:
+            read_num();
+            break;
+        case SAVE_READER_STRING:
+            read_string();
+            break;
+        case SAVE_READER_NULL:
+            read_null();
+            break;
+    }
 }
 
-void SaveObjectString::save(std::ostream& f)
+SaveObject* SaveReader::read_object()
 {
-    f << '"';
-    for(std::string::iterator it = str.begin(); it != str.end(); ++it)
+    switch (peek())
     {
-        char c = *it;
-        if (c == '\n')
-            f << "\\n";
-        else if (c == '"')
-            f << "\\\"";
-        else if (c == '\\')
-            f << "\\\\";
-        else
-            f << c;
+        case SAVE_READER_MAP:
+        {
+            SaveObjectMap* omap = new SaveObjectMap;
+            try
+            {
+                std::string_view key;
+                begin_map();
+                while (next_key(key))
+                {
+                    SaveString name(key, omap->omap.get_allocator());
+                    omap->add_item(name, read_object());
+                }
+            }
+            catch (const std::runtime_error& error)
+            {
+                delete omap;
+                throw;
+            }
+            return omap;
+        }
+        case SAVE_READER_LIST:
+        {
+            SaveObjectList* olist = new SaveObjectList;
+            try
+            {
+                begin_list();
+                while (next_item())
+                    olist->add_item(read_object());
+            }
+            catch (const std::runtime_error& error)
+            {
+                delete olist;
+                throw;
+            }
+            return olist;
+        }
+        case SAVE_READER_INTS:
+        {
+            SaveObjectIntArray* array = new SaveObjectIntArray;
+            try
+            {
+                begin_list();
+                while (next_item())
+                    array->add_num(read_num());
+            }
+            catch (const std::runtime_error& error)
+            {
+                delete array;
+                throw;
+            }
+            return array;
+        }
+        case SAVE_READER_NUM:
+            return new SaveObjectNumber(read_num());
+        case SAVE_READER_STRING:
+            return new SaveObjectString(read_string());
+        default:
+            read_null();
+            return new SaveObjectNull;
     }
-    f << '"';
 }
 
-SaveObjectMap::SaveObjectMap(std::istream& f)
+// Re-encodes one value from the reader into the writer without building it
+// as a tree, for passing a stored document through into another.
+
+void SaveReader::copy(SaveWriter& writer)
 {
-    assert_exp('{');
-    char c;
-    while (true)
+    switch (peek())
     {
-        skip_whitespace(f);    
-        if (f.peek() == '}')
+        case SAVE_READER_MAP:
+        {
+            std::string_view key;
+            begin_map();
+            writer.begin_map();
+            while (next_key(key))
+            {
+                writer.key(key);
+                copy(writer);
+            }
+            writer.end_map();
+            break;
+        }
+        case SAVE_READER_LIST:
+            begin_list();
+            writer.begin_list();
+            while (next_item())
+                copy(writer);
+            writer.end_list();
+            break;
+        case SAVE_READER_INTS:
+            begin_list();
+            writer.begin_ints();
+            while (next_item())
+                writer.num(read_num());
+            writer.end_list();
+            break;
+        case SAVE_READER_NUM:
+            writer.num(read_num());
             break;
-        std::string key = parse_string(f);
-        skip_whitespace(f);    
-        assert_exp(':');
-        SaveObject* obj = SaveObject::load(f);
-        add_item(key, obj);
-        skip_whitespace(f);
-        if (f.peek() == '}')
+        case SAVE_READER_STRING:
+            writer.string(read_string());
             break;
-        assert_exp(',');
+        case SAVE_READER_NULL:
+            read_null();
+            writer.null();
+            break;
+    }
+}
+
+// Pull reader over the text format.  A comma is owed after every complete
+// value, and is consumed by the next_key() or next_item() that follows it.
+
+class SaveTextReader :
+    public SaveReader
+{
+public:
+    SaveParser parser;
+    SaveString scratch;
+    bool comma = false;
+
+    SaveTextReader(const char* data, size_t length):
+        parser(data, length)
+    {}
+
+    std::string_view read_quoted()
+    {
+        parser.skip_whitespace();
+        const char* start = parser.pos;
+        parser.expect('"');
+        const char* run = parser.pos;
+        while (parser.pos < parser.end && *parser.pos != '"' && *parser.pos != '\\')
+            parser.pos++;
+        if (parser.pos < parser.end && *parser.pos == '"')
+            return std::string_view(run, parser.pos++ - run);
+        parser.pos = start;
+        scratch = parser.parse_string();
+        return scratch;
+    }
+
+    bool next(char close)
+    {
+        parser.skip_whitespace();
+        if (comma && parser.peek() == ',')
+        {
+            parser.pos++;
+            parser.skip_whitespace();
+        }
+        else if (comma && parser.peek() != close)
+        {
+            throw(std::runtime_error("Unexpected character"));
+        }
+        if (parser.peek() == close)
+        {
+            parser.pos++;
+            comma = true;
+            return false;
+        }
+        comma = false;
+        return true;
+    }
+
+    SaveReaderType peek()
+    {
+        parser.skip_whitespace();
+        int c = parser.peek();
+        if (c == '{')
+            return SAVE_READER_MAP;
+        if (c == '[')
+            return SAVE_READER_LIST;
+        if (c == '"')
+            return SAVE_READER_STRING;
+        if (c == 'n')
+            return SAVE_READER_NULL;
+        if ((c >= '0' && c <= '9') || c == '-')
+            return SAVE_READER_NUM;
+        throw(std::runtime_error("Parse Error"));
+    }
+
+    void begin_map()
+    {
+        parser.skip_whitespace();
+        parser.expect('{');
+        comma = false;
+    }
+
+    bool next_key(std::string_view& key)
+    {
+        if (!next('}'))
+            return false;
+        key = read_quoted();
+        parser.skip_whitespace();
+        parser.expect(':');
+        return true;
+    }
+
+    void begin_list()
+    {
+        parser.skip_whitespace();
+        parser.expect('[');
+        comma = false;
+    }
+
+    bool next_item()
+    {
+        return next(']');
+    }
+
+    int64_t read_num()
+    {
+        parser.skip_whitespace();
+        int64_t number;
+        std::from_chars_result result = std::from_chars(parser.pos, parser.end, number);
+        if (result.ec != std::errc())
+            throw(std::runtime_error("Bad number"));
+        parser.pos = result.ptr;
+        comma = true;
+        return number;
+    }
+
+    std::string_view read_string()
+    {
+        std::string_view str = read_quoted();
+        comma = true;
+        return str;
+    }
+
+    void read_null()
+    {
+        parser.skip_whitespace();
+        if (parser.end - parser.pos < 4 || memcmp(parser.pos, "null", 4))
+            throw(std::runtime_error("Unexpected character"));
+        parser.pos += 4;
+        comma = true;
+    }
+
+    using SaveReader::next_key;
+};
+
+class SaveBinaryReader :
+    public SaveReader
+{
+public:
+    SaveBinaryParser parser;
+
+    class Frame
+    {
+    public:
+        uint64_t left;
+        bool ints;
+        int64_t prev;
+    };
+    std::vector<Frame> frames;
+
+    SaveBinaryReader(const char* data, size_t length):
+        parser(data, length)
+    {}
+
+    bool in_ints()
+    {
+        return !frames.empty() && frames.back().ints;
+    }
+
+    void expect(unsigned tag)
+    {
+        if (parser.get_byte() != tag)
+            throw(std::runtime_error("Unexpected binary tag"));
+    }
+
+    bool next()
+    {
+        if (!frames.back().left)
+        {
+            frames.pop_back();
+            return false;
+        }
+        frames.back().left--;
+        return true;
+    }
+
+    SaveReaderType peek()
+    {
+        if (in_ints())
+            return SAVE_READER_NUM;
+        if (parser.pos >= parser.end)
+            throw(std::runtime_error("Truncated binary save"));
+        switch ((unsigned char)*parser.pos)
+        {
+            case SAVE_BINARY_NULL:
+                return SAVE_READER_NULL;
+            case SAVE_BINARY_NUMBER:
+                return SAVE_READER_NUM;
+            case SAVE_BINARY_STRING:
+                return SAVE_READER_STRING;
+            case SAVE_BINARY_LIST:
+                return SAVE_READER_LIST;
+            case SAVE_BINARY_INT_ARRAY:
+                return SAVE_READER_INTS;
+            case SAVE_BINARY_MAP:
+                return SAVE_READER_MAP;
+            default:
+                throw(std::runtime_error("Bad binary tag"));
+        }
+    }
+
+    void begin_map()
+    {
+        expect(SAVE_BINARY_MAP);
+        frames.push_back(Frame{parser.get_count(), false, 0});
+    }
+
+    bool next_key(std::string_view& key)
+    {
+        if (!next())
+            return false;
+        key = parser.get_key();
+        return true;
+    }
+
+    void begin_list()
+    {
+        unsigned tag = parser.get_byte();
+        if (tag != SAVE_BINARY_LIST && tag != SAVE_BINARY_INT_ARRAY)
+            throw(std::runtime_error("Unexpected binary tag"));
+        frames.push_back(Frame{parser.get_count(), tag == SAVE_BINARY_INT_ARRAY, 0});
+    }
+
+    bool next_item()
+    {
+        return next();
+    }
+
+    int64_t read_num()
+    {
+        if (in_ints())
+        {
+            Frame& frame = frames.back();
+            uint64_t delta = parser.get_varint();
+            frame.prev = int64_t(uint64_t(frame.prev) + uint64_t(int64_t(delta >> 1) ^ -int64_t(delta & 1)));
+            return frame.prev;
+        }
+        expect(SAVE_BINARY_NUMBER);
+        uint64_t value = parser.get_varint();
+        return int64_t(value >> 1) ^ -int64_t(value & 1);
+    }
+
+    std::string_view read_string()
+    {
+        expect(SAVE_BINARY_STRING);
+        return parser.get_string();
+    }
+
+    void read_null()
+    {
+        expect(SAVE_BINARY_NULL);
+    }
+
+    using SaveReader::next_key;
+};
+
+SaveReader* SaveReader::open(const char* data, size_t length)
+{
+    if (length && (unsigned char)data[0] == SAVE_BINARY_MAGIC)
+    {
+        if (length < 2 || data[1] < 1 || data[1] > SAVE_BINARY_VERSION)
+            throw(std::runtime_error("Unknown binary save version"));
+        return new SaveBinaryReader(data + 2, length - 2);
+    }
+    return new SaveTextReader(data, length);
+}
+
+SaveReaderType SaveTreeReader::peek()
+{
+    if (!current)
+    {
+        if (!stack.empty() && stack.back().obj->is_int_array())
+            return SAVE_READER_NUM;
+        throw(std::runtime_error("Parse Error"));
+    }
+    if (current->is_map())
+        return SAVE_READER_MAP;
+    if (current->is_list())
+        return SAVE_READER_LIST;
+    if (current->is_int_array())
+        return SAVE_READER_INTS;
+    if (current->is_num())
+        return SAVE_READER_NUM;
+    if (current->is_string())
+        return SAVE_READER_STRING;
+    return SAVE_READER_NULL;
+}
+
+void SaveTreeReader::begin_map()
+{
+    if (!current)
+        throw(std::runtime_error("Not a map"));
+    stack.push_back(Frame{current->get_map(), 0});
+    current = NULL;
+}
+
+bool SaveTreeReader::next_key(std::string_view& key)
+{
+    Frame& frame = stack.back();
+    SaveObjectMap* omap = (SaveObjectMap*)frame.obj;
+    if (frame.index >= omap->omap.size())
+    {
+        stack.pop_back();
+        current = NULL;
+        return false;
     }
-    assert_exp('}');
+    SaveObjectMap::Entry& entry = omap->omap[frame.index++];
+    key = entry.key;
+    current = entry.value;
+    return true;
+}
+
+void SaveTreeReader::begin_list()
+{
+    if (!current)
+        throw(std::runtime_error("Not a list"));
+    if (current->is_int_array())
+        stack.push_back(Frame{current, 0});
+    else
+        stack.push_back(Frame{current->get_list(), 0});
+    current = NULL;
+}
+
+bool SaveTreeReader::next_item()
+{
+    Frame& frame = stack.back();
+    if (frame.obj->is_int_array())
+    {
+        if (frame.index >= ((SaveObjectIntArray*)frame.obj)->values.size())
+        {
+            stack.pop_back();
+            return false;
+        }
+        frame.index++;
+        return true;
+    }
+    SaveObjectList* olist = (SaveObjectList*)frame.obj;
+    if (frame.index >= olist->olist.size())
+    {
+        stack.pop_back();
+        current = NULL;
+        return false;
+    }
+    current = olist->olist[frame.index++];
+    return true;
+}
+
+int64_t SaveTreeReader::read_num()
+{
+    if (!current)
+    {
+        if (stack.empty() || !stack.back().obj->is_int_array())
+            throw(std::runtime_error("Not a num"));
+        Frame& frame = stack.back();
+        return ((SaveObjectIntArray*)frame.obj)->values[frame.index - 1];
+    }
+    return current->get_num();
+}
+
+std::string_view SaveTreeReader::read_string()
+{
+    if (!current || !current->is_string())
+        throw(std::runtime_error("Not a string"));
+    return ((SaveObjectString*)current)->str;
+}
+
+void SaveTreeReader::read_null()
+{
+    if (!current || !current->is_null())
+        throw(std::runtime_error("Not null"));
+}
+
+std::string SaveObjectString::get_string()
+{
+    return std::string(str.data(), str.size());
+}
+
+void SaveObjectNumber::save_binary(SaveBinaryWriter& writer)
+{
+    writer.buf.put(SAVE_BINARY_NUMBER);
+    writer.put_num(number);
 }
+
+void SaveObjectString::save_binary(SaveBinaryWriter& writer)
+{
+    writer.buf.put(SAVE_BINARY_STRING);
+    writer.put_string(str);
+}
+
+void SaveObjectString::save(SaveBuffer& buf)
+{
+    buf.put('"');
+    buf.append_escaped(str);
+    buf.put('"');
+}
+
+const char* save_key_names[SAVE_KEY_COUNT] =
+{
+    "E", "EF", "N", "NF", "PRESET", "S", "SF", "W", "WF", "best_design", "best_pressure_log",
+    "best_price", "best_score", "best_steam", "circuit", "connections", "description", "dialogue",
+    "direction", "element", "elements", "first_simpoint", "forced_elements", "forced_signs", "global",
+    "help_design", "hints", "icon", "icon_bg", "last_pressure_index", "last_pressure_log", "last_price",
+    "last_score", "last_steam", "level_index", "level_version", "name", "points", "read_only", "reset",
+    "saved_designs", "signs", "substep_count", "tested_direction", "tests", "text", "type", "who", "x",
+    "y"
+};
+
+SaveKey save_key_lookup(std::string_view key)
+{
+    unsigned lo = 0;
+    unsigned hi = SAVE_KEY_COUNT;
+    while (lo < hi)
+    {
+        unsigned mid = (lo + hi) / 2;
+        int cmp = key.compare(save_key_names[mid]);
+        if (cmp == 0)
+            return SaveKey(mid);
+        if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return SAVE_KEY_NONE;
+}
+
 SaveObjectMap::~SaveObjectMap()
 {
-    for(std::map<std::string, SaveObject*>::iterator it = omap.begin();it != omap.end();++it)
-        delete it->second;
+    for(Map::iterator it = omap.begin();it != omap.end();++it)
+        delete it->value;
 }
 
-void SaveObjectMap::add_item(std::string key, SaveObject* value)
+// Entries are kept sorted by key.  Saves are written in key order, so when
+// loading, every new key normally goes on the end.
+
+static void insert_entry(SaveObjectMap::Map& omap, std::string_view key, SaveKey id, SaveObject* value)
+{
+    SaveObjectMap::Map::iterator it = omap.end();
+    if (!omap.empty() && !(std::string_view(omap.back().key) < key))
+    {
+        it = std::lower_bound(omap.begin(), omap.end(), key, [](const SaveObjectMap::Entry& entry, std::string_view key){return std::string_view(entry.key) < key;});
+        assert(std::string_view(it->key) != key);
+    }
+    omap.insert(it, SaveObjectMap::Entry{SaveString(key, omap.get_allocator()), value, id});
+}
+
+void SaveObjectMap::add_item(std::string_view key, SaveObject* value)
 {
-    assert(!omap[key]);
-    omap[key]=value;
+    insert_entry(omap, key, save_key_lookup(key), value);
 }
 
-SaveObject* SaveObjectMap::get_item(std::string key)
+void SaveObjectMap::add_item(SaveKey key, SaveObject* value)
 {
-    if (omap.find(key) == omap.end())
+    insert_entry(omap, save_key_names[key], key, value);
+}
+
+void SaveObjectMap::set_item(std::string_view key, SaveObject* value)
+{
+    Map::iterator it = std::lower_bound(omap.begin(), omap.end(), key, [](const Entry& entry, std::string_view key){return std::string_view(entry.key) < key;});
+    if (it == omap.end() || std::string_view(it->key) != key)
+    {
+        insert_entry(omap, key, save_key_lookup(key), value);
+        return;
+    }
+    delete it->value;
+    it->value = value;
+}
+
+SaveObject* SaveObjectMap::find(std::string_view key)
+{
+    Map::iterator it = std::lower_bound(omap.begin(), omap.end(), key, [](const Entry& entry, std::string_view key){return std::string_view(entry.key) < key;});
+    if (it == omap.end() || std::string_view(it->key) != key)
+        return NULL;
+    return it->value;
+}
+
+SaveObject* SaveObjectMap::find(SaveKey key)
+{
+    if (omap.size() > 16)
+        return find(save_key_names[key]);
+    for (Entry& entry : omap)
+        if (entry.id == key)
+            return entry.value;
+    return NULL;
+}
+
+SaveObject* SaveObjectMap::get_item(std::string_view key)
+{
+    SaveObject* value = find(key);
+    if (!value)
     {
         std::cout << key << "\n";
         throw(std::runtime_error("Bad map key"));
     }
-    return omap[key];
+    return value;
+}
+
+SaveObject* SaveObjectMap::get_item(SaveKey key)
+{
+    return get_item(save_key_names[key]);
 }
 
-int64_t SaveObjectMap::get_num(std::string key)
+int64_t SaveObjectMap::get_num(std::string_view key)
 {
-    if (omap.find(key) != omap.end())
-        return omap[key]->get_num();
+    SaveObject* value = find(key);
+    if (value)
+        return value->get_num();
     std::cout << "failed indexing for an int with key:" << key << "\n";
     return 0;
 }
-void SaveObjectMap::get_num(std::string key, int& value)
+
+int64_t SaveObjectMap::get_num(SaveKey key)
 {
-    if (omap.find(key) == omap.end())
+    SaveObject* value = find(key);
+    if (value)
+        return value->get_num();
+    std::cout << "failed indexing for an int with key:" << save_key_names[key] << "\n";
+    return 0;
+}
+
+void SaveObjectMap::get_num(std::string_view key, int& value)
+{
+    SaveObject* obj = find(key);
+    if (!obj)
         throw(std::runtime_error("Bad map key"));
-    value = omap[key]->get_num();
+    value = obj->get_num();
+}
+
+void SaveObjectMap::add_num(std::string_view key, int64_t value)
+{
+    add_item(key, new SaveObjectNumber(value));
 }
-void SaveObjectMap::add_num(std::string key, int64_t value)
+
+void SaveObjectMap::add_num(SaveKey key, int64_t value)
 {
     add_item(key, new SaveObjectNumber(value));
 }
-void SaveObjectMap::add_string(std::string key, std::string value)
+
+void SaveObjectMap::add_string(std::string_view key, std::string_view value)
 {
     add_item(key, new SaveObjectString(value));
 }
-void SaveObjectMap::get_string(std::string key, std::string& value)
+
+void SaveObjectMap::add_string(SaveKey key, std::string_view value)
 {
-    if (omap.find(key) == omap.end())
+    add_item(key, new SaveObjectString(value));
+}
+
+void SaveObjectMap::get_string(std::string_view key, std::string& value)
+{
+    SaveObject* obj = find(key);
+    if (!obj)
         throw(std::runtime_error("Bad map key"));
-    value = omap[key]->get_string();
+    value = obj->get_string();
 }
 
-std::string SaveObjectMap::get_string(std::string key)
+void SaveObjectMap::get_string(SaveKey key, std::string& value)
 {
-    if (omap.find(key) == omap.end())
+    SaveObject* obj = find(key);
+    if (!obj)
         throw(std::runtime_error("Bad map key"));
-    return omap[key]->get_string();
+    value = obj->get_string();
 }
 
-bool SaveObjectMap::has_key(std::string key)
+std::string SaveObjectMap::get_string(std::string_view key)
 {
-    return omap.find(key) != omap.end();
+    SaveObject* obj = find(key);
+    if (!obj)
+        throw(std::runtime_error("Bad map key"));
+    return obj->get_string();
 }
 
-void SaveObjectMap::save(std::ostream& f)
+std::string SaveObjectMap::get_string(SaveKey key)
 {
-    f.put('{');
+    SaveObject* obj = find(key);
+    if (!obj)
+        throw(std::runtime_error("Bad map key"));
+    return obj->get_string();
+}
+
+bool SaveObjectMap::has_key(std::string_view key)
+{
+    return find(key) != NULL;
+}
+
+bool SaveObjectMap::has_key(SaveKey key)
+{
+    return find(key) != NULL;
+}
+
+void SaveObjectMap::save(SaveBuffer& buf)
+{
+    buf.put('{');
     bool first = true;
-    for (std::map<std::string, SaveObject*>::iterator it=omap.begin(); it!=omap.end(); ++it)
+    for (Map::iterator it=omap.begin(); it!=omap.end(); ++it)
     {
         if (!first)
-            f << ',';
+            buf.put(',');
         first = false;
-        f << '"';
-        f << it->first;
-        f << '"';
-
-        f << ':';
-        it->second->save(f);
+        buf.put('"');
+        buf.append(it->key);
+        buf.append("\":", 2);
+        it->value->save(buf);
+        buf.spill();
     }
-    f.put('}');
+    buf.put('}');
 };
 
+void SaveObjectMap::save_binary(SaveBinaryWriter& writer)
+{
+    writer.buf.put(SAVE_BINARY_MAP);
+    writer.put_varint(omap.size());
+    for (Map::iterator it=omap.begin(); it!=omap.end(); ++it)
+    {
+        writer.put_key(it->key, it->id);
+        it->value->save_binary(writer);
+        writer.spill();
+    }
+}
+
 void SaveObjectMap::pretty_print(std::ostream& f, int indent)
 {
     f.put('\n');
     f << std::string(indent, ' ');
     f.put('{');
     bool first = true;
-    for (std::map<std::string, SaveObject*>::iterator it=omap.begin(); it!=omap.end(); ++it)
+    for (Map::iterator it=omap.begin(); it!=omap.end(); ++it)
     {
         if (!first)
             f << ',';
@@ -211,11 +1456,11 @@ void SaveObjectMap::pretty_print(std::ostream& f, int indent)
         f << std::string(indent + 2, ' ');
         first = false;
         f << '"';
-        f << it->first;
+        f << it->key;
         f << '"';
 
         f << ':';
-        it->second->pretty_print(f, indent + 4);
+        it->value->pretty_print(f, indent + 4);
     }
     f.put('\n');
     f << std::string(indent, ' ');
@@ -225,35 +1470,17 @@ void SaveObjectMap::pretty_print(std::ostream& f, int indent)
 SaveObject* SaveObjectMap::dup()
 {
     SaveObjectMap* rep = new SaveObjectMap;
-    for (std::map<std::string, SaveObject*>::iterator it=omap.begin(); it!=omap.end(); ++it)
+    rep->omap.reserve(omap.size());
+    for (Map::iterator it=omap.begin(); it!=omap.end(); ++it)
     {
-        rep->add_item(it->first, it->second->dup());
+        rep->omap.push_back(Entry{SaveString(it->key, rep->omap.get_allocator()), it->value->dup(), it->id});
     }
     return rep;
 };
 
-SaveObjectList::SaveObjectList(std::istream& f)
-{
-    assert_exp('[');
-    char c;
-    while (true)
-    {
-        skip_whitespace(f);    
-        if (f.peek() == ']')
-            break;
-        SaveObject* obj = SaveObject::load(f);
-        add_item(obj);
-        skip_whitespace(f);    
-        if (f.peek() == ']')
-            break;
-        assert_exp(',');
-    }
-    assert_exp(']');
-}
-
 SaveObjectList::~SaveObjectList()
 {
-    for(std::vector<SaveObject*>::iterator it = olist.begin(); it != olist.end(); it++)
+    for(auto it = olist.begin(); it != olist.end(); it++)
         delete *it;
 }
 
@@ -262,6 +1489,14 @@ void SaveObjectList::add_item(SaveObject* value)
     olist.push_back(value);
 }
 
+void SaveObjectList::set_item(unsigned index, SaveObject* value)
+{
+    if (index >= get_count())
+        throw(std::runtime_error("Bad list index"));
+    delete olist[index];
+    olist[index] = value;
+}
+
 SaveObject* SaveObjectList::get_item(unsigned index)
 {
     if (index >= get_count())
@@ -284,25 +1519,37 @@ int64_t SaveObjectList::get_num(int index)
     return get_item(index)->get_num();
 }
 
-void SaveObjectList::save(std::ostream& f)
+void SaveObjectList::save(SaveBuffer& buf)
 {
-    f.put('[');
+    buf.put('[');
     bool first = true;
-    for (std::vector<SaveObject*>::iterator it=olist.begin(); it!=olist.end(); ++it)
+    for (auto it=olist.begin(); it!=olist.end(); ++it)
     {
         if (!first)
-            f << ',';
+            buf.put(',');
         first = false;
-        (*it)->save(f);
+        (*it)->save(buf);
+        buf.spill();
+    }
+    buf.put(']');
+}
+
+void SaveObjectList::save_binary(SaveBinaryWriter& writer)
+{
+    writer.buf.put(SAVE_BINARY_LIST);
+    writer.put_varint(olist.size());
+    for (auto it=olist.begin(); it!=olist.end(); ++it)
+    {
+        (*it)->save_binary(writer);
+        writer.spill();
     }
-    f.put(']');
 }
 
 void SaveObjectList::pretty_print(std::ostream& f, int indent)
 {
     f.put('[');
     bool first = true;
-    for (std::vector<SaveObject*>::iterator it=olist.begin(); it!=olist.end(); ++it)
+    for (auto it=olist.begin(); it!=olist.end(); ++it)
     {
         if (!first)
             f << ',';
@@ -326,7 +1573,7 @@ std::string SaveObjectList::get_string(int index)
 SaveObject* SaveObjectList::dup()
 {
     SaveObjectList* rep = new SaveObjectList;
-    for (std::vector<SaveObject*>::iterator it=olist.begin(); it!=olist.end(); ++it)
+    for (auto it=olist.begin(); it!=olist.end(); ++it)
     {
         rep->add_item((*it)->dup());
     }
@@ -339,15 +1586,60 @@ void SaveObjectList::pop_back()
     olist.pop_back();
 }
 
-SaveObjectNull::SaveObjectNull(std::istream& f)
+void SaveObjectList::get_ints(std::vector<int64_t>& values)
+{
+    values.clear();
+    for (auto it=olist.begin(); it!=olist.end(); ++it)
+        values.push_back((*it)->get_num());
+}
+
+void SaveObjectIntArray::save(SaveBuffer& buf)
+{
+    buf.put('[');
+    for (size_t i = 0; i < values.size(); i++)
+    {
+        if (i)
+            buf.put(',');
+        buf.append_num(values[i]);
+    }
+    buf.put(']');
+}
+
+// Neighbouring values are usually close, so each one is stored as a zigzag
+// varint of the difference from the one before.
+
+void SaveObjectIntArray::save_binary(SaveBinaryWriter& writer)
+{
+    writer.buf.put(SAVE_BINARY_INT_ARRAY);
+    writer.put_varint(values.size());
+    int64_t prev = 0;
+    for (int64_t value : values)
+    {
+        writer.put_num(int64_t(uint64_t(value) - uint64_t(prev)));
+        prev = value;
+    }
+}
+
+int64_t SaveObjectIntArray::get_num(unsigned index)
+{
+    if (index >= values.size())
+        throw(std::runtime_error("Bad list index"));
+    return values[index];
+}
+
+SaveObject* SaveObjectIntArray::dup()
+{
+    SaveObjectIntArray* rep = new SaveObjectIntArray;
+    rep->values.assign(values.begin(), values.end());
+    return rep;
+}
+
+void SaveObjectNull::save(SaveBuffer& buf)
 {
-    assert_exp('n');
-    assert_exp('u');
-    assert_exp('l');
-    assert_exp('l');
+    buf.append("null", 4);
 }
 
-void SaveObjectNull::save(std::ostream& f)
+void SaveObjectNull::save_binary(SaveBinaryWriter& writer)
 {
-    f << "null";
+    writer.buf.put(SAVE_BINARY_NULL);
 }
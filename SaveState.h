@@ -3,34 +3,304 @@
 #include <iostream>
 #include <cassert>
 #include <map>
+#include <unordered_map>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <iostream>
 #include <sstream>
 
+class SaveObject;
 class SaveObjectMap;
 class SaveObjectList;
+class SaveObjectIntArray;
 class SaveObjectNull;
 
+// Bump allocator for save trees.  While a SaveArenaScope is active on a
+// thread, every SaveObject created on that thread, together with its strings
+// and container storage, is carved out of the arena.  Deleting such an object
+// runs its destructor but returns no memory; everything is released at once
+// when the arena is destroyed, so a whole document can simply be abandoned
+// with its arena.  Objects allocated outside any scope use the heap as before.
+
+class SaveArena
+{
+public:
+    std::vector<char*> blocks;
+    char* pos = NULL;
+    size_t left = 0;
+    size_t block_size = 64 * 1024;
+
+    SaveArena(){};
+    SaveArena(const SaveArena&) = delete;
+    SaveArena& operator=(const SaveArena&) = delete;
+    ~SaveArena();
+    void* allocate(size_t size, size_t align);
+};
+
+SaveArena* save_arena_current();
+
+class SaveArenaScope
+{
+public:
+    SaveArena* prev;
+    SaveArenaScope(SaveArena* arena);
+    ~SaveArenaScope();
+};
+
+template <class T> class SaveAllocator
+{
+public:
+    typedef T value_type;
+    SaveArena* arena;
+
+    SaveAllocator():
+        arena(save_arena_current())
+    {}
+    SaveAllocator(SaveArena* arena_):
+        arena(arena_)
+    {}
+    template <class U> SaveAllocator(const SaveAllocator<U>& other):
+        arena(other.arena)
+    {}
+    T* allocate(size_t n)
+    {
+        if (arena)
+            return (T*)arena->allocate(n * sizeof(T), alignof(T));
+        return (T*)::operator new(n * sizeof(T));
+    }
+    void deallocate(T* ptr, size_t n)
+    {
+        if (!arena)
+            ::operator delete(ptr);
+    }
+    template <class U> bool operator==(const SaveAllocator<U>& other) const {return arena == other.arena;}
+    template <class U> bool operator!=(const SaveAllocator<U>& other) const {return arena != other.arena;}
+};
+
+typedef std::basic_string<char, std::char_traits<char>, SaveAllocator<char>> SaveString;
+
+// Keys used by circuit and level saves are interned: map entries carry the
+// id alongside the key string, and lookups by id compare integers instead of
+// strings.  save_key_names is in byte order, so the ids sort like the keys.
+
+enum SaveKey
+{
+    SAVE_KEY_E,
+    SAVE_KEY_EF,
+    SAVE_KEY_N,
+    SAVE_KEY_NF,
+    SAVE_KEY_PRESET,
+    SAVE_KEY_S,
+    SAVE_KEY_SF,
+    SAVE_KEY_W,
+    SAVE_KEY_WF,
+    SAVE_KEY_BEST_DESIGN,
+    SAVE_KEY_BEST_PRESSURE_LOG,
+    SAVE_KEY_BEST_PRICE,
+    SAVE_KEY_BEST_SCORE,
+    SAVE_KEY_BEST_STEAM,
+    SAVE_KEY_CIRCUIT,
+    SAVE_KEY_CONNECTIONS,
+    SAVE_KEY_DESCRIPTION,
+    SAVE_KEY_DIALOGUE,
+    SAVE_KEY_DIRECTION,
+    SAVE_KEY_ELEMENT,
+    SAVE_KEY_ELEMENTS,
+    SAVE_KEY_FIRST_SIMPOINT,
+    SAVE_KEY_FORCED_ELEMENTS,
+    SAVE_KEY_FORCED_SIGNS,
+    SAVE_KEY_GLOBAL,
+    SAVE_KEY_HELP_DESIGN,
+    SAVE_KEY_HINTS,
+    SAVE_KEY_ICON,
+    SAVE_KEY_ICON_BG,
+    SAVE_KEY_LAST_PRESSURE_INDEX,
+    SAVE_KEY_LAST_PRESSURE_LOG,
+    SAVE_KEY_LAST_PRICE,
+    SAVE_KEY_LAST_SCORE,
+    SAVE_KEY_LAST_STEAM,
+    SAVE_KEY_LEVEL_INDEX,
+    SAVE_KEY_LEVEL_VERSION,
+    SAVE_KEY_NAME,
+    SAVE_KEY_POINTS,
+    SAVE_KEY_READ_ONLY,
+    SAVE_KEY_RESET,
+    SAVE_KEY_SAVED_DESIGNS,
+    SAVE_KEY_SIGNS,
+    SAVE_KEY_SUBSTEP_COUNT,
+    SAVE_KEY_TESTED_DIRECTION,
+    SAVE_KEY_TESTS,
+    SAVE_KEY_TEXT,
+    SAVE_KEY_TYPE,
+    SAVE_KEY_WHO,
+    SAVE_KEY_X,
+    SAVE_KEY_Y,
+    SAVE_KEY_COUNT,
+    SAVE_KEY_NONE = SAVE_KEY_COUNT
+};
+
+extern const char* save_key_names[SAVE_KEY_COUNT];
+SaveKey save_key_lookup(std::string_view key);
+
+// Output buffer for the serialisers.  Objects write into it with bulk
+// appends; the result is taken as a string once the whole tree has been
+// written, or, given a sink, passed on to it whenever it grows past
+// SAVE_BUFFER_SPILL so a large save never sits in memory whole.
+
+#define SAVE_BUFFER_SPILL 65536
+
+class SaveBuffer
+{
+public:
+    std::string data;
+    std::ostream* sink = NULL;
+
+    void flush(){sink->write(data.data(), data.size()); data.clear();};
+    void spill(){if (sink && data.size() >= SAVE_BUFFER_SPILL) flush();};
+    void put(char c){data.push_back(c);};
+    void append(const char* str, size_t length){data.append(str, length);};
+    void append(std::string_view str){data.append(str.data(), str.size());};
+    void append_num(int64_t value);
+    void append_escaped(std::string_view str);
+};
+
+// Streaming serialisation.  Domain objects write themselves through a
+// SaveWriter, so a save can go straight to text or binary without building a
+// SaveObject tree first; SaveTreeWriter builds the tree for the callers that
+// still want one.  Keys in a map are expected in byte order, which is what
+// SaveObjectMap writes, so all three produce the same document.
+
+class SaveWriter
+{
+public:
+    virtual ~SaveWriter(){};
+    virtual void begin_map()=0;
+    virtual void end_map()=0;
+    virtual void begin_list()=0;
+    virtual void begin_ints()=0;
+    virtual void end_list()=0;
+    virtual void write_key(std::string_view key, SaveKey id)=0;
+    virtual void write_num(int64_t value)=0;
+    virtual void write_string(std::string_view value)=0;
+    virtual void write_null()=0;
+    virtual void write_object(SaveObject* obj)=0;
+
+    void key(SaveKey id){write_key(save_key_names[id], id);};
+    void key(std::string_view key){write_key(key, SAVE_KEY_NONE);};
+    void num(int64_t value){write_num(value);};
+    void num(SaveKey id, int64_t value){key(id); write_num(value);};
+    void num(std::string_view name, int64_t value){key(name); write_num(value);};
+    void string(std::string_view value){write_string(value);};
+    void string(SaveKey id, std::string_view value){key(id); write_string(value);};
+    void string(std::string_view name, std::string_view value){key(name); write_string(value);};
+    void null(){write_null();};
+    void object(SaveObject* obj){write_object(obj);};
+};
+
+class SaveTextWriter :
+    public SaveWriter
+{
+public:
+    SaveBuffer buf;
+    bool comma = false;
+
+    void separate(){if (comma) buf.put(','); comma = true;};
+    void begin_map(){separate(); buf.put('{'); comma = false;};
+    void end_map(){buf.put('}'); comma = true; buf.spill();};
+    void begin_list(){separate(); buf.put('['); comma = false;};
+    void begin_ints(){begin_list();};
+    void end_list(){buf.put(']'); comma = true; buf.spill();};
+    void write_key(std::string_view key, SaveKey id);
+    void write_num(int64_t value){separate(); buf.append_num(value);};
+    void write_string(std::string_view value);
+    void write_null(){separate(); buf.append("null", 4);};
+    void write_object(SaveObject* obj);
+};
+
+// Binary encoding.  A document starts with SAVE_BINARY_MAGIC, which can never
+// start a text save, so SaveObject::load tells the two apart by the first
+// byte.  Numbers are zigzag varints, strings and containers carry their
+// length up front, and map keys are written out once per document and
+// referred to by index after that.
+
+#define SAVE_BINARY_MAGIC 0xC5
+#define SAVE_BINARY_VERSION 2
+
+class SaveBinaryWriter :
+    public SaveWriter
+{
+public:
+    SaveBuffer buf;
+    std::unordered_map<std::string_view, unsigned> keys;
+    unsigned key_count = 0;
+    unsigned interned_keys[SAVE_KEY_COUNT] = {};
+
+    // Containers opened through the SaveWriter interface.  Their length is
+    // not known until they are closed, so a one byte placeholder is left
+    // after the tag and widened if the count turns out not to fit.
+
+    class Frame
+    {
+    public:
+        size_t pos;
+        uint64_t count;
+        bool map;
+        bool ints;
+        int64_t prev;
+    };
+    std::vector<Frame> frames;
+
+    SaveBinaryWriter();
+    void put_varint(uint64_t value);
+    void put_num(int64_t value){put_varint((uint64_t(value) << 1) ^ uint64_t(value >> 63));};
+    void put_string(std::string_view str){put_varint(str.size()); buf.append(str);};
+    void put_key(std::string_view key, SaveKey id = SAVE_KEY_NONE);
+
+    void item(){if (!frames.empty() && !frames.back().map) frames.back().count++;};
+    void spill(){if (frames.empty()) buf.spill();};
+    void begin(char tag, bool map, bool ints);
+    void end();
+    void begin_map();
+    void end_map(){end();};
+    void begin_list();
+    void begin_ints();
+    void end_list(){end();};
+    void write_key(std::string_view key, SaveKey id){frames.back().count++; put_key(key, id);};
+    void write_num(int64_t value);
+    void write_string(std::string_view value);
+    void write_null();
+    void write_object(SaveObject* obj);
+};
+
 class SaveObject
 {
 public:
     SaveObject(){};
     virtual ~SaveObject(){};
-    virtual void save(std::ostream& f)=0;
+    static void* operator new(size_t size);
+    static void operator delete(void* ptr, size_t size);
+    virtual void save(SaveBuffer& buf)=0;
+    void save(std::ostream& f);
+    virtual void save_binary(SaveBinaryWriter& writer)=0;
+    void save_binary(std::ostream& f);
     virtual void pretty_print(std::ostream& f, int indent = 0)=0;
     std::string to_string();
-    static SaveObject* load(std::string& input);
+    std::string to_binary();
+    static SaveObject* load(const char* data, size_t length);
+    static SaveObject* load(const std::string& input);
     static SaveObject* load(std::istream& f);
     virtual int64_t get_num(){throw(std::runtime_error("Not a num"));};
     virtual std::string get_string(){throw(std::runtime_error("Not a string"));};
     virtual SaveObjectMap* get_map(){throw(std::runtime_error("Not a map"));};
     virtual SaveObjectList* get_list(){throw(std::runtime_error("Not a list"));};
+    virtual void get_ints(std::vector<int64_t>& values){throw(std::runtime_error("Not a list"));};
     virtual bool is_null(){return false;};
     virtual bool is_map(){return false;};
     virtual bool is_num(){return false;};
     virtual bool is_string(){return false;};
     virtual bool is_list(){return false;};
+    virtual bool is_int_array(){return false;};
     virtual SaveObject* dup() = 0;
 };
 
@@ -40,10 +310,12 @@ class SaveObjectNumber :
 public:
     int64_t number;
     SaveObjectNumber(int64_t number_):number(number_){};
-    SaveObjectNumber(std::istream& stream) {stream >> number;};
     int64_t get_num(){return number;};
-    void save(std::ostream& f){f << number;};
-    void pretty_print(std::ostream& f, int indent){save(f);};
+    using SaveObject::save;
+    using SaveObject::save_binary;
+    void save(SaveBuffer& buf){buf.append_num(number);};
+    void save_binary(SaveBinaryWriter& writer);
+    void pretty_print(std::ostream& f, int indent){f << number;};
     SaveObject* dup() {return new SaveObjectNumber(number);};
     virtual bool is_num(){return true;};
 };
@@ -52,11 +324,13 @@ class SaveObjectString :
     public SaveObject
 {
 public:
-    std::string str;
-    SaveObjectString(std::string str_):str(str_){};
-    SaveObjectString(std::istream& stream);
+    SaveString str;
+    SaveObjectString(std::string_view str_):str(str_){};
     std::string get_string();
-    void save(std::ostream& f);
+    using SaveObject::save;
+    using SaveObject::save_binary;
+    void save(SaveBuffer& buf);
+    void save_binary(SaveBinaryWriter& writer);
     void pretty_print(std::ostream& f, int indent){save(f);};
     SaveObject* dup() {return new SaveObjectString(str);};
     virtual bool is_string(){return true;};
@@ -66,24 +340,45 @@ class SaveObjectMap :
     public SaveObject
 {
 public:
-    std::map<std::string, SaveObject*> omap;
+    class Entry
+    {
+    public:
+        SaveString key;
+        SaveObject* value;
+        SaveKey id;
+    };
+    typedef std::vector<Entry, SaveAllocator<Entry>> Map;
+    Map omap;
 
     SaveObjectMap(){};
     virtual ~SaveObjectMap();
-    SaveObjectMap(std::istream& f);
-    void save(std::ostream& f);
+    using SaveObject::save;
+    using SaveObject::save_binary;
+    void save(SaveBuffer& buf);
+    void save_binary(SaveBinaryWriter& writer);
     void pretty_print(std::ostream& f, int indent);
     SaveObjectMap* get_map(){return this;};
     
-    void add_item(std::string key, SaveObject* value);
-    SaveObject* get_item(std::string key);
-    int64_t get_num(std::string key);
-    void get_num(std::string key, int& value);
-    void add_num(std::string key, int64_t value);
-    void add_string(std::string key, std::string value);
-    void get_string(std::string key, std::string& value);
-    std::string get_string(std::string key);
-    bool has_key(std::string key);
+    void add_item(std::string_view key, SaveObject* value);
+    void add_item(SaveKey key, SaveObject* value);
+    void set_item(std::string_view key, SaveObject* value);
+    SaveObject* find(std::string_view key);
+    SaveObject* find(SaveKey key);
+    SaveObject* get_item(std::string_view key);
+    SaveObject* get_item(SaveKey key);
+    int64_t get_num(std::string_view key);
+    int64_t get_num(SaveKey key);
+    void get_num(std::string_view key, int& value);
+    void add_num(std::string_view key, int64_t value);
+    void add_num(SaveKey key, int64_t value);
+    void add_string(std::string_view key, std::string_view value);
+    void add_string(SaveKey key, std::string_view value);
+    void get_string(std::string_view key, std::string& value);
+    void get_string(SaveKey key, std::string& value);
+    std::string get_string(std::string_view key);
+    std::string get_string(SaveKey key);
+    bool has_key(std::string_view key);
+    bool has_key(SaveKey key);
     SaveObject* dup();
     virtual bool is_map(){return true;};
 
@@ -94,16 +389,20 @@ class SaveObjectList :
     public SaveObject
 {
 public:
-    std::vector<SaveObject*> olist;
+    std::vector<SaveObject*, SaveAllocator<SaveObject*>> olist;
 
     SaveObjectList(){};
-    SaveObjectList(std::istream& f);
     ~SaveObjectList();
-    void save(std::ostream& f);
+    using SaveObject::save;
+    using SaveObject::save_binary;
+    void save(SaveBuffer& buf);
+    void save_binary(SaveBinaryWriter& writer);
     void pretty_print(std::ostream& f, int indent);
     SaveObjectList* get_list(){return this;};
+    void get_ints(std::vector<int64_t>& values);
     
     void add_item(SaveObject* value);
+    void set_item(unsigned index, SaveObject* value);
     SaveObject* get_item(unsigned index);
     unsigned get_count();
     void add_num(int64_t value);
@@ -116,15 +415,130 @@ public:
 
 };
 
+// A list of numbers held in one vector rather than as separate objects.  It
+// is written as an ordinary list in text, so a text save reads back as a
+// SaveObjectList; readers use get_ints() to accept either.
+
+class SaveObjectIntArray :
+    public SaveObject
+{
+public:
+    std::vector<int64_t, SaveAllocator<int64_t>> values;
+
+    SaveObjectIntArray(){};
+    using SaveObject::save;
+    using SaveObject::save_binary;
+    void save(SaveBuffer& buf);
+    void save_binary(SaveBinaryWriter& writer);
+    void pretty_print(std::ostream& f, int indent){save(f);};
+    void get_ints(std::vector<int64_t>& values_){values_.assign(values.begin(), values.end());};
+
+    unsigned get_count(){return values.size();};
+    void add_num(int64_t value){values.push_back(value);};
+    int64_t get_num(unsigned index);
+    void pop_back(){values.pop_back();};
+    SaveObject* dup();
+    virtual bool is_int_array(){return true;};
+};
+
 
 class SaveObjectNull :
     public SaveObject
 {
 public:
     SaveObjectNull(){};
-    SaveObjectNull(std::istream& f);
-    void save(std::ostream& f);
+    using SaveObject::save;
+    using SaveObject::save_binary;
+    void save(SaveBuffer& buf);
+    void save_binary(SaveBinaryWriter& writer);
     void pretty_print(std::ostream& f, int indent){save(f);};
     virtual bool is_null(){return true;};
     SaveObject* dup() {return new SaveObjectNull();};
 };
+
+class SaveTreeWriter :
+    public SaveWriter
+{
+public:
+    SaveObject* root = NULL;
+    std::vector<SaveObject*> stack;
+    std::string pending_key;
+    SaveKey pending_id = SAVE_KEY_NONE;
+
+    ~SaveTreeWriter(){delete root;};
+    SaveObject* take(){SaveObject* obj = root; root = NULL; return obj;};
+    void add(SaveObject* obj);
+    void begin_map();
+    void end_map(){stack.pop_back();};
+    void begin_list();
+    void begin_ints();
+    void end_list(){stack.pop_back();};
+    void write_key(std::string_view key, SaveKey id);
+    void write_num(int64_t value);
+    void write_string(std::string_view value){add(new SaveObjectString(value));};
+    void write_null(){add(new SaveObjectNull);};
+    void write_object(SaveObject* obj){add(obj->dup());};
+};
+
+// Pull parser.  The reader walks a document one value at a time: maps are
+// read with begin_map() and next_key() until it returns false, lists with
+// begin_list() and next_item().  Integer arrays peek as SAVE_READER_INTS but
+// are otherwise read like lists.  Strings returned by the reader stay valid
+// until the next call.
+
+enum SaveReaderType
+{
+    SAVE_READER_NULL,
+    SAVE_READER_NUM,
+    SAVE_READER_STRING,
+    SAVE_READER_LIST,
+    SAVE_READER_INTS,
+    SAVE_READER_MAP
+};
+
+class SaveReader
+{
+public:
+    virtual ~SaveReader(){};
+    virtual SaveReaderType peek()=0;
+    virtual void begin_map()=0;
+    virtual bool next_key(std::string_view& key)=0;
+    virtual void begin_list()=0;
+    virtual bool next_item()=0;
+    virtual int64_t read_num()=0;
+    virtual std::string_view read_string()=0;
+    virtual void read_null()=0;
+
+    bool next_key(SaveKey& id);
+    void skip();
+    SaveObject* read_object();
+    void copy(SaveWriter& writer);
+    static SaveReader* open(const char* data, size_t length);
+};
+
+class SaveTreeReader :
+    public SaveReader
+{
+public:
+    class Frame
+    {
+    public:
+        SaveObject* obj;
+        size_t index;
+    };
+    std::vector<Frame> stack;
+    SaveObject* current;
+
+    SaveTreeReader(SaveObject* root):
+        current(root)
+    {}
+    SaveReaderType peek();
+    void begin_map();
+    bool next_key(std::string_view& key);
+    void begin_list();
+    bool next_item();
+    int64_t read_num();
+    std::string_view read_string();
+    void read_null();
+    using SaveReader::next_key;
+};
@@ -0,0 +1,244 @@
+#include "Stats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <vector>
+#include <stdio.h>
+
+uint64_t stats_time_us()
+{
+    static const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+unsigned LatencyHistogram::bucket_index(uint64_t value)
+{
+    if (value < SUB_BUCKETS)
+        return value;
+    unsigned msb = 63 - __builtin_clzll(value);
+    unsigned sub = (value >> (msb - 3)) & (SUB_BUCKETS - 1);
+    return (msb - 2) * SUB_BUCKETS + sub;
+}
+
+uint64_t LatencyHistogram::bucket_limit(unsigned index)
+{
+    if (index < SUB_BUCKETS)
+        return index + 1;
+    unsigned msb = index / SUB_BUCKETS + 2;
+    uint64_t sub = index % SUB_BUCKETS;
+    if (msb >= 63)
+        return UINT64_MAX;
+    return (uint64_t(SUB_BUCKETS + sub + 1)) << (msb - 3);
+}
+
+void LatencyHistogram::add(uint64_t value)
+{
+    buckets[bucket_index(value)]++;
+    count++;
+    sum += value;
+    if (value > max)
+        max = value;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other)
+{
+    for (unsigned i = 0; i < BUCKET_COUNT; i++)
+        buckets[i] += other.buckets[i];
+    count += other.count;
+    sum += other.sum;
+    if (other.max > max)
+        max = other.max;
+}
+
+void LatencyHistogram::clear()
+{
+    *this = LatencyHistogram();
+}
+
+uint64_t LatencyHistogram::percentile(double p) const
+{
+    if (!count)
+        return 0;
+    uint64_t target = uint64_t(p * count / 100);
+    if (target >= count)
+        target = count - 1;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < BUCKET_COUNT; i++)
+    {
+        seen += buckets[i];
+        if (seen > target)
+            return std::min(bucket_limit(i), max);
+    }
+    return max;
+}
+
+uint64_t LatencyHistogram::mean() const
+{
+    return count ? sum / count : 0;
+}
+
+void LatencyHistogram::write_prometheus(std::ostream& f, const std::string& name, const std::string& labels) const
+{
+    static const uint64_t limits[] = {100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000};
+    std::string sep = labels.empty() ? "" : ",";
+    unsigned index = 0;
+    uint64_t cumulative = 0;
+    for (uint64_t limit : limits)
+    {
+        while (index < BUCKET_COUNT && bucket_limit(index) <= limit)
+            cumulative += buckets[index++];
+        f << name << "_bucket{" << labels << sep << "le=\"" << (limit / 1e6) << "\"} " << cumulative << "\n";
+    }
+    f << name << "_bucket{" << labels << sep << "le=\"+Inf\"} " << count << "\n";
+    f << name << "_sum{" << labels << "} " << (sum / 1e6) << "\n";
+    f << name << "_count{" << labels << "} " << count << "\n";
+}
+
+const char* frame_stage_names[FRAME_STAGE_COUNT] = {"events", "sim", "network", "clipboard", "render_prep", "render", "text", "present", "audio", "save", "other"};
+
+void FrameStats::begin_frame()
+{
+    for (unsigned i = 0; i < FRAME_STAGE_COUNT; i++)
+        stage_time[i] = 0;
+    active = FRAME_STAGE_NONE;
+    frame_start = stats_time_us();
+}
+
+void FrameStats::end_frame(uint64_t budget)
+{
+    int64_t frame_time = stats_time_us() - frame_start;
+    int64_t accounted = 0;
+    for (unsigned i = 0; i < FRAME_STAGE_OTHER; i++)
+        accounted += stage_time[i];
+    stage_time[FRAME_STAGE_OTHER] = std::max(frame_time - accounted, int64_t(0));
+
+    if (window_frames >= FRAME_WINDOW)
+    {
+        window ^= 1;
+        window_frames = 0;
+        for (unsigned i = 0; i < FRAME_STAGE_COUNT; i++)
+            stage_histograms[window][i].clear();
+        frame_histograms[window].clear();
+    }
+    window_frames++;
+
+    FrameRecord& record = history[frames % FRAME_HISTORY];
+    record.frame_time = frame_time;
+    unsigned slowest = 0;
+    for (unsigned i = 0; i < FRAME_STAGE_COUNT; i++)
+    {
+        uint64_t t = std::max(stage_time[i], int64_t(0));
+        stage_histograms[window][i].add(t);
+        record.stage_time[i] = t;
+        if (stage_time[i] > stage_time[slowest])
+            slowest = i;
+    }
+    frame_histograms[window].add(frame_time);
+    frames++;
+    if (history_count < FRAME_HISTORY)
+        history_count++;
+
+    if (uint64_t(frame_time) > budget)
+    {
+        slow_frames++;
+        slow_by_stage[slowest]++;
+    }
+}
+
+LatencyHistogram FrameStats::stage_histogram(FrameStage stage) const
+{
+    LatencyHistogram histogram = stage_histograms[0][stage];
+    histogram.merge(stage_histograms[1][stage]);
+    return histogram;
+}
+
+LatencyHistogram FrameStats::frame_histogram() const
+{
+    LatencyHistogram histogram = frame_histograms[0];
+    histogram.merge(frame_histograms[1]);
+    return histogram;
+}
+
+void FrameStats::write_csv(const std::string& summary_filename, const std::string& history_filename) const
+{
+    std::ofstream f(summary_filename.c_str());
+    f << "stage,mean_us,p50_us,p90_us,p99_us,max_us,slow_frames\n";
+    for (unsigned i = 0; i <= FRAME_STAGE_COUNT; i++)
+    {
+        LatencyHistogram histogram = i < FRAME_STAGE_COUNT ? stage_histogram(FrameStage(i)) : frame_histogram();
+        f << (i < FRAME_STAGE_COUNT ? frame_stage_names[i] : "frame") << "," << histogram.mean() << "," << histogram.percentile(50) << ","
+          << histogram.percentile(90) << "," << histogram.percentile(99) << "," << histogram.max << ","
+          << (i < FRAME_STAGE_COUNT ? slow_by_stage[i] : slow_frames) << "\n";
+    }
+
+
+    std::ofstream h(history_filename.c_str());
+    h << "frame,frame_us";
+    for (unsigned i = 0; i < FRAME_STAGE_COUNT; i++)
+        h << "," << frame_stage_names[i] << "_us";
+    h << "\n";
+    for (uint64_t n = frames - history_count; n < frames; n++)
+    {
+        const FrameRecord& record = history[n % FRAME_HISTORY];
+        h << n << "," << record.frame_time;
+        for (unsigned i = 0; i < FRAME_STAGE_COUNT; i++)
+            h << "," << record.stage_time[i];
+        h << "\n";
+    }
+}
+
+class StartupRecord
+{
+public:
+    const char* name;
+    uint64_t start;
+    uint64_t duration;
+    unsigned thread;
+};
+
+class StartupLog
+{
+public:
+    std::mutex mutex;
+    std::vector<StartupRecord> records;
+    unsigned thread_count = 0;
+};
+
+// Phases are recorded from static initialisers too, so the log is built on
+// first use rather than relying on initialisation order.
+
+static StartupLog& startup_log()
+{
+    static StartupLog log;
+    return log;
+}
+
+StartupPhase::StartupPhase(const char* name_):
+    name(name_),
+    start(stats_time_us())
+{
+}
+
+StartupPhase::~StartupPhase()
+{
+    static thread_local unsigned thread = 0;
+    uint64_t duration = stats_time_us() - start;
+    StartupLog& log = startup_log();
+    std::lock_guard<std::mutex> lock(log.mutex);
+    if (!thread)
+        thread = ++log.thread_count;
+    log.records.push_back({name, start, duration, thread});
+}
+
+void startup_report()
+{
+    StartupLog& log = startup_log();
+    std::lock_guard<std::mutex> lock(log.mutex);
+    std::vector<StartupRecord> records = log.records;
+    std::sort(records.begin(), records.end(), [](const StartupRecord& a, const StartupRecord& b){return a.start < b.start;});
+    printf("startup: %.1f ms\n", stats_time_us() / 1000.0);
+    for (StartupRecord& record : records)
+        printf("  %-20s thread %u  at %8.1f ms  took %8.1f ms\n", record.name, record.thread, record.start / 1000.0, record.duration / 1000.0);
+}
@@ -0,0 +1,147 @@
+#pragma once
+#include <stdint.h>
+#include <iostream>
+#include <string>
+
+uint64_t stats_time_us();
+
+// Latency histogram with eight linear sub-buckets per power of two, so any
+// percentile is reported to within 12.5%.  Values are in microseconds.
+
+class LatencyHistogram
+{
+public:
+    static const unsigned SUB_BUCKETS = 8;
+    static const unsigned BUCKET_COUNT = 64 * SUB_BUCKETS;
+
+    uint64_t buckets[BUCKET_COUNT] = {};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+
+    void add(uint64_t value);
+    void merge(const LatencyHistogram& other);
+    void clear();
+    uint64_t percentile(double p) const;
+    uint64_t mean() const;
+
+    static unsigned bucket_index(uint64_t value);
+    static uint64_t bucket_limit(unsigned index);
+
+    void write_prometheus(std::ostream& f, const std::string& name, const std::string& labels) const;
+};
+
+class StatsTimer
+{
+public:
+    LatencyHistogram& histogram;
+    uint64_t start;
+
+    StatsTimer(LatencyHistogram& histogram_):
+        histogram(histogram_),
+        start(stats_time_us())
+    {}
+    ~StatsTimer()
+    {
+        histogram.add(stats_time_us() - start);
+    }
+};
+
+enum FrameStage
+{
+    FRAME_STAGE_EVENTS,
+    FRAME_STAGE_SIM,
+    FRAME_STAGE_NETWORK,
+    FRAME_STAGE_CLIPBOARD,
+    FRAME_STAGE_RENDER_PREP,
+    FRAME_STAGE_RENDER,
+    FRAME_STAGE_TEXT,
+    FRAME_STAGE_PRESENT,
+    FRAME_STAGE_AUDIO,
+    FRAME_STAGE_SAVE,
+    FRAME_STAGE_OTHER,
+    FRAME_STAGE_COUNT,
+    FRAME_STAGE_NONE = FRAME_STAGE_COUNT
+};
+
+extern const char* frame_stage_names[FRAME_STAGE_COUNT];
+
+// Per-stage frame timing.  Stage times are exclusive: a stage timed inside
+// another (text rasterisation inside render) is taken out of its parent, so
+// the stages of a frame add up to the frame time.  Histograms cover the
+// current and the previous window of FRAME_WINDOW frames.
+
+class FrameStats
+{
+public:
+    static const unsigned FRAME_WINDOW = 1000;
+    static const unsigned FRAME_HISTORY = 1024;
+
+    int64_t stage_time[FRAME_STAGE_COUNT] = {};
+    FrameStage active = FRAME_STAGE_NONE;
+    uint64_t frame_start = 0;
+
+    LatencyHistogram stage_histograms[2][FRAME_STAGE_COUNT];
+    LatencyHistogram frame_histograms[2];
+    unsigned window = 0;
+    unsigned window_frames = 0;
+
+    uint64_t frames = 0;
+    uint64_t slow_frames = 0;
+    uint64_t slow_by_stage[FRAME_STAGE_COUNT] = {};
+
+    class FrameRecord
+    {
+    public:
+        uint32_t frame_time;
+        uint32_t stage_time[FRAME_STAGE_COUNT];
+    } history[FRAME_HISTORY];
+    unsigned history_count = 0;
+
+    void begin_frame();
+    void end_frame(uint64_t budget);
+    LatencyHistogram stage_histogram(FrameStage stage) const;
+    LatencyHistogram frame_histogram() const;
+    void write_csv(const std::string& summary_filename, const std::string& history_filename) const;
+};
+
+class FrameStageTimer
+{
+public:
+    FrameStats& stats;
+    FrameStage stage;
+    FrameStage parent;
+    uint64_t start;
+
+    FrameStageTimer(FrameStats& stats_, FrameStage stage_):
+        stats(stats_),
+        stage(stage_),
+        parent(stats_.active),
+        start(stats_time_us())
+    {
+        stats.active = stage;
+    }
+    ~FrameStageTimer()
+    {
+        int64_t duration = stats_time_us() - start;
+        stats.stage_time[stage] += duration;
+        if (parent != FRAME_STAGE_NONE)
+            stats.stage_time[parent] -= duration;
+        stats.active = parent;
+    }
+};
+
+// Startup phase timing.  Phases may be timed on any thread; startup_report()
+// prints them in start order, relative to the first timestamp taken.
+
+class StartupPhase
+{
+public:
+    const char* name;
+    uint64_t start;
+
+    StartupPhase(const char* name_);
+    ~StartupPhase();
+};
+
+void startup_report();
@@ -0,0 +1,244 @@
+#include "Trace.h"
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+
+#define TRACE_BUFFER_SIZE 16384
+
+struct TraceEvent
+{
+    const char* name;
+    uint64_t start;
+    uint64_t duration;
+    unsigned tid;
+};
+
+// Each thread owns one ring buffer and is the only writer to it, so recording
+// a span is a couple of plain stores and a release of the head counter.  The
+// flush reads behind the writer and discards anything that may have been
+// overwritten while it was copying.  A buffer is handed on to the next thread
+// once its owner exits; each event carries the tid of the lane it was
+// recorded on, so reuse never moves old events.
+//
+// Lanes are what the export shows as threads.  A thread that names itself
+// takes over an idle lane of the same name, so short-lived threads such as
+// the save thread show up as one lane rather than a new one per run, and two
+// threads of the same name running at once get a lane each.  Idle unnamed
+// lanes are reused the same way.
+
+class TraceBuffer
+{
+public:
+    TraceEvent events[TRACE_BUFFER_SIZE];
+    std::atomic<uint64_t> head = 0;
+    std::atomic<bool> in_use = false;
+};
+
+class TraceLane
+{
+public:
+    unsigned tid;
+    std::string name;
+    bool live;
+};
+
+static void trace_release_lane(unsigned tid);
+
+class TraceThread
+{
+public:
+    TraceBuffer* buffer = NULL;
+    unsigned tid = 0;
+    ~TraceThread()
+    {
+        if (buffer)
+            buffer->in_use.store(false, std::memory_order_release);
+        if (tid)
+            trace_release_lane(tid);
+    }
+};
+
+static std::atomic<bool> trace_on = false;
+static std::string trace_filename;
+static std::chrono::steady_clock::time_point trace_epoch = std::chrono::steady_clock::now();
+
+static std::mutex trace_mutex;
+static std::vector<TraceBuffer*> trace_buffers;
+static std::vector<TraceLane> trace_lanes;
+
+static thread_local TraceThread trace_thread;
+
+static void trace_release_lane(unsigned tid)
+{
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    trace_lanes[tid - 1].live = false;
+}
+
+static TraceBuffer* trace_get_buffer()
+{
+    if (trace_thread.buffer)
+        return trace_thread.buffer;
+
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    TraceBuffer* buffer = NULL;
+    for (TraceBuffer* buf : trace_buffers)
+    {
+        bool expected = false;
+        if (buf->in_use.compare_exchange_strong(expected, true))
+        {
+            buffer = buf;
+            break;
+        }
+    }
+    if (!buffer)
+    {
+        buffer = new TraceBuffer;
+        buffer->in_use = true;
+        trace_buffers.push_back(buffer);
+    }
+    trace_thread.buffer = buffer;
+    if (!trace_thread.tid)
+    {
+        for (TraceLane& lane : trace_lanes)
+        {
+            if (!lane.live && lane.name.empty())
+            {
+                lane.live = true;
+                trace_thread.tid = lane.tid;
+                break;
+            }
+        }
+    }
+    if (!trace_thread.tid)
+    {
+        trace_lanes.push_back({unsigned(trace_lanes.size() + 1), std::string(), true});
+        trace_thread.tid = trace_lanes.size();
+    }
+    return buffer;
+}
+
+void trace_init()
+{
+    const char* filename = getenv("COMPRESSURE_TRACE");
+    if (!filename || !filename[0])
+        return;
+    trace_filename = filename;
+    trace_epoch = std::chrono::steady_clock::now();
+    trace_on = true;
+    trace_thread_name("main");
+}
+
+bool trace_enabled()
+{
+    return trace_on.load(std::memory_order_relaxed);
+}
+
+uint64_t trace_now()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - trace_epoch).count();
+}
+
+void trace_thread_name(const char* name)
+{
+    if (!trace_enabled())
+        return;
+    trace_get_buffer();
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    TraceLane& current = trace_lanes[trace_thread.tid - 1];
+    if (current.name == name)
+        return;
+    for (TraceLane& lane : trace_lanes)
+    {
+        if (!lane.live && lane.name == name)
+        {
+            current.live = false;
+            lane.live = true;
+            trace_thread.tid = lane.tid;
+            return;
+        }
+    }
+    if (current.name.empty())
+    {
+        current.name = name;
+        return;
+    }
+    current.live = false;
+    trace_lanes.push_back({unsigned(trace_lanes.size() + 1), name, true});
+    trace_thread.tid = trace_lanes.size();
+}
+
+TraceSpan::TraceSpan(const char* name_):
+    name(name_)
+{
+    if (trace_enabled())
+        start = trace_now();
+}
+
+TraceSpan::~TraceSpan()
+{
+    if (!trace_enabled() || !start)
+        return;
+    TraceBuffer* buffer = trace_get_buffer();
+    uint64_t head = buffer->head.load(std::memory_order_relaxed);
+    TraceEvent& event = buffer->events[head % TRACE_BUFFER_SIZE];
+    event.name = name;
+    event.start = start;
+    event.duration = trace_now() - start;
+    event.tid = trace_thread.tid;
+    buffer->head.store(head + 1, std::memory_order_release);
+}
+
+void trace_flush()
+{
+    if (!trace_enabled())
+        return;
+    std::vector<TraceEvent> events;
+    std::vector<TraceLane> lanes;
+    {
+        std::lock_guard<std::mutex> lock(trace_mutex);
+        lanes = trace_lanes;
+        for (TraceBuffer* buf : trace_buffers)
+        {
+            uint64_t head = buf->head.load(std::memory_order_acquire);
+            uint64_t first = head > TRACE_BUFFER_SIZE ? head - TRACE_BUFFER_SIZE : 0;
+            size_t old_size = events.size();
+            for (uint64_t i = first; i < head; i++)
+                events.push_back(buf->events[i % TRACE_BUFFER_SIZE]);
+            uint64_t new_head = buf->head.load(std::memory_order_acquire);
+            if (new_head > TRACE_BUFFER_SIZE && new_head - TRACE_BUFFER_SIZE > first)
+            {
+                uint64_t torn = new_head - TRACE_BUFFER_SIZE - first;
+                if (torn > head - first)
+                    torn = head - first;
+                events.erase(events.begin() + old_size, events.begin() + old_size + torn);
+            }
+        }
+    }
+
+    std::ofstream outfile(trace_filename.c_str());
+    outfile << "{\"traceEvents\":[\n";
+    bool first = true;
+    for (TraceLane& lane : lanes)
+    {
+        if (lane.name.empty())
+            continue;
+        if (!first)
+            outfile << ",\n";
+        first = false;
+        outfile << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << lane.tid << ",\"args\":{\"name\":\"" << lane.name << "\"}}";
+    }
+    for (TraceEvent& event : events)
+    {
+        if (!first)
+            outfile << ",\n";
+        first = false;
+        outfile << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.tid
+                << ",\"ts\":" << event.start << ",\"dur\":" << event.duration << "}";
+    }
+    outfile << "\n]}\n";
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <stdint.h>
+
+// Chrome trace_event timeline export.  Tracing is off unless the
+// COMPRESSURE_TRACE environment variable names an output file; the file can
+// be loaded into chrome://tracing or https://ui.perfetto.dev.
+
+void trace_init();
+void trace_flush();
+bool trace_enabled();
+void trace_thread_name(const char* name);
+uint64_t trace_now();
+
+class TraceSpan
+{
+public:
+    const char* name;
+    uint64_t start = 0;
+
+    TraceSpan(const char* name_);
+    ~TraceSpan();
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) TraceSpan TRACE_CONCAT(trace_span_, __LINE__)(name)
@@ -0,0 +1,149 @@
+#include "Translation.h"
+#include "SaveState.h"
+#include "Compress.h"
+
+#include <algorithm>
+#include <sstream>
+
+void Translation::read(std::istream& f)
+{
+    std::stringstream stream;
+    stream << f.rdbuf();
+    std::string text = stream.str();
+
+    languages.clear();
+    SaveReader* reader = SaveReader::open(text.data(), text.size());
+    try
+    {
+        std::string_view key;
+        reader->begin_map();
+        while (reader->next_key(key))
+        {
+            languages.push_back(std::string(key));
+            reader->skip();
+        }
+    }
+    catch (const std::runtime_error& error)
+    {
+        delete reader;
+        throw;
+    }
+    delete reader;
+    data = compress_string(text, COMPRESS_REALTIME);
+    std::sort(languages.begin(), languages.end());
+    languages.erase(std::unique(languages.begin(), languages.end()), languages.end());
+}
+
+bool Translation::has_language(const std::string& name)
+{
+    return std::binary_search(languages.begin(), languages.end(), name);
+}
+
+static void read_screens(SaveReader& reader, std::vector<std::vector<Translation::DialogueScreen>>& levels)
+{
+    levels.clear();
+    reader.begin_list();
+    while (reader.next_item())
+    {
+        levels.emplace_back();
+        reader.begin_list();
+        while (reader.next_item())
+        {
+            Translation::DialogueScreen screen;
+            std::string_view key;
+            reader.begin_map();
+            while (reader.next_key(key))
+            {
+                if (key == "who")
+                    screen.who = reader.read_string();
+                else if (key == "text")
+                    screen.text = reader.read_string();
+                else
+                    reader.skip();
+            }
+            levels.back().push_back(screen);
+        }
+    }
+}
+
+void Translation::load(const std::string& name)
+{
+    std::fill(tooltip_set.begin(), tooltip_set.end(), false);
+    help.clear();
+    dialogue.clear();
+    hints.clear();
+    language = name;
+
+    std::string text = decompress_string(data);
+    SaveReader* reader = SaveReader::open(text.data(), text.size());
+    try
+    {
+        std::string_view key;
+        reader->begin_map();
+        while (reader->next_key(key))
+        {
+            if (key != name)
+            {
+                reader->skip();
+                continue;
+            }
+            reader->begin_map();
+            while (reader->next_key(key))
+            {
+                if (key == "tooltips")
+                {
+                    reader->begin_map();
+                    while (reader->next_key(key))
+                    {
+                        unsigned id = get_tooltip_id(key);
+                        tooltips[id] = reader->read_string();
+                        tooltip_set[id] = true;
+                    }
+                }
+                else if (key == "help")
+                {
+                    reader->begin_list();
+                    while (reader->next_item())
+                        help.push_back(std::string(reader->read_string()));
+                }
+                else if (key == "dialogue")
+                {
+                    read_screens(*reader, dialogue);
+                }
+                else if (key == "hints")
+                {
+                    read_screens(*reader, hints);
+                }
+                else
+                {
+                    reader->skip();
+                }
+            }
+        }
+    }
+    catch (const std::runtime_error& error)
+    {
+        delete reader;
+        throw;
+    }
+    delete reader;
+}
+
+unsigned Translation::get_tooltip_id(std::string_view key)
+{
+    std::unordered_map<std::string, unsigned>::iterator it = tooltip_ids.find(std::string(key));
+    if (it != tooltip_ids.end())
+        return it->second;
+    unsigned id = tooltips.size();
+    tooltip_ids[std::string(key)] = id;
+    tooltips.push_back(std::string());
+    tooltip_set.push_back(false);
+    return id;
+}
+
+const std::string* Translation::tooltip(unsigned id)
+{
+    if (id >= tooltips.size() || !tooltip_set[id])
+        return NULL;
+    return &tooltips[id];
+}
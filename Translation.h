@@ -0,0 +1,41 @@
+#pragma once
+#include <istream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// One language out of lang.json.  The file is kept compressed and only the
+// selected language is read out of it, into arrays indexed by level, help
+// page or tooltip id.  Tooltip keys get their ids the first time they are
+// seen and keep them when the language changes, so callers resolve a key
+// once and look it up by id from then on.
+
+class Translation
+{
+public:
+    class DialogueScreen
+    {
+    public:
+        std::string who;
+        std::string text;
+    };
+
+    std::string data;
+    std::vector<std::string> languages;
+    std::string language;
+
+    std::unordered_map<std::string, unsigned> tooltip_ids;
+    std::vector<std::string> tooltips;
+    std::vector<bool> tooltip_set;
+    std::vector<std::string> help;
+    std::vector<std::vector<DialogueScreen>> dialogue;
+    std::vector<std::vector<DialogueScreen>> hints;
+
+    void read(std::istream& f);
+    bool has_language(const std::string& name);
+    void load(const std::string& name);
+
+    unsigned get_tooltip_id(std::string_view key);
+    const std::string* tooltip(unsigned id);
+};
@@ -14,10 +14,16 @@
 #include <fstream>
 
 #include "GameState.h"
+#include "Compress.h"
 #include "Level.h"
+#include "Trace.h"
 
 #ifdef _WIN32
     #include <filesystem>
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <errno.h>
 #endif
 
 
@@ -107,48 +113,237 @@ void SteamGameManager::update_achievements(GameState* game_state)
 
 #endif
 
+static std::string save_dir;
 static std::string save_filename;
+static std::string journal_filename;
+
+// Periodic saves append the levels that changed to the journal; after this
+// many, and at exit, a full snapshot replaces the save and the journal.
+
+static const unsigned SAVE_JOURNAL_LIMIT = 30;
+
+static const int SAVE_EXIT_ATTEMPTS = 3;
+
+// The main thread only takes a snapshot of the game; the save thread
+// serialises it, compresses it and writes it out.
+
+class SaveJob
+{
+public:
+    SaveSnapshot* snapshot;
+    bool full;
+};
+
+static SaveJob* make_save_job(GameState* game_state, bool full)
+{
+    SaveJob* job = new SaveJob;
+    job->full = full;
+    if (full)
+        job->snapshot = game_state->save_snapshot();
+    else
+        job->snapshot = game_state->save_journal();
+    return job;
+}
+
+static bool append_journal(const std::string& comp)
+{
+#ifdef _WIN32
+    std::ofstream outfile (std::filesystem::path((char8_t*)journal_filename.c_str()), std::ios::binary | std::ios::app);
+#else
+    std::ofstream outfile (journal_filename.c_str(), std::ios::binary | std::ios::app);
+#endif
+    unsigned char header[4];
+    for (int i = 0; i < 4; i++)
+        header[i] = comp.size() >> (i * 8);
+    outfile.write((char*)header, 4);
+    outfile.write(comp.data(), comp.size());
+    outfile.flush();
+    return outfile.good();
+}
+
+// Cuts a torn record off the end of the journal, so later appends are not
+// lost behind it.
+
+static void truncate_journal(int64_t size)
+{
+#ifdef _WIN32
+    std::error_code ec;
+    std::filesystem::resize_file(std::filesystem::path((char8_t*)journal_filename.c_str()), size, ec);
+    if (ec)
+#else
+    if (truncate(journal_filename.c_str(), size))
+#endif
+        printf("could not truncate %s\n", journal_filename.c_str());
+}
+
+// The save is written under a temporary name, flushed to disk and renamed
+// over the old one, so a crash leaves either the old save or the new one.
+
+#ifdef _WIN32
+
+static bool write_save_file(const std::string& filename, const std::string& data)
+{
+    std::filesystem::path path((char8_t*)filename.c_str());
+    std::filesystem::path tmp_path((char8_t*)(filename + ".tmp").c_str());
+    FILE* f = _wfopen(tmp_path.c_str(), L"wbc");
+    if (!f)
+        return false;
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    ok = !fflush(f) && ok;
+    ok = !fclose(f) && ok;
+    std::error_code ec;
+    if (ok)
+        std::filesystem::rename(tmp_path, path, ec);
+    if (!ok || ec)
+    {
+        std::filesystem::remove(tmp_path, ec);
+        return false;
+    }
+    return true;
+}
+
+static void link_backup(const std::string& filename, const std::string& backup)
+{
+    std::filesystem::path path((char8_t*)filename.c_str());
+    std::filesystem::path backup_path((char8_t*)backup.c_str());
+    std::error_code ec;
+    std::filesystem::remove(backup_path, ec);
+    std::filesystem::create_hard_link(path, backup_path, ec);
+    if (ec)
+        std::filesystem::copy_file(path, backup_path, std::filesystem::copy_options::overwrite_existing, ec);
+}
+
+#else
+
+static bool write_save_file(const std::string& filename, const std::string& data)
+{
+    std::string tmp_filename = filename + ".tmp";
+    int fd = open(tmp_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    size_t pos = 0;
+    bool ok = true;
+    while (pos < data.size())
+    {
+        ssize_t got = write(fd, data.data() + pos, data.size() - pos);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+        {
+            ok = false;
+            break;
+        }
+        pos += got;
+    }
+    ok = ok && !fsync(fd);
+    ok = !close(fd) && ok;
+    if (!ok || rename(tmp_filename.c_str(), filename.c_str()))
+    {
+        unlink(tmp_filename.c_str());
+        return false;
+    }
+    int dir_fd = open(save_dir.c_str(), O_RDONLY);
+    if (dir_fd >= 0)
+    {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    return true;
+}
+
+// The save is only ever replaced by rename, never rewritten, so a hard link
+// keeps this version however many saves follow.
+
+static void link_backup(const std::string& filename, const std::string& backup)
+{
+    unlink(backup.c_str());
+    if (!link(filename.c_str(), backup.c_str()))
+        return;
+    std::ifstream infile(filename.c_str(), std::ios::binary);
+    std::ofstream outfile(backup.c_str(), std::ios::binary);
+    outfile << infile.rdbuf();
+}
+
+#endif
 
 static int save_thread_func(void *ptr)
 {
     static int save_index = 0;
-    SaveObject* omap = (SaveObject*)ptr;
+    SaveJob* job = (SaveJob*)ptr;
+    trace_thread_name("save_thread");
+    TRACE_SCOPE("save_thread_func");
+
+    SaveBinaryWriter writer;
+    job->snapshot->save(writer);
+    bool full = job->full;
+    delete job->snapshot;
+    delete job;
+    std::string comp = compress_string(writer.buf.data, COMPRESS_INTERACTIVE);
+
+    if (!full)
+    {
+        if (append_journal(comp))
+            return 0;
+        printf("could not write %s\n", journal_filename.c_str());
+        return 1;
+    }
 
-    std::string my_save_filename = save_filename + std::to_string(save_index);
+    if (!write_save_file(save_filename, comp))
+    {
+        printf("could not write %s\n", save_filename.c_str());
+        return 1;
+    }
+    link_backup(save_filename, save_filename + std::to_string(save_index));
+    save_index = (save_index + 1) % 10;
 
 #ifdef _WIN32
-    std::ofstream outfile1 (std::filesystem::path((char8_t*)save_filename.c_str()));
-    std::ofstream outfile2 (std::filesystem::path((char8_t*)my_save_filename.c_str()));
+    std::ofstream journal (std::filesystem::path((char8_t*)journal_filename.c_str()), std::ios::binary | std::ios::trunc);
 #else
-    std::ofstream outfile1 (save_filename.c_str());
-    std::ofstream outfile2 (my_save_filename.c_str());
+    std::ofstream journal (journal_filename.c_str(), std::ios::binary | std::ios::trunc);
 #endif
-    omap->save(outfile1);
-    omap->save(outfile2);
-    delete omap;
-    save_index = (save_index + 1) % 10;
     return 0;
 }
 
+// The save thread returns non-zero if the save did not reach the disk.  A
+// failed full save leaves snapshot_needed set, so the next save tries again.
+
+static bool finish_save(GameState* game_state, SDL_Thread*& save_thread, bool full)
+{
+    if (!save_thread)
+        return true;
+    int status = 0;
+    SDL_WaitThread(save_thread, &status);
+    save_thread = NULL;
+    game_state->save_finished(full, !status);
+    return !status;
+}
+
 void mainloop()
 {
     char* save_path = SDL_GetPrefPath("CharlieBrej", "ComPressure");
+    save_dir = save_path;
 #ifdef STEAM
     save_filename = std::string(save_path) + "compressure.save";
 #else
     save_filename = std::string(save_path) + "test_compressure.save";
 #endif
     SDL_free(save_path);
+    journal_filename = save_filename + ".journal";
 
     GameState* game_state;
     {
 #ifdef _WIN32
-        std::ifstream loadfile(std::filesystem::path((char8_t*)save_filename.c_str()));
+        std::ifstream loadfile(std::filesystem::path((char8_t*)save_filename.c_str()), std::ios::binary);
+        std::ifstream journalfile(std::filesystem::path((char8_t*)journal_filename.c_str()), std::ios::binary);
 #else
-        std::ifstream loadfile(save_filename.c_str());
+        std::ifstream loadfile(save_filename.c_str(), std::ios::binary);
+        std::ifstream journalfile(journal_filename.c_str(), std::ios::binary);
 #endif
-        game_state = new GameState(loadfile);
+        StartupPhase phase("game_state");
+        game_state = new GameState(loadfile, journalfile);
     }
+    if (game_state->journal_torn_at >= 0)
+        truncate_journal(game_state->journal_torn_at);
 #ifdef STEAM
     SteamGameManager steam_manager;
     game_state->set_steam_user(SteamUser()->GetSteamID().CSteamID::ConvertToUint64(), SteamFriends()->GetPersonaName());
@@ -161,12 +356,17 @@ void mainloop()
     }
 
 #endif
+    game_state->capabilities_fetch();
     int frame = 0;
     SDL_Thread *save_thread = NULL;
+    bool save_full = false;
+    StartupPhase* first_frame_phase = new StartupPhase("first_frame");
     
 	while(true)
 	{
+        TRACE_SCOPE("frame");
         unsigned oldtime = SDL_GetTicks();
+        game_state->frame_stats.begin_frame();
 		if (game_state->events())
             break;
         game_state->advance();
@@ -179,10 +379,12 @@ void mainloop()
         if (frame > 100 * 60)
         {
             game_state->render(true);
-            SaveObject* omap = game_state->save();
-            SDL_WaitThread(save_thread, NULL);
+            FrameStageTimer save_timer(game_state->frame_stats, FRAME_STAGE_SAVE);
+            finish_save(game_state, save_thread, save_full);
+            save_full = game_state->snapshot_needed || game_state->journal_records >= SAVE_JOURNAL_LIMIT;
+            SaveJob* job = make_save_job(game_state, save_full);
             game_state->save_to_server();
-            save_thread = SDL_CreateThread(save_thread_func, "save_thread", (void *)omap);
+            save_thread = SDL_CreateThread(save_thread_func, "save_thread", (void *)job);
             frame = 0;
         }
         else
@@ -190,16 +392,33 @@ void mainloop()
             game_state->render();
         }
         
+        game_state->frame_stats.end_frame(10000);
+        if (first_frame_phase)
+        {
+            delete first_frame_phase;
+            first_frame_phase = NULL;
+            startup_report();
+        }
         unsigned newtime = SDL_GetTicks();
         if ((newtime - oldtime) < 10)
             SDL_Delay(10 - (newtime - oldtime));
 	}
     SDL_HideWindow(game_state->sdl_window);
-    SDL_WaitThread(save_thread, NULL);
+    finish_save(game_state, save_thread, save_full);
     
-    SaveObject* omap = game_state->save();
-    save_thread = SDL_CreateThread(save_thread_func, "save_thread", (void *)omap);
-    SDL_WaitThread(save_thread, NULL);
+    // There is no next save to retry at exit, so try again now, and if the
+    // save file cannot be written keep everything in the journal instead.
+    bool saved = false;
+    for (int attempt = 0; !saved && attempt < SAVE_EXIT_ATTEMPTS; attempt++)
+    {
+        save_thread = SDL_CreateThread(save_thread_func, "save_thread", (void *)make_save_job(game_state, true));
+        saved = finish_save(game_state, save_thread, true);
+    }
+    if (!saved)
+    {
+        save_thread = SDL_CreateThread(save_thread_func, "save_thread", (void *)make_save_job(game_state, false));
+        finish_save(game_state, save_thread, false);
+    }
 
     game_state->save_to_server(true);
     delete game_state;
@@ -207,6 +426,7 @@ void mainloop()
 
 int main( int argc, char* argv[] )
 {
+    trace_init();
 #ifdef STEAM
 	if (SteamAPI_RestartAppIfNecessary(1528120))
 		return 1;
@@ -214,11 +434,14 @@ int main( int argc, char* argv[] )
 		return 1;
 #endif
 
-    SDL_Init(SDL_INIT_VIDEO| SDL_INIT_AUDIO);
-    IMG_Init(IMG_INIT_PNG);
-    SDLNet_Init();
-    TTF_Init();
-    Mix_Init(0);
+    {
+        StartupPhase phase("sdl_init");
+        SDL_Init(SDL_INIT_VIDEO| SDL_INIT_AUDIO);
+        IMG_Init(IMG_INIT_PNG);
+        SDLNet_Init();
+        TTF_Init();
+        Mix_Init(0);
+    }
     
     SDL_SetHint(SDL_HINT_MOUSE_FOCUS_CLICKTHROUGH, "1");
 
@@ -229,7 +452,7 @@ int main( int argc, char* argv[] )
     SDLNet_Quit();
 	IMG_Quit();
 	SDL_Quit();
-    delete level_desc;
+    trace_flush();
 
 
 #ifdef STEAM
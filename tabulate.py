@@ -0,0 +1,257 @@
+#!/usr/bin/python3
+
+# Turns Level.json into the tables in Level.tables, so the built-in levels
+# are compiled into the binary rather than parsed at startup.  Forced
+# elements and help designs are written in the binary save encoding.
+
+import sys
+
+class Parser:
+    # The same dialect SaveParser accepts: trailing commas, a UTF-8 BOM and
+    # backslash escapes where only \n is special.
+
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def skip_whitespace(self):
+        while self.pos < len(self.data):
+            c = self.data[self.pos]
+            if c in b' \t\n\r':
+                self.pos += 1
+            elif c == 0xEF:
+                self.pos += 3
+            else:
+                break
+
+    def peek(self):
+        return self.data[self.pos:self.pos + 1]
+
+    def expect(self, c):
+        if self.peek() != c:
+            raise ValueError("Unexpected character at %d" % self.pos)
+        self.pos += 1
+
+    def parse_string(self):
+        self.expect(b'"')
+        out = bytearray()
+        while True:
+            c = self.data[self.pos]
+            self.pos += 1
+            if c == ord('"'):
+                return bytes(out)
+            if c == ord('\\'):
+                c = self.data[self.pos]
+                self.pos += 1
+                if c == ord('n'):
+                    c = ord('\n')
+            out.append(c)
+
+    def parse(self):
+        self.skip_whitespace()
+        c = self.peek()
+        if c == b'{':
+            self.pos += 1
+            omap = {}
+            while True:
+                self.skip_whitespace()
+                if self.peek() == b'}':
+                    break
+                key = self.parse_string()
+                self.skip_whitespace()
+                self.expect(b':')
+                omap[key.decode()] = self.parse()
+                self.skip_whitespace()
+                if self.peek() == b'}':
+                    break
+                self.expect(b',')
+            self.expect(b'}')
+            return omap
+        if c == b'[':
+            self.pos += 1
+            olist = []
+            while True:
+                self.skip_whitespace()
+                if self.peek() == b']':
+                    break
+                olist.append(self.parse())
+                self.skip_whitespace()
+                if self.peek() == b']':
+                    break
+                self.expect(b',')
+            self.expect(b']')
+            return olist
+        if c == b'"':
+            return self.parse_string()
+        if self.data.startswith(b'null', self.pos):
+            self.pos += 4
+            return None
+        end = self.pos + 1
+        while end < len(self.data) and self.data[end] in b'0123456789':
+            end += 1
+        number = int(self.data[self.pos:end])
+        self.pos = end
+        return number
+
+# Matches SaveObject::to_binary for a tree read from text.
+
+SAVE_BINARY_NULL, SAVE_BINARY_NUMBER, SAVE_BINARY_STRING, SAVE_BINARY_LIST, SAVE_BINARY_MAP = range(5)
+
+class BinaryWriter:
+    def __init__(self):
+        self.buf = bytearray([0xC5, 2])
+        self.keys = {}
+
+    def put_varint(self, value):
+        while value >= 0x80:
+            self.buf.append((value & 0x7F) | 0x80)
+            value >>= 7
+        self.buf.append(value)
+
+    def put_string(self, value):
+        self.put_varint(len(value))
+        self.buf += value
+
+    def write(self, obj):
+        if obj is None:
+            self.buf.append(SAVE_BINARY_NULL)
+        elif isinstance(obj, int):
+            self.buf.append(SAVE_BINARY_NUMBER)
+            self.put_varint(((obj << 1) ^ (obj >> 63)) & 0xFFFFFFFFFFFFFFFF)
+        elif isinstance(obj, bytes):
+            self.buf.append(SAVE_BINARY_STRING)
+            self.put_string(obj)
+        elif isinstance(obj, list):
+            self.buf.append(SAVE_BINARY_LIST)
+            self.put_varint(len(obj))
+            for item in obj:
+                self.write(item)
+        else:
+            self.buf.append(SAVE_BINARY_MAP)
+            self.put_varint(len(obj))
+            for key in sorted(obj, key=lambda key: key.encode()):
+                if key in self.keys:
+                    self.put_varint(self.keys[key])
+                else:
+                    self.put_varint(0)
+                    self.put_string(key.encode())
+                    self.keys[key] = len(self.keys) + 1
+                self.write(obj[key])
+
+def to_binary(obj):
+    writer = BinaryWriter()
+    writer.write(obj)
+    return bytes(writer.buf)
+
+def c_string(data):
+    out = []
+    line = '"'
+    for c in data:
+        if c == ord('"') or c == ord('\\'):
+            line += '\\' + chr(c)
+        elif 32 <= c < 127:
+            line += chr(c)
+        else:
+            line += '\\%03o' % c
+        if len(line) > 100:
+            out.append(line + '"')
+            line = '"'
+    if line != '"' or not out:
+        out.append(line + '"')
+    return '\n        '.join(out)
+
+def c_text(data):
+    return 'NULL' if data is None else c_string(data)
+
+def c_blob(data):
+    return 'std::string_view(%s, %d)' % (c_string(data), len(data))
+
+def icon_rows(rows, width):
+    rows = [(row + [8] * width)[:width] for row in rows[:24]]
+    rows += [[8] * width] * (24 - len(rows))
+    return rows
+
+out = []
+def emit(line = ''):
+    out.append(line)
+
+def emit_array(ctype, name, items, width = ''):
+    if not items:
+        return 'NULL'
+    emit('static constexpr %s %s[]%s =' % (ctype, name, width))
+    emit('{')
+    for item in items:
+        emit('    %s,' % item)
+    emit('};')
+    emit()
+    return name
+
+with open(sys.argv[1], 'rb') as f:
+    levels = Parser(f.read()).parse()
+
+emit('// Generated from Level.json by tabulate.py, do not edit.')
+emit()
+
+descs = []
+for index, level in enumerate(levels):
+    prefix = 'level_desc_%d' % index
+    tests = []
+    for test_index, test in enumerate(level['tests']):
+        tested_direction = test.get('tested_direction', 1)
+        first_simpoint = test.get('first_simpoint', 0)
+        points = []
+        for point_index, point in enumerate(test['points']):
+            values = [point.get(d, 0) for d in ('N', 'E', 'S', 'W')]
+            force = [point.get(d + 'F', 0 if tested_direction == i else 50) for i, d in enumerate(('N', 'E', 'S', 'W'))]
+            if 'PRESET' in point:
+                first_simpoint = point_index + 1
+            points.append('SimPoint(%s)' % ', '.join(str(v) for v in values + force))
+        name = emit_array('SimPoint', '%s_test_%d_points' % (prefix, test_index), points)
+        tests.append('{Direction(%d), TestResetType(%d), %d, %s, %d}' % (tested_direction, test.get('reset', 0), first_simpoint, name, len(points)))
+    tests = emit_array('LevelDescTest', prefix + '_tests', tests)
+
+    elements = ['{%d, %d, %s}' % (e['x'], e['y'], c_blob(to_binary(e['element']))) for e in level.get('forced_elements', [])]
+    elements_name = emit_array('LevelDescElement', prefix + '_forced_elements', elements)
+
+    signs = ['{%d, %d, Direction(%d), %s}' % (s['pos.x'], s['pos.y'], s.get('direction', 0), c_string(s['text'])) for s in level.get('forced_signs', [])]
+    signs_name = emit_array('LevelDescSign', prefix + '_forced_signs', signs)
+
+    dialogue = ['{%s, %s}' % (c_string(d['who']), c_string(d['text'])) for d in level.get('dialogue', [])]
+    dialogue_name = emit_array('LevelDescDialogue', prefix + '_dialogue', dialogue)
+    hints = ['{%s, %s}' % (c_string(d['who']), c_string(d['text'])) for d in level.get('hints', [])]
+    hints_name = emit_array('LevelDescDialogue', prefix + '_hints', hints)
+
+    icon_bg = 'NULL'
+    if 'icon_bg' in level:
+        rows = icon_rows(level['icon_bg'], 24)
+        icon_bg = emit_array('uint8_t', prefix + '_icon_bg', ['{%s}' % ','.join(map(str, row)) for row in rows], '[24]')
+    icon = 'NULL'
+    if 'icon' in level:
+        rows = icon_rows(level['icon'], 24 * 8)
+        icon = emit_array('uint8_t', prefix + '_icon', ['{%s}' % ','.join(map(str, row)) for row in rows], '[24 * 8]')
+
+    help_design = c_blob(to_binary(level['help_design'])) if 'help_design' in level else 'std::string_view()'
+
+    descs.append('\n'.join([
+        '    {',
+        '        %s,' % c_string(level['name']),
+        '        %s,' % c_text(level.get('description')),
+        '        %s,' % ('true' if 'global' in level else 'false'),
+        '        %d, %d,' % (level['substep_count'], level['level_version']),
+        '        {%s}, %d,' % (', '.join(map(str, level['connections'])), len(level['connections'])),
+        '        %s, %d,' % (tests, len(level['tests'])),
+        '        %s, %d,' % (elements_name, len(elements)),
+        '        %s, %d,' % (signs_name, len(signs)),
+        '        %s, %d,' % (dialogue_name, len(dialogue)),
+        '        %s, %d,' % (hints_name, len(hints)),
+        '        %s,' % icon_bg,
+        '        %s,' % icon,
+        '        %s' % help_design,
+        '    },']))
+
+emit('constexpr LevelDesc level_descs[LEVEL_COUNT] =')
+emit('{')
+out += descs
+emit('};')
+
+print('\n'.join(out))